@@ -20,22 +20,51 @@ appendBuffer newAppendBuffer() {
   return ap;
 }
 
+/// Wraps `len` bytes of null terminated memory owned by someone else (e.g. an
+/// arena). The buffer is copied into its own allocation the first time it
+/// needs to grow or change, and it is never freed by `abFree`.
+appendBuffer abBorrow(char *buf, size_t len) {
+  appendBuffer ab = {.buf = buf, .cap = 0, .len = len};
+
+  return ab;
+}
+
+/// Smallest power of 2 that is greater than or equal to `n`.
+size_t nextPowerOf2(size_t n) {
+  if (n <= 1)
+    return 1;
+
+  return (size_t)1 << (sizeof(size_t) * 8 - __builtin_clzl(n - 1));
+}
+
 /// Resize the buffer into the next power of 2 of `cap`.
 void abResize(appendBuffer *ab, size_t cap) {
-  size_t new_cap = 1 << (size_t)ceil(log2(cap + 1));
+  size_t new_cap = nextPowerOf2(cap + 1);
 
   if (ab->cap >= new_cap) {
     return;
   }
 
-  ab->buf = realloc(ab->buf, new_cap);
+  if (ab->cap == 0 && ab->buf != NULL) {
+    // Borrowed memory, take a copy of it.
+    char *buf = malloc(new_cap);
+    memcpy(buf, ab->buf, ab->len + 1);
+    ab->buf = buf;
+  } else {
+    ab->buf = realloc(ab->buf, new_cap);
+  }
   ab->cap = new_cap;
 }
 
-/// Inserts the given string to the end of the buffer.
-void abAppend(appendBuffer *ab, const char *s) {
-  size_t extra_needed = strlen(s);
+/// Takes a copy of borrowed memory before it is changed in place, the owner
+/// may share it with others.
+void abOwn(appendBuffer *ab) {
+  if (ab->cap == 0 && ab->buf != NULL)
+    abResize(ab, ab->len);
+}
 
+/// Inserts the first `extra_needed` bytes of `s` to the end of the buffer.
+void abAppendN(appendBuffer *ab, const char *s, size_t extra_needed) {
   if (extra_needed == 0) {
     return;
   }
@@ -51,6 +80,11 @@ void abAppend(appendBuffer *ab, const char *s) {
   ab->buf[ab->len] = '\0'; // Null terminated
 }
 
+/// Inserts the given string to the end of the buffer.
+void abAppend(appendBuffer *ab, const char *s) {
+  abAppendN(ab, s, strlen(s));
+}
+
 /// Inserts the provided char at the end of the buffer.
 void abAppendChar(appendBuffer *ab, char c) {
   size_t new_len = ab->len + 1;
@@ -69,6 +103,7 @@ char abPop(appendBuffer *ab) {
   char out = '\0';
 
   if (ab->len != 0) {
+    abOwn(ab);
     ab->len -= 1;
     out = ab->buf[ab->len];
     ab->buf[ab->len] = '\0';
@@ -79,8 +114,8 @@ char abPop(appendBuffer *ab) {
 
 /// Copies all the contents of the `src` buffer into the `dst` buffer.
 void abCopyInto(appendBuffer *src, appendBuffer *dst) {
-  if (dst->cap < src->cap) {
-    abResize(dst, src->cap + 1);
+  if (dst->cap <= src->len) {
+    abResize(dst, src->len + 1);
   }
 
   memcpy(dst->buf, src->buf, src->len);
@@ -91,9 +126,10 @@ void abCopyInto(appendBuffer *src, appendBuffer *dst) {
 /// Clears the contents of the appendBuffer while keeping the allocated buffer
 /// intact and ready to reused.
 void abClear(appendBuffer *ab) {
+  abOwn(ab);
   ab->len = 0;
 
-  if (ab->cap >= 1)
+  if (ab->buf != NULL)
     ab->buf[0] = '\0'; // Null terminated
 }
 
@@ -114,6 +150,44 @@ void abInsertAt(appendBuffer *r, size_t at, size_t c) {
   // TODO does this move the null terminated char? I think so.
 }
 
+/// Inserts `len` bytes of `s` at the requested position in the buffer, with a
+/// single shift of the elements after `at`.
+void abInsertN(appendBuffer *ab, size_t at, const char *s, size_t len) {
+  if (at > ab->len)
+    at = ab->len;
+
+  if (ab->cap <= ab->len + len)
+    abResize(ab, ab->len + len);
+
+  memmove(&ab->buf[at + len], &ab->buf[at], ab->len - at + 1);
+  memcpy(&ab->buf[at], s, len);
+  ab->len += len;
+}
+
+/// Removes `n` elements starting at the requested position in the buffer, with
+/// a single shift of the elements after them.
+void abRemoveRange(appendBuffer *ab, size_t at, size_t n) {
+  if (at >= ab->len || n == 0)
+    return;
+
+  if (n > ab->len - at)
+    n = ab->len - at;
+
+  abOwn(ab);
+  memmove(&ab->buf[at], &ab->buf[at + n], ab->len - at - n + 1);
+  ab->len -= n;
+}
+
+/// Drops everything in the buffer after the first `len` elements.
+void abTruncate(appendBuffer *ab, size_t len) {
+  if (len >= ab->len)
+    return;
+
+  abOwn(ab);
+  ab->len = len;
+  ab->buf[len] = '\0'; // Null terminated
+}
+
 /// Removes the element that is at the requested position in the buffer.
 /// Beware that this is a O(N) operations, as all the elements from `at` to the
 /// end need to be shifted.
@@ -121,10 +195,14 @@ void abRemoveAt(appendBuffer *ab, size_t at) {
   if (at >= ab->len)
     return;
 
+  abOwn(ab);
   memmove(&ab->buf[at], &ab->buf[at + 1], ab->len - at);
   ab->len--;
   // TODO does this move the null terminated char? I think so.
 }
 
 /// Frees the resources used by the buffer.
-void abFree(appendBuffer *ab) { free(ab->buf); }
+void abFree(appendBuffer *ab) {
+  if (ab->cap != 0)
+    free(ab->buf);
+}
@@ -3,7 +3,9 @@
 #pragma once
 
 #include "appendBuffer.c"
+#include "utf8.c"
 #include <stdint.h>
+#include <sys/stat.h>
 #include <termios.h>
 #include <unistd.h>
 
@@ -13,6 +15,10 @@
 #define TAB_STOP 4
 #define STATUS_MSG_TIMEOUT 5
 #define QUIT_TIMES 2
+#define BURST_BUDGET_MS 50
+#define CURSOR_REPLY_MS 100 // For each byte of where the terminal says it is.
+#define LONG_LINE (128 << 10)  // Rows from this size on are laid out in chunks.
+#define LINE_CHUNK (32 << 10) // Bytes per chunk of a long line.
 
 typedef enum editorKey {
   BACKSPACE = 127,
@@ -25,7 +31,8 @@ typedef enum editorKey {
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  PASTE // Bracketed paste, the text is in `inputPaste()`.
 } editorKey;
 
 typedef enum editorHighlight {
@@ -37,10 +44,24 @@ typedef enum editorHighlight {
 typedef enum Mode { NORMAL, INSERT } Mode;
 
 /*** data ***/
+/// What is known about the layout of a row, see `rowLayout`.
+typedef enum rowFlags {
+  ROW_LAID_OUT = 1, // `width` and the other flags are up to date.
+  ROW_ASCII = 2,    // One byte per char, so one column per byte of render.
+  ROW_TABS = 4,
+  ROW_WIDE = 8, // Has chars two columns wide.
+} rowFlags;
+
 typedef struct row {
   appendBuffer chars;
   appendBuffer render;
-  uint8_t *hl; // Highlight information. TODO use a bitset.
+  uint8_t *hl; // Highlight information, NULL if there is none. TODO use a
+               // bitset.
+  uint32_t width; // Columns the render takes.
+  uint8_t flags;
+  struct lineIndex *index; // Chunks of long lines, they have no render.
+  struct rowStore *shared; // Register the chars are borrowed from, or NULL.
+  uint64_t *words; // Where words start and end, NULL until a motion needs it.
 } row;
 
 row new_row() {
@@ -51,6 +72,95 @@ row new_row() {
   return r;
 }
 
+/// What a file on disk is like, to notice when it changes.
+typedef struct fileStamp {
+  uint64_t size;
+  uint64_t mtime_ns;
+  uint64_t inode;
+  uint64_t device;
+} fileStamp;
+
+fileStamp fileStampOf(const struct stat *st) {
+  return (fileStamp){
+      .size = st->st_size,
+      .mtime_ns =
+          (uint64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec,
+      .inode = st->st_ino,
+      .device = st->st_dev,
+  };
+}
+
+uint_fast8_t fileStampEqual(fileStamp a, fileStamp b) {
+  return a.size == b.size && a.mtime_ns == b.mtime_ns && a.inode == b.inode &&
+         a.device == b.device;
+}
+
+/// A position in the text of the file, `x` is an index into `chars`.
+typedef struct textPos {
+  size_t y;
+  size_t x;
+} textPos;
+
+/// A file being edited, with its rows and where it is looked at. Only the
+/// buffer in `E.buf` is shown and edited, the others wait as they were left.
+typedef struct buffer {
+  // Cursor Position
+  uint_fast32_t cx;
+  uint_fast32_t cy;
+
+  // File contents, line by line
+  uint_fast32_t num_rows;
+  uint_fast32_t rows_cap;
+  row *rows;
+
+  // Reads the file in the background, NULL once it is fully loaded.
+  struct fileLoader *loader;
+  fileStamp file_stamp; // Of the file when it was loaded, saved or reloaded.
+
+  // What the rows read from the file borrow their chars from, NULL once none
+  // of them do.
+  struct rowText *text;
+
+  // Notices when the file changes on disk, NULL when it's not watched.
+  struct fileWatch *watch;
+
+  // Appends what is written to the file, NULL when not following it.
+  struct follow *follow;
+
+  // Visual lines of the rows when soft wrap is on, NULL otherwise.
+  struct wrapIndex *wrap;
+
+  // Changes that can be undone, NULL until the first one.
+  struct undoLog *undo;
+
+  // Words of the file for completion, NULL until the first one.
+  struct completeIndex *complete;
+
+  // Read only view of a mapped file, with no rows, NULL when editing.
+  struct pager *pager;
+
+  // Search whose hits are the rows, NULL for the buffers of files.
+  struct grepSearch *grep;
+
+  // What changed from the file on disk, NULL when it's not shown.
+  struct diffView *diff;
+
+  // Where the file was left last time, until the rows get there.
+  struct openState *reopen;
+
+  // Current view posiiton
+  int_fast32_t row_offset;
+  int_fast32_t col_offset;
+
+  char *filename;
+
+  // State Flags
+  uint_fast8_t dirty;
+  uint_fast8_t opened;   // The file was read, or it is new. See `bufferShow`.
+  uint_fast8_t released; // Dropped its layout while it wasn't shown.
+  uint64_t hidden_ms;    // When it stopped being shown.
+} buffer;
+
 /// Holds all the state of the editor.
 struct editorConfig {
   struct termios orig_termios;
@@ -65,48 +175,85 @@ struct editorConfig {
   // Left margin width
   uint_fast32_t left_margin;
 
-  // Cursor Position
-  uint_fast32_t cx;
-  uint_fast32_t cy;
-
   // Cursor Render Position
   uint_fast32_t rx;
 
-  // File contents, line by line
-  uint_fast32_t num_rows;
-  row *rows;
-
-  // Current view posiiton
-  int_fast32_t row_offset;
-  int_fast32_t col_offset;
+  // The file shown, the others are in `Buffers`.
+  buffer *buf;
 
   // Status bar stuff
-  char *filename;
   appendBuffer status_msg;
   time_t status_msg_time;
 
   // State Flags
-  uint_fast8_t dirty;
+  uint_fast8_t headless; // No terminal, keys come from a script.
+  uint_fast8_t hud;      // Show frame statistics in the status bar.
   Mode mode;
+
+  // Output statistics
+  uint64_t frames;
+  uint64_t bytes_written;
+  uint64_t last_frame_ns;
+  uint64_t last_frame_bytes;
 };
 
 struct editorConfig E = {0};
 
-uint_fast32_t getCy() { return (E.cy - E.row_offset); }
-uint_fast32_t getCx() { return (E.rx - E.col_offset); }
+uint_fast32_t getCy() { return (E.buf->cy - E.buf->row_offset); }
+uint_fast32_t getCx() { return (E.rx - E.buf->col_offset); }
 
 /*** prototypes ***/
+void die(const char *s);
+void editorWrite(const char *buf, size_t len);
+void getWindowSize();
 char *editorPrompt(char *prompt, void (*callback)(char *, size_t));
 void editorDelChar();
 void editorFind();
 void editorInsertChar(size_t c);
+void editorInsertText(const char *s, size_t len);
 void editorInsertNewline();
 void editorRefreshScreen();
 void editorSave();
 void moveCursor(uint64_t key);
-void rowDelChar(row *row, size_t at);
-void rowInsertChar(row *row, size_t at, size_t c);
 void setStatusMessage(const char *fmt, ...);
 void updateRow(row *r);
-void editorRowAppendString(row *src, row *dst);
+void rowLayout(row *r);
+size_t rowRenderChars(const char *s, size_t len, size_t col, char *out,
+                      size_t *cols, uint8_t *flags);
+size_t editorRowNextChar(row *row, size_t cx);
+uint64_t readKey();
+textPos editorReplaceRange(textPos from, textPos to, const char *s, size_t len);
 void editorDelRow(size_t at);
+void editorDelRows(size_t at, size_t n);
+void editorDeleteRange(textPos from, textPos to);
+textPos editorInsertTextAt(textPos at, const char *s, size_t len);
+void editorJoinLines();
+row *editorSpliceRows(size_t at, size_t remove, size_t insert);
+uint_fast8_t rowIsLong(row *r);
+size_t editorMiddleRow();
+uint_fast32_t editorTextCols();
+size_t numDigits(uint64_t n);
+void add_line_number(appendBuffer *ab, uint_fast32_t line, size_t width);
+void editorDrawChars(appendBuffer *ab, const char *s, size_t len, size_t i,
+                     size_t col, size_t offset, size_t cols);
+void wrapToggle();
+void followToggle();
+void editorLoadStart(int fd);
+uint_fast8_t followCheck();
+uint_fast8_t reloadCheck();
+uint_fast8_t editorReload();
+void undoRecord(size_t at, size_t remove, size_t insert);
+void undoBreak();
+void undoPause(uint_fast8_t paused);
+void undoForget();
+void editorUndo();
+void editorRedo();
+void editorExPrompt();
+void processKey(uint64_t c);
+void editorFreeRow(row *row);
+uint_fast8_t normalPending();
+void grepHide(buffer *b);
+void grepResume(buffer *b);
+void diffChanging(size_t at, size_t remove, size_t insert);
+void openStateRestore();
+void openStateApply();
@@ -0,0 +1,182 @@
+// Headless benchmark: replays a script of keys against a file on a virtual
+// screen and reports how long each key took to handle and draw.
+//
+//   make bench && ./bench [-s COLSxROWS] script.keys file
+//
+// The script holds the bytes a terminal would send. New lines are ignored so
+// scripts can be split in lines, and these escapes are understood:
+//   \e (ESC)  \r (Enter)  \t  \n  \\  \xHH
+// e.g. `jjjjGggi// Hello\e` or `/needle\r\e[B\e[B\r`.
+
+#define FIRE_NO_MAIN
+#include "fire.c"
+
+struct benchStats {
+  uint64_t *latencies; // Nanoseconds it took to handle and draw each key.
+  size_t num_ops;
+  size_t cap_ops;
+
+  uint64_t load_ns;
+  uint64_t replay_start;
+  uint64_t replay_ns;
+};
+
+struct benchStats Bench = {0};
+
+int hexDigit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+
+  return -1;
+}
+
+/// Reads a key script, translating its escapes into the bytes they stand for.
+appendBuffer readKeyScript(const char *path) {
+  FILE *fp = fopen(path, "r");
+
+  if (!fp)
+    die("fopen");
+
+  appendBuffer keys = newAppendBuffer();
+  int c = 0;
+
+  while ((c = fgetc(fp)) != EOF) {
+    if (c == '\n')
+      continue;
+
+    if (c == '\\') {
+      switch (c = fgetc(fp)) {
+      case 'e':
+        c = ESC;
+        break;
+      case 'r':
+        c = '\r';
+        break;
+      case 't':
+        c = '\t';
+        break;
+      case 'n':
+        c = '\n';
+        break;
+      case 'x': {
+        int hi = hexDigit(fgetc(fp));
+        int lo = hexDigit(fgetc(fp));
+
+        if (hi == -1 || lo == -1) {
+          fprintf(stderr, "bench: bad \\x escape in %s\n", path);
+          exit(1);
+        }
+        c = hi << 4 | lo;
+      } break;
+      case EOF:
+        c = '\\';
+        break;
+      }
+    }
+
+    abAppendChar(&keys, c);
+  }
+
+  fclose(fp);
+  return keys;
+}
+
+int compareU64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+double percentileUs(double p) {
+  if (Bench.num_ops == 0)
+    return 0;
+
+  size_t idx = (size_t)(p * (Bench.num_ops - 1) + 0.5);
+  return Bench.latencies[idx] / 1000.0;
+}
+
+/// Printed at exit, so scripts can also end by quitting the editor.
+void benchReport() {
+  if (Bench.replay_ns == 0)
+    Bench.replay_ns = nowNs() - Bench.replay_start;
+
+  qsort(Bench.latencies, Bench.num_ops, sizeof(uint64_t), compareU64);
+
+  printf("file: %s\n", E.buf->filename ? E.buf->filename : "[No Name]");
+  printf("rows: %lu\n", (unsigned long)E.buf->num_rows);
+  printf("screen: %lux%lu\n", (unsigned long)E.screen_cols,
+         (unsigned long)E.screen_rows + 2);
+  printf("load_ms: %.3f\n", Bench.load_ns / 1e6);
+  printf("replay_ms: %.3f\n", Bench.replay_ns / 1e6);
+  printf("ops: %zu\n", Bench.num_ops);
+  printf("latency_us: p50 %.2f p90 %.2f p99 %.2f max %.2f\n",
+         percentileUs(0.50), percentileUs(0.90), percentileUs(0.99),
+         percentileUs(1.0));
+  printf("frames: %lu\n", (unsigned long)E.frames);
+  printf("bytes_written: %lu\n", (unsigned long)E.bytes_written);
+  printf("bytes_per_frame: %.1f\n",
+         E.frames ? (double)E.bytes_written / E.frames : 0.0);
+}
+
+void usage() {
+  fprintf(stderr, "usage: bench [-s COLSxROWS] script.keys [file]\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long cols = 80;
+  unsigned long rows = 24;
+  int opt = 0;
+
+  while ((opt = getopt(argc, argv, "s:")) != -1) {
+    if (opt != 's' || sscanf(optarg, "%lux%lu", &cols, &rows) != 2 ||
+        rows < 3)
+      usage();
+  }
+
+  if (optind >= argc)
+    usage();
+
+  appendBuffer keys = readKeyScript(argv[optind]);
+
+  E.headless = 1;
+  E.screen_cols = cols;
+  E.screen_rows = rows;
+  initEditor();
+
+  if (optind + 1 < argc) {
+    uint64_t start = nowNs();
+    editorOpen(argv[optind + 1]);
+
+    while (E.buf->loader)
+      eventWait(-1);
+    Bench.load_ns = nowNs() - start;
+  }
+
+  atexit(benchReport);
+  inputSetScript(keys.buf, keys.len);
+
+  Bench.replay_start = nowNs();
+  editorRefreshScreen();
+
+  while (inputHasKey()) {
+    uint64_t op_start = nowNs();
+    processKeypress();
+    editorRefreshScreen();
+
+    if (Bench.num_ops == Bench.cap_ops) {
+      Bench.cap_ops = Bench.cap_ops ? Bench.cap_ops * 2 : 1024;
+      Bench.latencies =
+          realloc(Bench.latencies, sizeof(uint64_t) * Bench.cap_ops);
+    }
+    Bench.latencies[Bench.num_ops++] = nowNs() - op_start;
+  }
+  Bench.replay_ns = nowNs() - Bench.replay_start;
+
+  return 0;
+}
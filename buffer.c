@@ -0,0 +1,235 @@
+#pragma once
+
+#include "base.c"
+#include "diff.c"
+#include "event.c"
+#include "loader.c"
+#include "undo.c"
+#include "watch.c"
+#include "word.c"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*** buffers ***/
+#define BUFFER_IDLE_MS 30000 // Hidden this long, a buffer drops its layout.
+
+/// Every file open. Switching between them only swaps `E.buf`: the rows,
+/// the cursor and the view stay in the buffer that is hidden, and the reads
+/// and watches of its file wait until it is shown again.
+struct buffers {
+  buffer **list;
+  size_t len;
+  size_t cap;
+  uint_fast8_t idle_timer; // Whether `buffersReleaseIdle` is due to run.
+};
+
+struct buffers Buffers = {0};
+
+/// Adds a buffer for `filename`, which is read when it is first shown. The
+/// first one is the buffer the editor starts with.
+buffer *bufferAdd(const char *filename) {
+  buffer *b = calloc(1, sizeof(buffer));
+
+  b->filename = filename ? strdup(filename) : NULL;
+  b->opened = filename == NULL;
+
+  if (Buffers.len == Buffers.cap) {
+    Buffers.cap = Buffers.cap ? Buffers.cap * 2 : 8;
+    Buffers.list = realloc(Buffers.list, sizeof(buffer *) * Buffers.cap);
+  }
+  Buffers.list[Buffers.len++] = b;
+
+  return b;
+}
+
+/// Position of the buffer in the list, from 0.
+size_t bufferIndex(buffer *b) {
+  size_t i = 0;
+
+  while (i < Buffers.len && Buffers.list[i] != b)
+    i++;
+
+  return i;
+}
+
+/// The buffer of `filename`, NULL if it is not open.
+buffer *bufferFind(const char *filename) {
+  for (size_t i = 0; i < Buffers.len; i++)
+    if (Buffers.list[i]->filename &&
+        strcmp(Buffers.list[i]->filename, filename) == 0)
+      return Buffers.list[i];
+
+  return NULL;
+}
+
+/// A buffer with changes that are not saved, NULL if there is none.
+buffer *buffersModified() {
+  for (size_t i = 0; i < Buffers.len; i++)
+    if (Buffers.list[i]->dirty)
+      return Buffers.list[i];
+
+  return NULL;
+}
+
+/// Drops what is kept of the rows to draw them, they are laid out again
+/// when shown, like rows fresh from the loader. Renders of their own become
+/// the chars again, the highlights and the word bitmaps go, and so does the
+/// text of the file if no row borrows from it anymore.
+void bufferRelease(buffer *b) {
+  for (size_t i = 0; i < b->num_rows; i++) {
+    row *r = &b->rows[i];
+
+    if (r->render.cap != 0) {
+      abFree(&r->render);
+      r->render = abBorrow(r->chars.buf, r->chars.len);
+      r->flags = 0;
+    }
+
+    free(r->hl);
+    r->hl = NULL;
+    rowWordsFree(r);
+  }
+
+  rowTextDrop(b);
+  b->released = 1;
+}
+
+/// Releases the buffers hidden for long enough, and comes back later for
+/// the others.
+uint_fast8_t buffersReleaseIdle(int fd) {
+  (void)fd;
+  uint64_t now = nowMs();
+  uint64_t next = 0;
+
+  for (size_t i = 0; i < Buffers.len; i++) {
+    buffer *b = Buffers.list[i];
+
+    if (b == E.buf || b->released || !b->opened)
+      continue;
+
+    if (now - b->hidden_ms >= BUFFER_IDLE_MS) {
+      bufferRelease(b);
+    } else {
+      uint64_t left = BUFFER_IDLE_MS - (now - b->hidden_ms);
+      next = next == 0 || left < next ? left : next;
+    }
+  }
+
+  Buffers.idle_timer = next != 0;
+  if (next != 0)
+    eventSetTimer(buffersReleaseIdle, next);
+
+  return 0;
+}
+
+/// Stops listening for the file of the buffer while it is hidden. Its
+/// loader keeps reading, the rows wait for it to be shown.
+void bufferHide(buffer *b) {
+  if (b->loader)
+    eventUnwatch(b->loader->wake_fd);
+  if (b->watch) {
+    eventUnwatch(b->watch->inotify_fd);
+    b->watch->scheduled = 0;
+  }
+  grepHide(b);
+
+  b->hidden_ms = nowMs();
+}
+
+/// Takes in what happened to the file while it was hidden.
+void bufferResume(buffer *b) {
+  b->released = 0;
+
+  if (b->loader) {
+    eventWatch(b->loader->wake_fd, loaderWoken);
+    editorLoadPoll();
+  }
+  if (b->watch) {
+    eventWatch(b->watch->inotify_fd, watchEvents);
+    watchSchedule(WATCH_BATCH_MS); // The events while hidden are not known.
+  }
+  grepResume(b);
+  diffSchedule(); // It may have been edited, or saved, while hidden.
+}
+
+/// Starts reading the file of the buffer being shown. A file that doesn't
+/// exist yet is an empty buffer, created when saved.
+void bufferOpen(buffer *b) {
+  int fd = open(b->filename, O_RDONLY);
+
+  b->opened = 1;
+  if (fd == -1) {
+    if (errno == ENOENT)
+      setStatusMessage("\"%s\" [New]", b->filename);
+    else
+      setStatusMessage("Can't open %s: %s", b->filename, strerror(errno));
+    return;
+  }
+
+  editorLoadStart(fd);
+  watchStart();
+}
+
+/// Shows `b` instead of the current buffer, as it was left.
+void bufferShow(buffer *b) {
+  if (b == E.buf)
+    return;
+
+  // The command that switched goes on in the new buffer, like a macro. Its
+  // edits there are undone together, as the ones here were.
+  size_t grouping = undoLog()->grouping;
+  undoLog()->grouping = 0;
+  bufferHide(E.buf);
+
+  E.buf = b;
+  undoLog()->grouping = grouping;
+  undoLog()->grouped = 0;
+
+  if (b->opened)
+    bufferResume(b);
+  else
+    bufferOpen(b);
+
+  // A timer already due runs first, and comes back for the buffer hidden now.
+  // Setting it again would push it back, switching often would keep the
+  // buffers hidden long ago from being released.
+  if (!Buffers.idle_timer) {
+    Buffers.idle_timer = 1;
+    eventSetTimer(buffersReleaseIdle, BUFFER_IDLE_MS);
+  }
+}
+
+/// Shows the buffer of `filename`, added if it is not open yet.
+void bufferEdit(const char *filename) {
+  buffer *b = bufferFind(filename);
+
+  bufferShow(b ? b : bufferAdd(filename));
+}
+
+/// Shows the buffer `step` places after the current one in the list, or
+/// before it if `step` is negative.
+void bufferCycle(int64_t step) {
+  int64_t len = Buffers.len;
+  int64_t i = ((int64_t)bufferIndex(E.buf) + step % len + len) % len;
+
+  bufferShow(Buffers.list[i]);
+}
+
+/// Puts the buffers in the status message, the one shown marked with `%`
+/// and the modified ones with `+`.
+void buffersList() {
+  char list[256] = {0};
+  size_t len = 0;
+
+  for (size_t i = 0; i < Buffers.len && len < sizeof(list); i++) {
+    buffer *b = Buffers.list[i];
+
+    len += snprintf(&list[len], sizeof(list) - len, "%s%zu%s%s \"%s\"",
+                    i > 0 ? " | " : "", i + 1, b == E.buf ? "%" : "",
+                    b->dirty ? "+" : "", b->filename ? b->filename : "");
+  }
+
+  setStatusMessage("%s", list);
+}
@@ -0,0 +1,261 @@
+#pragma once
+
+#include "base.c"
+#include "buffer.c"
+#include "loader.c"
+#include "pager.c"
+#include "reload.c"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*** open state cache ***/
+#define OPEN_STATE_MAGIC 0x3165746174536946 // "FiState1", and the version.
+
+/// Where a file was left, kept between sessions in a file of its own in the
+/// cache directory. It's only used while the file is the same, by its stamp.
+/// The pager also keeps its line index, so it shows the same place of a file
+/// of any size without going through it again.
+///
+/// On disk it's followed by `num_marks` marks and the path of the file, which
+/// tells apart the files whose paths have the same hash.
+typedef struct openState {
+  uint64_t magic;
+  fileStamp stamp;
+
+  uint64_t cx;
+  uint64_t cy;
+  uint64_t row_offset;
+  uint64_t col_offset;
+
+  // The index of the pager, none for buffers with rows.
+  uint64_t stride;
+  uint64_t num_marks;
+  uint64_t scanned_lines;
+  uint64_t scanned_bytes;
+  uint64_t num_lines;
+  uint64_t complete;
+
+  uint64_t path_len;
+  size_t marks[]; // Not saved with the state of buffers with rows.
+} openState;
+
+/// Path of the cache file of the file at `full`, in `$XDG_CACHE_HOME/fire`
+/// or `~/.cache/fire`, named after the hash of the path. The directories are
+/// made if `create` is set. NULL if there is nowhere to keep it.
+char *openStatePath(const char *full, uint_fast8_t create) {
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  char dir[PATH_MAX] = {0};
+
+  if (xdg && *xdg == '/')
+    snprintf(dir, sizeof(dir), "%s/fire", xdg);
+  else if (home && *home == '/')
+    snprintf(dir, sizeof(dir), "%s/.cache/fire", home);
+  else
+    return NULL;
+
+  if (create) {
+    // The parent, then the directory of fire.
+    char *slash = strrchr(dir, '/');
+    *slash = '\0';
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+      return NULL;
+    *slash = '/';
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+      return NULL;
+  }
+
+  char *path = NULL;
+  if (asprintf(&path, "%s/%016lx", dir,
+               (unsigned long)lineHash(full, strlen(full))) == -1)
+    return NULL;
+
+  return path;
+}
+
+/// Reads the state kept for `filename`, NULL if there is none or the file
+/// changed since.
+openState *openStateRead(const char *filename, fileStamp stamp) {
+  char *full = realpath(filename, NULL);
+  char *path = full ? openStatePath(full, 0) : NULL;
+  int fd = path ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+  openState head = {0};
+  openState *s = NULL;
+
+  if (fd != -1 && read(fd, &head, sizeof(head)) == sizeof(head) &&
+      head.magic == OPEN_STATE_MAGIC && fileStampEqual(head.stamp, stamp) &&
+      head.num_marks <= PAGER_MAX_MARKS && head.path_len == strlen(full)) {
+    size_t marks = sizeof(size_t) * head.num_marks;
+    char *saved = malloc(head.path_len);
+
+    s = malloc(sizeof(openState) + marks);
+    *s = head;
+
+    if (read(fd, s->marks, marks) != (ssize_t)marks ||
+        read(fd, saved, head.path_len) != (ssize_t)head.path_len ||
+        memcmp(saved, full, head.path_len) != 0) {
+      free(s);
+      s = NULL;
+    }
+    free(saved);
+  }
+
+  if (fd != -1)
+    close(fd);
+  free(path);
+  free(full);
+  return s;
+}
+
+/// Keeps where the buffer was left, and the index of the pager. It's written
+/// to the side and moved over, a session reading it never sees half of it.
+void openStateWrite(buffer *b) {
+  if (b->filename == NULL || b->file_stamp.inode == 0)
+    return; // Not read from a file, or not saved yet.
+
+  char *full = realpath(b->filename, NULL);
+  char *path = full ? openStatePath(full, 1) : NULL;
+  char *tmp = NULL;
+
+  if (path == NULL || asprintf(&tmp, "%s.%d", path, getpid()) == -1) {
+    free(path);
+    free(full);
+    return;
+  }
+
+  openState s = {
+      .magic = OPEN_STATE_MAGIC,
+      .stamp = b->file_stamp,
+      .cx = b->cx,
+      .cy = b->cy,
+      .row_offset = b->row_offset,
+      .col_offset = b->col_offset,
+      .path_len = strlen(full),
+  };
+  const size_t *marks = NULL;
+
+  if (b->pager) {
+    struct pager *p = b->pager;
+
+    s.stride = p->stride;
+    s.num_marks = p->num_marks;
+    s.scanned_lines = p->scanned_lines;
+    s.scanned_bytes = p->scanned_bytes;
+    s.num_lines = p->num_lines;
+    s.complete = p->complete;
+    marks = p->marks;
+  }
+
+  appendBuffer out = {0};
+  abAppendN(&out, (const char *)&s, sizeof(s));
+  if (marks)
+    abAppendN(&out, (const char *)marks, sizeof(size_t) * s.num_marks);
+  abAppendN(&out, full, s.path_len);
+
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd != -1) {
+    uint_fast8_t written = write(fd, out.buf, out.len) == (ssize_t)out.len;
+
+    close(fd);
+    if (!written || rename(tmp, path) == -1)
+      unlink(tmp);
+  }
+
+  abFree(&out);
+  free(tmp);
+  free(path);
+  free(full);
+}
+
+/// Keeps where every file was left, when the editor exits.
+void openStatesSave() {
+  for (size_t i = 0; i < Buffers.len; i++)
+    if (Buffers.list[i]->opened)
+      openStateWrite(Buffers.list[i]);
+}
+
+/// Moves to where the file being loaded was left, once there are rows up to
+/// there, unless it was moved away from the top already. Called as they come.
+void openStateApply() {
+  openState *s = E.buf->reopen;
+
+  if (E.buf->cy != 0 || E.buf->row_offset != 0) {
+    free(s); // Somewhere else already.
+    E.buf->reopen = NULL;
+    return;
+  }
+  if (E.buf->num_rows <= s->cy && E.buf->loader)
+    return;
+
+  if (E.buf->num_rows > 0) {
+    E.buf->cy = s->cy < E.buf->num_rows ? s->cy : E.buf->num_rows - 1;
+    E.buf->row_offset = s->row_offset <= E.buf->cy ? s->row_offset : E.buf->cy;
+    E.buf->col_offset = s->col_offset;
+    E.buf->cx = s->cx;
+    moveCursor(0); // Stay inside the row.
+  }
+
+  free(s);
+  E.buf->reopen = NULL;
+}
+
+/// Whether the index kept in `s` is one the pager could have built for its
+/// file, the cache file may be damaged or written by something else.
+uint_fast8_t openStateIndexValid(const openState *s, const struct pager *p) {
+  if (s->num_marks == 0 || s->stride == 0 || (s->stride & (s->stride - 1)) ||
+      s->stride > SIZE_MAX / s->num_marks ||
+      s->scanned_lines > s->num_marks * s->stride ||
+      s->scanned_bytes > p->size || s->marks[0] != 0)
+    return 0;
+
+  if (s->complete && s->num_lines != s->scanned_lines &&
+      s->num_lines != s->scanned_lines + 1)
+    return 0;
+
+  for (size_t i = 1; i < s->num_marks; i++)
+    if (s->marks[i] <= s->marks[i - 1] || s->marks[i] > s->scanned_bytes)
+      return 0;
+
+  return 1;
+}
+
+/// Picks up where the file just opened was left. The pager gets its index
+/// back, the loader waits for the rows of the first screen there instead of
+/// at the top.
+void openStateRestore() {
+  if (E.buf->filename == NULL)
+    return;
+
+  openState *s = openStateRead(E.buf->filename, E.buf->file_stamp);
+  if (s == NULL)
+    return;
+
+  struct pager *p = E.buf->pager;
+  if (p) {
+    if (openStateIndexValid(s, p)) {
+      memcpy(p->marks, s->marks, sizeof(size_t) * s->num_marks);
+      p->num_marks = s->num_marks;
+      p->stride = s->stride;
+      p->scanned_lines = s->scanned_lines;
+      p->scanned_bytes = s->scanned_bytes;
+      p->num_lines = s->num_lines;
+      p->complete = s->complete;
+    }
+
+    E.buf->cy = s->cy;
+    E.buf->cx = s->cx;
+    E.buf->row_offset = s->row_offset;
+    E.buf->col_offset = s->col_offset;
+    free(s);
+    return;
+  }
+
+  E.buf->reopen = s;
+  if (E.buf->loader)
+    E.buf->loader->first_batch += s->row_offset;
+}
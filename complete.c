@@ -0,0 +1,387 @@
+#pragma once
+
+#include "base.c"
+#include "trace.c"
+#include <stdlib.h>
+#include <string.h>
+
+/*** completion ***/
+#define COMPLETE_MIN_WORD 2   // Shorter words are not worth completing.
+#define COMPLETE_MAX_WORD 128 // Longer ones are not identifiers.
+#define COMPLETE_MAX 16       // Candidates offered for a prefix.
+
+/// A node of the trie, for the byte `byte` after the ones of its parents.
+typedef struct completeNode {
+  uint32_t child;   // First child, the others follow it in byte order.
+  uint32_t sibling; // Next child of the parent, 0 if there is none.
+  uint32_t parent;
+  uint32_t count; // Times the word that ends here is in the file.
+  uint32_t best;  // Highest count below it, the subtrees that can't rank.
+  uint32_t text;  // Where the word is in `text`, once it is one.
+  uint8_t byte;
+  uint8_t len;
+} completeNode;
+
+/// Every word of the file and how many times it is there. Words are found in
+/// the hash to count them, and by prefix in the trie, where each node knows
+/// the best count under it so a lookup only walks the subtrees that rank.
+///
+/// It is kept in step with the edits instead of reading the file again: the
+/// words of the rows an edit replaces are taken out before it, and the ones
+/// of the rows it puts are counted at the next edit or lookup, once they
+/// have their text.
+struct completeIndex {
+  completeNode *nodes; // The first one is the root.
+  size_t num_nodes;
+  size_t nodes_cap;
+
+  uint32_t *words; // Nodes of the words by hash, 0 where there is none.
+  size_t num_words;
+  size_t words_cap;
+  appendBuffer text; // The words, one after the other.
+
+  size_t rows;        // Rows counted, the ones after them were loaded since.
+  size_t pending;     // Rows put by the last edit, not counted yet.
+  size_t num_pending;
+};
+
+/// The word being completed and the words it can be. The one at
+/// `num_candidates` is the word as it was typed.
+struct completion {
+  textPos at;  // Where the word starts.
+  textPos end; // Where it ends, the cursor must still be there to go on.
+  appendBuffer prefix;
+  uint32_t candidates[COMPLETE_MAX];
+  size_t num_candidates;
+  size_t current;
+  uint_fast8_t active;
+};
+
+struct completion Completion = {0};
+
+/// Like the words of `w` and `b`: letters, digits, `_` and anything that is
+/// not ASCII.
+uint_fast8_t completeIsKeyword(unsigned char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_' || c >= 0x80;
+}
+
+uint64_t completeHash(const char *s, size_t len) {
+  uint64_t h = 0xcbf29ce484222325;
+
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char)s[i]) * 0x100000001b3;
+
+  return h;
+}
+
+uint32_t completeNewNode(struct completeIndex *ix, uint32_t parent,
+                         uint8_t byte) {
+  if (ix->num_nodes == ix->nodes_cap) {
+    ix->nodes_cap = ix->nodes_cap ? ix->nodes_cap * 2 : 1024;
+    ix->nodes = realloc(ix->nodes, sizeof(completeNode) * ix->nodes_cap);
+  }
+
+  ix->nodes[ix->num_nodes] = (completeNode){
+      .parent = parent,
+      .byte = byte,
+      .len = parent ? ix->nodes[parent].len + 1 : 1,
+  };
+
+  return ix->num_nodes++;
+}
+
+/// The child of `parent` for `byte`, added in its place if `create` is set.
+/// Returns 0 if there is none.
+uint32_t completeChild(struct completeIndex *ix, uint32_t parent,
+                       unsigned char byte, uint_fast8_t create) {
+  uint32_t *link = &ix->nodes[parent].child;
+
+  while (*link && ix->nodes[*link].byte < byte)
+    link = &ix->nodes[*link].sibling;
+
+  if (*link && ix->nodes[*link].byte == byte)
+    return *link;
+  if (!create)
+    return 0;
+
+  uint32_t n = completeNewNode(ix, parent, byte);
+  // `link` may point into the nodes that just moved.
+  link = &ix->nodes[parent].child;
+  while (*link && ix->nodes[*link].byte < byte)
+    link = &ix->nodes[*link].sibling;
+
+  ix->nodes[n].sibling = *link;
+  *link = n;
+  return n;
+}
+
+/// Slot of the hash where the word is, or where it would go.
+uint32_t *completeSlot(struct completeIndex *ix, const char *s, size_t len) {
+  size_t mask = ix->words_cap - 1;
+  size_t i = completeHash(s, len) & mask;
+
+  for (;; i = (i + 1) & mask) {
+    uint32_t n = ix->words[i];
+
+    if (n == 0 || (ix->nodes[n].len == len &&
+                   memcmp(&ix->text.buf[ix->nodes[n].text], s, len) == 0))
+      return &ix->words[i];
+  }
+}
+
+void completeGrowWords(struct completeIndex *ix) {
+  uint32_t *words = ix->words;
+  size_t cap = ix->words_cap;
+
+  ix->words_cap = cap ? cap * 2 : 1024;
+  ix->words = calloc(ix->words_cap, sizeof(uint32_t));
+
+  for (size_t i = 0; i < cap; i++) {
+    if (words[i] == 0)
+      continue;
+
+    completeNode *n = &ix->nodes[words[i]];
+    *completeSlot(ix, &ix->text.buf[n->text], n->len) = words[i];
+  }
+
+  free(words);
+}
+
+/// The node of the word, added to the trie and the hash if `create` is set.
+uint32_t completeFind(struct completeIndex *ix, const char *s, size_t len,
+                      uint_fast8_t create) {
+  if ((ix->num_words + 1) * 2 > ix->words_cap)
+    completeGrowWords(ix);
+
+  uint32_t *slot = completeSlot(ix, s, len);
+  if (*slot || !create)
+    return *slot;
+
+  uint32_t n = 0;
+  for (size_t i = 0; i < len; i++)
+    n = completeChild(ix, n, s[i], 1);
+
+  ix->nodes[n].text = ix->text.len;
+  abAppendN(&ix->text, s, len);
+  ix->num_words++;
+
+  return *slot = n;
+}
+
+/// Adds `delta`, 1 or -1, to the times the word is in the file, and fixes the
+/// best counts above it.
+void completeCount(struct completeIndex *ix, const char *s, size_t len,
+                   int delta) {
+  uint32_t n = completeFind(ix, s, len, delta > 0);
+
+  if (n == 0 || (delta < 0 && ix->nodes[n].count == 0))
+    return;
+
+  ix->nodes[n].count += delta;
+  uint32_t below = ix->nodes[n].count;
+
+  for (;; n = ix->nodes[n].parent) {
+    completeNode *node = &ix->nodes[n];
+    uint32_t best = below > node->best ? below : node->best;
+
+    if (delta < 0) {
+      // It may have been the best, the others say what is left.
+      best = node->count;
+      for (uint32_t c = node->child; c; c = ix->nodes[c].sibling)
+        if (ix->nodes[c].best > best)
+          best = ix->nodes[c].best;
+    }
+
+    if (node->best == best)
+      break;
+    node->best = below = best;
+    if (n == 0)
+      break;
+  }
+}
+
+/// Counts the words of the row, or takes them out if `delta` is -1.
+void completeRow(struct completeIndex *ix, row *r, int delta) {
+  const char *s = r->chars.buf;
+  size_t len = r->chars.len;
+
+  for (size_t i = 0; i < len;) {
+    if (!completeIsKeyword(s[i])) {
+      i++;
+      continue;
+    }
+
+    size_t start = i;
+    while (i < len && completeIsKeyword(s[i]))
+      i++;
+
+    size_t word_len = i - start;
+    if (word_len >= COMPLETE_MIN_WORD && word_len <= COMPLETE_MAX_WORD &&
+        !(s[start] >= '0' && s[start] <= '9'))
+      completeCount(ix, &s[start], word_len, delta);
+  }
+}
+
+/// Called before `remove` rows at `at` are replaced with `insert` rows.
+void completeChanging(size_t at, size_t remove, size_t insert) {
+  struct completeIndex *ix = E.buf->complete;
+
+  if (ix == NULL || at > ix->rows)
+    return;
+
+  size_t end = at + remove < ix->rows ? at + remove : ix->rows;
+  size_t pending_end = ix->pending + ix->num_pending;
+
+  // The rows of the last edit have their text now. The ones that go away
+  // were never counted, like a row being typed in.
+  for (size_t y = ix->pending; y < pending_end; y++)
+    if (y < at || y >= end)
+      completeRow(ix, &E.buf->rows[y], 1);
+
+  for (size_t y = at; y < end; y++)
+    if (y < ix->pending || y >= pending_end)
+      completeRow(ix, &E.buf->rows[y], -1);
+
+  ix->rows = ix->rows - (end - at) + insert;
+  ix->pending = at;
+  ix->num_pending = insert;
+}
+
+/// Counts the rows of the last edit, and the ones loaded since.
+void completeFlush(struct completeIndex *ix) {
+  for (size_t y = ix->pending; y < ix->pending + ix->num_pending; y++)
+    completeRow(ix, &E.buf->rows[y], 1);
+  ix->num_pending = 0;
+
+  for (size_t y = ix->rows; y < E.buf->num_rows; y++)
+    completeRow(ix, &E.buf->rows[y], 1);
+  ix->rows = E.buf->num_rows;
+}
+
+/// The index of the words of the file, read in full the first time.
+struct completeIndex *completeIndex() {
+  if (E.buf->complete == NULL) {
+    E.buf->complete = calloc(1, sizeof(struct completeIndex));
+    completeNewNode(E.buf->complete, 0, 0);
+  }
+
+  uint64_t start = traceBegin();
+  completeFlush(E.buf->complete);
+  traceEnd("completeFlush", start);
+
+  return E.buf->complete;
+}
+
+/// Keeps the node in the candidates if it ranks, most counted first and in
+/// byte order among the same count.
+void completeRank(struct completeIndex *ix, uint32_t n) {
+  struct completion *c = &Completion;
+  uint32_t count = ix->nodes[n].count;
+  size_t i = c->num_candidates;
+
+  while (i > 0 && ix->nodes[c->candidates[i - 1]].count < count)
+    i--;
+  if (i == COMPLETE_MAX)
+    return;
+
+  size_t len = c->num_candidates < COMPLETE_MAX ? c->num_candidates
+                                                 : COMPLETE_MAX - 1;
+  memmove(&c->candidates[i + 1], &c->candidates[i],
+          sizeof(uint32_t) * (len - i));
+  c->candidates[i] = n;
+  c->num_candidates = len + 1;
+}
+
+/// Ranks the words under `n`, skipping the subtrees with no count higher
+/// than the last candidate.
+void completeCollect(struct completeIndex *ix, uint32_t n, uint32_t prefix) {
+  struct completion *c = &Completion;
+
+  if (n != prefix && ix->nodes[n].count > 0)
+    completeRank(ix, n);
+
+  for (uint32_t child = ix->nodes[n].child; child;
+       child = ix->nodes[child].sibling) {
+    uint32_t best = ix->nodes[child].best;
+
+    if (best == 0 ||
+        (c->num_candidates == COMPLETE_MAX &&
+         best <= ix->nodes[c->candidates[COMPLETE_MAX - 1]].count))
+      continue;
+
+    completeCollect(ix, child, prefix);
+  }
+}
+
+/// Finds the words that start with `prefix`, other than itself.
+void completeLookup(const char *prefix, size_t len) {
+  struct completeIndex *ix = completeIndex();
+  uint64_t start = traceBegin();
+  uint32_t n = 0;
+
+  Completion.num_candidates = 0;
+  for (size_t i = 0; i < len && (i == 0 || n != 0); i++)
+    n = completeChild(ix, n, prefix[i], 0);
+
+  // The root is the prefix of every word, no other node is.
+  if (len == 0 || n != 0)
+    completeCollect(ix, n, n);
+  traceEnd("completeLookup", start);
+}
+
+/// Goes to the next candidate (`step` 1) or the previous one (-1) of the word
+/// before the cursor, starting over if the cursor moved since.
+void completeStep(int step) {
+  struct completion *c = &Completion;
+
+  if (E.buf->cy >= E.buf->num_rows)
+    return;
+
+  if (!c->active || c->end.y != E.buf->cy || c->end.x != E.buf->cx) {
+    row *r = &E.buf->rows[E.buf->cy];
+    size_t x = E.buf->cx;
+
+    while (x > 0 && completeIsKeyword(r->chars.buf[x - 1]))
+      x--;
+
+    abClear(&c->prefix);
+    abAppendN(&c->prefix, &r->chars.buf[x], E.buf->cx - x);
+    completeLookup(c->prefix.buf, c->prefix.len);
+
+    if (c->num_candidates == 0) {
+      setStatusMessage("No completions for \"%.*s\"", (int)c->prefix.len,
+                       c->prefix.buf);
+      c->active = 0;
+      return;
+    }
+
+    c->at = (textPos){.y = E.buf->cy, .x = x};
+    c->end = (textPos){.y = E.buf->cy, .x = E.buf->cx};
+    c->current = c->num_candidates;
+    c->active = 1;
+  }
+
+  size_t n = c->num_candidates + 1;
+  c->current = (c->current + n + step) % n;
+
+  const char *s = c->prefix.buf;
+  size_t len = c->prefix.len;
+
+  if (c->current < c->num_candidates) {
+    completeNode *node = &E.buf->complete->nodes[c->candidates[c->current]];
+    s = &E.buf->complete->text.buf[node->text];
+    len = node->len;
+    setStatusMessage("Completion %zu of %zu", c->current + 1,
+                     c->num_candidates);
+  } else {
+    setStatusMessage("Back at original");
+  }
+
+  textPos end = editorReplaceRange(c->at, c->end, s, len);
+  E.buf->cy = c->end.y = end.y;
+  E.buf->cx = c->end.x = end.x;
+}
+
+/// Any other key ends the completion, the next one starts over.
+void completeEnd() { Completion.active = 0; }
@@ -0,0 +1,349 @@
+#pragma once
+
+#include "base.c"
+#include "event.c"
+#include "reload.c"
+#include "theme.c"
+#include "trace.c"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*** diff ***/
+#define DIFF_DELAY_MS 30 // After the last edit, the rows are diffed again.
+
+/// What changed in the rows from the file on disk, shown in the gutter. The
+/// hunks are the ones of `diffRows`, from the rows to the lines of the file,
+/// as they were the last time they were diffed.
+///
+/// The rows edited since then are `from` to `to`, and the ones after them
+/// moved by `delta`. Only those are diffed again, together with the hunks
+/// they touch, so an edit costs the same in a file of any size.
+struct diffView {
+  char *text; // The file on disk, split into `lines`.
+  diskLine *lines;
+  size_t num_lines;
+  fileStamp stamp; // Of the file when it was read.
+
+  reloadHunk *hunks;
+  size_t num_hunks;
+  size_t num_rows; // The rows there are, as far as the diff knows.
+
+  uint_fast8_t changed; // Rows were edited since they were diffed.
+  size_t from;
+  size_t to;
+  int64_t delta;
+};
+
+void diffFree(struct diffView *d) {
+  free(d->text);
+  free(d->lines);
+  free(d->hunks);
+  free(d);
+}
+
+/// Reads the file again and splits it into lines. A file that is not there
+/// has none, everything in the rows is new.
+void diffReadFile(struct diffView *d) {
+  struct stat st = {0};
+  int fd = open(E.buf->filename, O_RDONLY | O_CLOEXEC);
+  size_t size = 0;
+
+  free(d->text);
+  d->text = NULL;
+  d->num_lines = 0;
+  d->stamp = (fileStamp){0};
+
+  if (fd == -1)
+    return;
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    d->text = malloc(st.st_size + 1);
+    size = reloadRead(fd, d->text, st.st_size);
+    d->stamp = fileStampOf(&st);
+  }
+  close(fd);
+
+  const char *end = d->text + size;
+  size_t cap = 0;
+
+  // The last line break doesn't start another line.
+  for (const char *s = d->text; s < end;) {
+    const char *nl = memchr(s, '\n', end - s);
+    const char *line_end = nl ? nl : end;
+
+    if (d->num_lines == cap) {
+      cap = cap ? cap * 2 : 1024;
+      d->lines = realloc(d->lines, sizeof(diskLine) * cap);
+    }
+
+    d->lines[d->num_lines++] =
+        (diskLine){.s = s, .len = diskLineLen(s, line_end - s)};
+    s = line_end + 1;
+  }
+}
+
+/// Widens the rows edited since the last diff to the `remove` rows at `at`
+/// that are replaced with `insert` rows.
+void diffEdit(struct diffView *d, size_t at, size_t remove, size_t insert) {
+  if (!d->changed) {
+    d->changed = 1;
+    d->from = at;
+    d->to = at + remove;
+    d->delta = 0;
+  }
+
+  if (at < d->from)
+    d->from = at;
+  if (at + remove > d->to)
+    d->to = at + remove;
+  d->to = d->to - remove + insert;
+  d->delta += (int64_t)insert - (int64_t)remove;
+  d->num_rows = d->num_rows - remove + insert;
+}
+
+/// Diffs all the rows with the file.
+void diffAll(struct diffView *d) {
+  free(d->hunks);
+  d->num_hunks =
+      diffRows(0, E.buf->num_rows, d->lines, d->num_lines, &d->hunks);
+  d->num_rows = E.buf->num_rows;
+  d->changed = 0;
+}
+
+/// Diffs the edited rows again. Where they were is widened to the hunks it
+/// touches, the lines of the file there are known from the hunks before it,
+/// and the new hunks replace those.
+void diffEdited(struct diffView *d) {
+  size_t a = d->from;
+  size_t b = d->to - d->delta; // Where the edits end, before them.
+  int64_t shift = 0;           // From a row to its line on disk.
+  size_t first = 0;
+
+  for (; first < d->num_hunks; first++) {
+    reloadHunk *h = &d->hunks[first];
+
+    if (h->old_start + h->old_len >= a)
+      break;
+    shift += (int64_t)h->new_len - (int64_t)h->old_len;
+  }
+
+  size_t da = a + shift;
+  size_t last = first;
+
+  for (; last < d->num_hunks && d->hunks[last].old_start <= b; last++) {
+    reloadHunk *h = &d->hunks[last];
+
+    if (h->old_start < a) {
+      da -= a - h->old_start;
+      a = h->old_start;
+    }
+    if (h->old_start + h->old_len > b)
+      b = h->old_start + h->old_len;
+    shift += (int64_t)h->new_len - (int64_t)h->old_len;
+  }
+
+  size_t db = b + shift;
+  if (db > d->num_lines || da > db) {
+    diffAll(d); // Out of step with the file, it can't be.
+    return;
+  }
+
+  reloadHunk *fresh = NULL;
+  size_t num_fresh =
+      diffRows(a, b + d->delta - a, &d->lines[da], db - da, &fresh);
+
+  for (size_t i = 0; i < num_fresh; i++)
+    fresh[i].new_start += da - a;
+
+  // The hunks before stay, the new ones go in place of the ones they touched
+  // and the ones after move along with the rows.
+  size_t after = d->num_hunks - last;
+  size_t num_hunks = first + num_fresh + after;
+
+  if (num_fresh != last - first) {
+    if (num_fresh > last - first)
+      d->hunks = realloc(d->hunks, sizeof(reloadHunk) * num_hunks);
+    memmove(&d->hunks[first + num_fresh], &d->hunks[last],
+            sizeof(reloadHunk) * after);
+  }
+  if (num_fresh > 0)
+    memcpy(&d->hunks[first], fresh, sizeof(reloadHunk) * num_fresh);
+  for (size_t i = first + num_fresh; i < num_hunks; i++)
+    d->hunks[i].old_start += d->delta;
+
+  d->num_hunks = num_hunks;
+  d->changed = 0;
+  free(fresh);
+}
+
+/// Brings the diff up to date with the rows, and with the file if it changed
+/// on disk. Returns whether it was done, it waits for the file to be loaded.
+uint_fast8_t diffRefresh() {
+  struct diffView *d = E.buf->diff;
+  struct stat st = {0};
+
+  if (d == NULL || E.buf->loader)
+    return 0;
+
+  uint64_t start = traceBegin();
+
+  // Rows that came in without an edit, from the loader or a followed file.
+  if (E.buf->num_rows > d->num_rows)
+    diffEdit(d, d->num_rows, 0, E.buf->num_rows - d->num_rows);
+
+  if (stat(E.buf->filename, &st) == -1 ||
+      !fileStampEqual(fileStampOf(&st), d->stamp)) {
+    diffReadFile(d);
+    diffAll(d);
+  } else if (E.buf->num_rows != d->num_rows) {
+    diffAll(d);
+  } else if (d->changed) {
+    diffEdited(d);
+  }
+
+  traceEnd("diffRefresh", start);
+  return 1;
+}
+
+uint_fast8_t diffTimer(int fd) {
+  (void)fd;
+
+  if (E.buf->diff && !diffRefresh())
+    eventSetTimer(diffTimer, DIFF_DELAY_MS); // Still loading.
+
+  return E.buf->diff != NULL;
+}
+
+/// Diffs again soon, when the buffer is shown or the file was saved.
+void diffSchedule() {
+  if (E.buf->diff)
+    eventSetTimer(diffTimer, DIFF_DELAY_MS);
+}
+
+/// Called before `remove` rows at `at` are replaced with `insert` rows. The
+/// rows they are among are diffed again a moment later.
+void diffChanging(size_t at, size_t remove, size_t insert) {
+  if (E.buf->diff == NULL)
+    return;
+
+  diffEdit(E.buf->diff, at, remove, insert);
+  eventSetTimer(diffTimer, DIFF_DELAY_MS);
+}
+
+/// The mark of row `y` in the gutter, `+` if it was added, `~` if it was
+/// changed and `-` where lines were deleted, with its color. 0 if the row is
+/// the same on disk.
+char diffMark(size_t y, themeColor *color) {
+  struct diffView *d = E.buf->diff;
+  size_t old = y;
+
+  // Edited since they were diffed, the marks come when they are.
+  if (d->changed && y >= d->from && y < d->to) {
+    *color = THEME_DIFF_CHANGED;
+    return '~';
+  }
+  if (d->changed && y >= d->to)
+    old = y - d->delta;
+
+  // The first hunk that starts after the row.
+  size_t lo = 0;
+  size_t hi = d->num_hunks;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (d->hunks[mid].old_start <= old)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  reloadHunk *h = lo > 0 ? &d->hunks[lo - 1] : NULL;
+  reloadHunk *next = lo < d->num_hunks ? &d->hunks[lo] : NULL;
+  size_t old_rows = d->num_rows - (d->changed ? d->delta : 0);
+
+  if (h && old < h->old_start + h->old_len) {
+    // Replaced rows are changed, the ones more than the lines replaced added.
+    uint_fast8_t added = old - h->old_start >= h->new_len;
+    *color = added ? THEME_DIFF_ADDED : THEME_DIFF_CHANGED;
+    return added ? '+' : '~';
+  }
+
+  // Lines deleted at the end go on the last row.
+  if ((h && h->old_len == 0 && h->old_start == old) ||
+      (next && next->old_len == 0 && next->old_start == old_rows &&
+       old + 1 == old_rows)) {
+    *color = THEME_DIFF_REMOVED;
+    return '-';
+  }
+
+  return 0;
+}
+
+/// Moves to the start of the `step`th change after the cursor, or before it
+/// if `step` is negative. Returns whether there was one.
+uint_fast8_t diffJump(int64_t step) {
+  struct diffView *d = E.buf->diff;
+
+  if (d == NULL) {
+    setStatusMessage("Not diffing with the file, :diff to start");
+    return 0;
+  }
+  if (!diffRefresh()) {
+    setStatusMessage("Can't diff while the file is still loading");
+    return 0;
+  }
+
+  // Where each hunk is in the rows, deleted lines at the end on the last one.
+  size_t last_row = E.buf->num_rows > 0 ? E.buf->num_rows - 1 : 0;
+  size_t i = 0;
+
+#define HUNK_ROW(i)                                                            \
+  (d->hunks[i].old_start < last_row ? d->hunks[i].old_start : last_row)
+
+  if (step > 0) {
+    while (i < d->num_hunks && HUNK_ROW(i) <= E.buf->cy)
+      i++;
+    i += step - 1;
+  } else {
+    while (i < d->num_hunks && HUNK_ROW(i) < E.buf->cy)
+      i++;
+    i = (int64_t)i + step >= 0 ? i + step : d->num_hunks;
+  }
+
+  if (i >= d->num_hunks) {
+    setStatusMessage("No more changes");
+    return 0;
+  }
+
+  E.buf->cy = HUNK_ROW(i);
+  E.buf->cx = 0;
+#undef HUNK_ROW
+
+  setStatusMessage("Change %zu of %zu", i + 1, d->num_hunks);
+  return 1;
+}
+
+/// Starts marking what changed from the file on disk, or stops it.
+void diffToggle() {
+  if (E.buf->diff) {
+    diffFree(E.buf->diff);
+    E.buf->diff = NULL;
+    setStatusMessage("Diff with the file off");
+    return;
+  }
+  if (E.buf->pager || E.buf->filename == NULL) {
+    setStatusMessage("No file to diff with");
+    return;
+  }
+
+  E.buf->diff = calloc(1, sizeof(struct diffView));
+  E.buf->diff->stamp.size = SIZE_MAX; // Not read yet.
+
+  if (diffRefresh())
+    setStatusMessage("%zu changes from the file", E.buf->diff->num_hunks);
+  else
+    diffSchedule();
+}
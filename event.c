@@ -0,0 +1,430 @@
+#pragma once
+
+#include "base.c"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <time.h>
+
+/*** event loop ***/
+#define EVENT_MAX_WATCHES 16
+#define EVENT_MAX_TIMERS 8
+#define INPUT_RING_SIZE (1 << 16)
+#define ESC_SEQ_TIMEOUT_MS 50
+
+/// Called when a watched file descriptor or a timer fires. Returns whether the
+/// screen needs to be redrawn.
+typedef uint_fast8_t (*eventCallback)(int fd);
+
+typedef struct eventTimer {
+  uint64_t deadline; // Monotonic, in milliseconds.
+  eventCallback callback;
+} eventTimer;
+
+/// Keys read from the terminal but not decoded yet. `head` and `tail` only
+/// grow, they are masked when indexing `buf`.
+typedef struct inputRing {
+  unsigned char buf[INPUT_RING_SIZE];
+  size_t head;
+  size_t tail;
+} inputRing;
+
+struct eventLoop {
+  struct pollfd fds[EVENT_MAX_WATCHES];
+  eventCallback callbacks[EVENT_MAX_WATCHES];
+  size_t num_watches;
+
+  eventTimer timers[EVENT_MAX_TIMERS];
+  size_t num_timers;
+
+  inputRing input;
+
+  // Keys replayed instead of reading the terminal, when running headless.
+  const char *script;
+  size_t script_len;
+  size_t script_pos;
+
+  // Text of the bracketed paste being received, or last received.
+  appendBuffer paste;
+  enum { PASTE_NONE, PASTE_RECEIVING, PASTE_COMPLETE } pasting;
+};
+
+struct eventLoop Loop = {0};
+
+/// Nanoseconds from an arbitrary point, never goes backwards.
+uint64_t nowNs() {
+  struct timespec ts = {0};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t nowMs() { return nowNs() / 1000000; }
+
+/// Calls `callback` every time `fd` becomes readable.
+void eventWatch(int fd, eventCallback callback) {
+  if (Loop.num_watches == EVENT_MAX_WATCHES)
+    die("eventWatch");
+
+  Loop.fds[Loop.num_watches] = (struct pollfd){.fd = fd, .events = POLLIN};
+  Loop.callbacks[Loop.num_watches] = callback;
+  Loop.num_watches++;
+}
+
+void eventUnwatch(int fd) {
+  for (size_t i = 0; i < Loop.num_watches; i++) {
+    if (Loop.fds[i].fd == fd) {
+      Loop.num_watches--;
+      Loop.fds[i] = Loop.fds[Loop.num_watches];
+      Loop.callbacks[i] = Loop.callbacks[Loop.num_watches];
+      return;
+    }
+  }
+}
+
+/// Calls `callback` once, `delay_ms` from now. Setting a timer again with the
+/// same callback moves its deadline.
+void eventSetTimer(eventCallback callback, uint64_t delay_ms) {
+  size_t i = 0;
+
+  while (i < Loop.num_timers && Loop.timers[i].callback != callback)
+    i++;
+
+  if (i == EVENT_MAX_TIMERS)
+    die("eventSetTimer");
+
+  Loop.timers[i] = (eventTimer){.deadline = nowMs() + delay_ms,
+                                .callback = callback};
+  if (i == Loop.num_timers)
+    Loop.num_timers++;
+}
+
+/// Number of bytes waiting to be decoded.
+size_t inputPending() { return Loop.input.tail - Loop.input.head; }
+
+/// Reads everything the terminal has for us, as long as it fits.
+void inputFill() {
+  inputRing *in = &Loop.input;
+
+  while (inputPending() < INPUT_RING_SIZE) {
+    size_t off = in->tail & (INPUT_RING_SIZE - 1);
+    size_t room = INPUT_RING_SIZE - inputPending();
+
+    if (room > INPUT_RING_SIZE - off)
+      room = INPUT_RING_SIZE - off; // Up to the end of the ring.
+
+    ssize_t n = 0;
+
+    if (E.headless) {
+      size_t left = Loop.script_len - Loop.script_pos;
+      n = left < room ? left : room;
+      memcpy(&in->buf[off], &Loop.script[Loop.script_pos], n);
+      Loop.script_pos += n;
+    } else {
+      n = read(STDIN_FILENO, &in->buf[off], room);
+    }
+
+    if (n == -1 && errno != EAGAIN && errno != EINTR)
+      die("read");
+    if (n <= 0)
+      break;
+
+    in->tail += n;
+  }
+}
+
+/// Waits until there are keys to decode, a watched file descriptor is
+/// readable, a timer expires or `max_wait_ms` passes (-1 waits forever).
+/// Returns whether the screen needs to be redrawn.
+uint_fast8_t eventWait(int64_t max_wait_ms) {
+  uint_fast8_t redraw = 0;
+  uint64_t now = nowMs();
+  int64_t timeout = max_wait_ms;
+
+  for (size_t i = 0; i < Loop.num_timers; i++) {
+    int64_t left = Loop.timers[i].deadline > now
+                       ? (int64_t)(Loop.timers[i].deadline - now)
+                       : 0;
+    if (timeout < 0 || left < timeout)
+      timeout = left;
+  }
+
+  // Stdin goes last, it is only polled while there is room in the ring.
+  struct pollfd fds[EVENT_MAX_WATCHES + 1];
+  size_t num_fds = Loop.num_watches;
+  memcpy(fds, Loop.fds, sizeof(struct pollfd) * num_fds);
+  if (inputPending() < INPUT_RING_SIZE && !E.headless)
+    fds[num_fds++] = (struct pollfd){.fd = STDIN_FILENO, .events = POLLIN};
+
+  int ready = poll(fds, num_fds, timeout);
+
+  if (ready == -1 && errno != EINTR)
+    die("poll");
+
+  if (ready > 0) {
+    // Callbacks may unwatch descriptors, so look them up again.
+    for (size_t i = 0; i < Loop.num_watches && i < num_fds; i++) {
+      for (size_t j = 0; j < num_fds; j++) {
+        if (fds[j].fd == Loop.fds[i].fd && fds[j].revents) {
+          fds[j].revents = 0;
+          redraw |= Loop.callbacks[i](fds[j].fd);
+          break;
+        }
+      }
+    }
+
+    struct pollfd *in = &fds[num_fds - 1];
+    if (in->fd == STDIN_FILENO && in->revents) {
+      if (in->revents & POLLIN)
+        inputFill();
+      else
+        exit(0); // The terminal went away.
+    }
+  }
+
+  now = nowMs();
+  for (size_t i = 0; i < Loop.num_timers;) {
+    if (Loop.timers[i].deadline <= now) {
+      eventCallback callback = Loop.timers[i].callback;
+      Loop.timers[i] = Loop.timers[--Loop.num_timers];
+      redraw |= callback(-1);
+    } else {
+      i++;
+    }
+  }
+
+  return redraw;
+}
+
+/// Routes the signals the editor cares about through the event loop. It
+/// must be called before any thread is started so they inherit the mask.
+void eventInit(eventCallback on_signal) {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGWINCH);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGHUP);
+  sigaddset(&mask, SIGINT);
+
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+    die("sigprocmask");
+
+  int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (fd == -1)
+    die("signalfd");
+
+  eventWatch(fd, on_signal);
+}
+
+/// Replays `len` bytes of `keys` as if they were typed, for headless runs.
+void inputSetScript(const char *keys, size_t len) {
+  Loop.script = keys;
+  Loop.script_len = len;
+  Loop.script_pos = 0;
+}
+
+/*** key decoding ***/
+
+/// Returns the byte `i` positions after the next one to decode, or -1 if it
+/// hasn't arrived yet.
+int inputPeek(size_t i) {
+  if (i >= inputPending())
+    return -1;
+
+  return Loop.input.buf[(Loop.input.head + i) & (INPUT_RING_SIZE - 1)];
+}
+
+/// Maps the final byte (and the numeric parameter) of a CSI or SS3 sequence
+/// to a key. Unknown sequences are reported as `ESC`.
+uint64_t decodeSequence(int final, uint_fast32_t param) {
+  switch (final) {
+  case '~':
+    switch (param) {
+    case 1:
+    case 7:
+      return HOME_KEY;
+    case 4:
+    case 8:
+      return END_KEY;
+    case 5:
+      return PAGE_UP;
+    case 6:
+      return PAGE_DOWN;
+    }
+    break;
+
+  // Arrow keys
+  case 'A':
+    return ARROW_UP;
+  case 'B':
+    return ARROW_DOWN;
+  case 'C':
+    return ARROW_RIGHT;
+  case 'D':
+    return ARROW_LEFT;
+  case 'H':
+    return HOME_KEY;
+  case 'F':
+    return END_KEY;
+  }
+
+  return ESC;
+}
+
+/// Moves the text of a bracketed paste from the ring into the paste buffer.
+/// Returns whether the end of the paste has been received.
+uint_fast8_t inputCollectPaste() {
+  inputRing *in = &Loop.input;
+
+  while (inputPending() != 0) {
+    size_t off = in->head & (INPUT_RING_SIZE - 1);
+    size_t avail = inputPending();
+
+    if (avail > INPUT_RING_SIZE - off)
+      avail = INPUT_RING_SIZE - off; // Up to the end of the ring.
+
+    unsigned char *esc = memchr(&in->buf[off], ESC, avail);
+    size_t text = esc ? (size_t)(esc - &in->buf[off]) : avail;
+
+    abAppendN(&Loop.paste, (char *)&in->buf[off], text);
+    in->head += text;
+
+    if (esc == NULL)
+      continue;
+
+    // Is it the end of the paste: ESC [ 2 0 1 ~?
+    const char *end = "\x1b[201~";
+    size_t i = 1;
+    int b = -1;
+
+    while (end[i] && (b = inputPeek(i)) == end[i])
+      i++;
+
+    if (end[i] == '\0') {
+      in->head += i;
+      Loop.pasting = PASTE_COMPLETE;
+      return 1;
+    }
+    if (b == -1)
+      return 0; // Wait for the rest of it.
+
+    abAppendChar(&Loop.paste, ESC);
+    in->head++;
+  }
+
+  return 0;
+}
+
+/// Finds the next key in the input ring, without consuming it. Returns how
+/// many bytes it takes, 0 if there is nothing to decode or if an escape
+/// sequence is still incomplete and `flush` isn't set, in which case a lone
+/// `ESC` is returned.
+size_t inputScanKey(uint64_t *key, uint_fast8_t flush) {
+  int c = inputPeek(0);
+
+  if (c == -1)
+    return 0;
+
+  size_t used = 1;
+  *key = c;
+
+  if (c == ESC) {
+    int kind = inputPeek(1);
+
+    if (kind == '[') {
+      // CSI: parameters, intermediates and a final byte.
+      uint_fast32_t param = 0;
+      size_t i = 2;
+      int b = -1;
+
+      while ((b = inputPeek(i)) != -1 && b >= 0x20 && b <= 0x3f) {
+        if (b >= '0' && b <= '9')
+          param = param * 10 + (b - '0');
+        i++;
+      }
+
+      if (b != -1) {
+        *key = b == '~' && param == 200 ? PASTE : decodeSequence(b, param);
+        used = i + 1;
+      } else if (!flush) {
+        return 0;
+      }
+    } else if (kind == 'O') {
+      int b = inputPeek(2);
+
+      if (b != -1) {
+        *key = decodeSequence(b, 0);
+        used = 3;
+      } else if (!flush) {
+        return 0;
+      }
+    } else if (kind == -1 && !flush) {
+      return 0;
+    }
+  }
+
+  return used;
+}
+
+/// Decodes the next key from the input ring into `key`. Returns 0 if there
+/// is nothing to decode yet, see `inputScanKey`. A bracketed paste is decoded
+/// as a single `PASTE` key once all of its text has arrived.
+uint_fast8_t inputDecodeKey(uint64_t *key, uint_fast8_t flush) {
+  if (Loop.pasting == PASTE_NONE) {
+    size_t used = inputScanKey(key, flush);
+
+    if (used == 0)
+      return 0;
+
+    Loop.input.head += used;
+    if (*key != PASTE)
+      return 1;
+
+    Loop.pasting = PASTE_RECEIVING;
+    abClear(&Loop.paste);
+  }
+
+  if (Loop.pasting == PASTE_RECEIVING && !inputCollectPaste())
+    return 0;
+
+  *key = PASTE;
+  Loop.pasting = PASTE_NONE;
+  return 1;
+}
+
+/// Whether a whole key can be decoded without waiting, after reading
+/// whatever the terminal already has for us.
+uint_fast8_t inputHasKey() {
+  uint64_t key = 0;
+
+  inputFill();
+
+  while (Loop.pasting == PASTE_RECEIVING && !inputCollectPaste()) {
+    size_t tail = Loop.input.tail;
+    inputFill();
+
+    if (Loop.input.tail == tail)
+      break; // The rest of the paste isn't here yet.
+  }
+  if (Loop.pasting != PASTE_NONE)
+    return Loop.pasting == PASTE_COMPLETE;
+
+  return inputScanKey(&key, 0) != 0;
+}
+
+/// The key `inputDecodeKey` gives next, left in the ring. Only meaningful
+/// once `inputHasKey` said there is one.
+uint64_t inputPeekKey() {
+  uint64_t key = PASTE;
+
+  if (Loop.pasting == PASTE_NONE)
+    inputScanKey(&key, 0);
+
+  return key;
+}
+
+/// Whether the text of a bracketed paste is still arriving.
+uint_fast8_t inputPasting() { return Loop.pasting == PASTE_RECEIVING; }
+
+appendBuffer *inputPaste() { return &Loop.paste; }
@@ -0,0 +1,623 @@
+#pragma once
+
+#include "base.c"
+#include "buffer.c"
+#include "diff.c"
+#include "grep.c"
+#include "reload.c"
+#include "trace.c"
+#include "undo.c"
+#include "wrap.c"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+/*** ex commands ***/
+#define SORT_MIN_SLICE (1 << 15) // Rows sorted by each thread, at least.
+#define FILTER_CHUNK (1 << 16)   // Bytes read from a filter at a time.
+
+/// Parses the address of a line at `*p`: a number, `.` for the line of the
+/// cursor or `$` for the last one, followed by offsets like `+2` or `-1`.
+/// Returns whether there was one.
+uint_fast8_t exAddress(const char **p, size_t *y) {
+  const char *s = *p;
+  long line = E.buf->cy + 1;
+  uint_fast8_t found = 1;
+
+  if (*s == '.') {
+    s++;
+  } else if (*s == '$') {
+    line = E.buf->num_rows;
+    s++;
+  } else if (isdigit((unsigned char)*s)) {
+    line = strtol(s, (char **)&s, 10);
+  } else {
+    found = 0;
+  }
+
+  while (*s == '+' || *s == '-') {
+    long sign = *s++ == '+' ? 1 : -1;
+    long n = isdigit((unsigned char)*s) ? strtol(s, (char **)&s, 10) : 1;
+
+    line += sign * n;
+    found = 1;
+  }
+
+  if (!found)
+    return 0;
+
+  if (line > (long)E.buf->num_rows)
+    line = E.buf->num_rows;
+  *y = line > 1 ? line - 1 : 0;
+  *p = s;
+
+  return 1;
+}
+
+/// Parses the rows a command applies to, `from` to `to` both included: `%`
+/// for all of them, or one or two addresses. Returns whether there were any.
+uint_fast8_t exRange(const char **p, size_t *from, size_t *to) {
+  if (**p == '%') {
+    (*p)++;
+    *from = 0;
+    *to = E.buf->num_rows > 0 ? E.buf->num_rows - 1 : 0;
+    return 1;
+  }
+
+  if (!exAddress(p, from))
+    return 0;
+
+  *to = *from;
+  if (**p == ',') {
+    (*p)++;
+    exAddress(p, to);
+  }
+
+  if (*from > *to) {
+    size_t swap = *from;
+    *from = *to;
+    *to = swap;
+  }
+
+  return 1;
+}
+
+/// Puts `insert` rows moved from `rows` in place of `remove` rows at `at`, as
+/// one change.
+void exPutRows(size_t at, size_t remove, row *rows, size_t insert) {
+  undoBreak();
+  undoRecord(at, remove, insert);
+  undoBreak();
+
+  row *r = editorSpliceRows(at, remove, insert);
+  memcpy(r, rows, sizeof(row) * insert);
+
+  E.buf->cy = at < E.buf->num_rows
+                  ? at
+                  : (E.buf->num_rows > 0 ? E.buf->num_rows - 1 : 0);
+  E.buf->cx = 0;
+  E.buf->dirty = 1;
+}
+
+/// Keeps the rows from `from` on that are marked in `keep`, and deletes the
+/// rest of the `n` rows, in one pass. Returns the rows deleted.
+size_t exKeepRows(size_t from, size_t n, const uint8_t *keep) {
+  size_t kept = 0;
+
+  for (size_t i = 0; i < n; i++)
+    kept += keep[i];
+
+  // Undo keeps a copy before they move.
+  undoBreak();
+  undoRecord(from, n, kept);
+  undoBreak();
+
+  row *rows = malloc(sizeof(row) * (kept + 1));
+  for (size_t i = 0, k = 0; i < n; i++) {
+    if (keep[i]) {
+      rows[k++] = E.buf->rows[from + i];
+      E.buf->rows[from + i] = (row){0}; // Not freed by the splice.
+    }
+  }
+
+  row *r = editorSpliceRows(from, n, kept);
+  memcpy(r, rows, sizeof(row) * kept);
+  free(rows);
+
+  E.buf->cy = from < E.buf->num_rows
+                  ? from
+                  : (E.buf->num_rows > 0 ? E.buf->num_rows - 1 : 0);
+  E.buf->cx = 0;
+  E.buf->dirty = 1;
+
+  return n - kept;
+}
+
+/// `:g/pattern/d` deletes the rows with `pattern`, `:v/pattern/d` the ones
+/// without it.
+void exGlobal(size_t from, size_t to, const char *arg, uint_fast8_t invert) {
+  char delim = *arg++;
+  const char *end = strchr(arg, delim);
+
+  if (delim == '\0' || end == NULL || strcmp(end + 1, "d") != 0) {
+    setStatusMessage("Only :g/pattern/d and :v/pattern/d are supported");
+    return;
+  }
+
+  uint64_t start = traceBegin();
+  size_t len = end - arg;
+  size_t n = to - from + 1;
+  uint8_t *keep = malloc(n);
+
+  for (size_t i = 0; i < n; i++) {
+    row *r = &E.buf->rows[from + i];
+    uint_fast8_t found = memmem(r->chars.buf, r->chars.len, arg, len) != NULL;
+
+    keep[i] = found == invert;
+  }
+
+  setStatusMessage("%zu fewer lines", exKeepRows(from, n, keep));
+  free(keep);
+  traceEnd("exGlobal", start);
+}
+
+/// `:uniq` deletes the rows that are the same as one before them.
+void exUniq(size_t from, size_t to) {
+  uint64_t start = traceBegin();
+  size_t n = to - from + 1;
+  size_t cap = 1;
+
+  while (cap < n * 2)
+    cap *= 2;
+
+  // First row of each text, by hash.
+  size_t *seen = malloc(sizeof(size_t) * cap);
+  memset(seen, 0xff, sizeof(size_t) * cap);
+  uint8_t *keep = malloc(n);
+
+  for (size_t i = 0; i < n; i++) {
+    row *r = &E.buf->rows[from + i];
+    size_t slot = lineHash(r->chars.buf, r->chars.len) & (cap - 1);
+
+    keep[i] = 1;
+    for (; seen[slot] != SIZE_MAX; slot = (slot + 1) & (cap - 1)) {
+      if (rowEqualsLine(&E.buf->rows[seen[slot]], r->chars.buf, r->chars.len)) {
+        keep[i] = 0;
+        break;
+      }
+    }
+
+    if (keep[i])
+      seen[slot] = from + i;
+  }
+
+  setStatusMessage("%zu fewer lines", exKeepRows(from, n, keep));
+  free(keep);
+  free(seen);
+  traceEnd("exUniq", start);
+}
+
+/// A row to sort, with its first bytes at hand so most comparisons don't
+/// have to go to its chars.
+typedef struct sortKey {
+  uint64_t prefix; // Big endian, so it compares like the bytes.
+  row *row;
+} sortKey;
+
+sortKey sortKeyOf(row *r) {
+  uint8_t bytes[8] = {0};
+  uint64_t prefix = 0;
+
+  memcpy(bytes, r->chars.buf, r->chars.len < 8 ? r->chars.len : 8);
+  for (size_t i = 0; i < 8; i++)
+    prefix = prefix << 8 | bytes[i];
+
+  return (sortKey){.prefix = prefix, .row = r};
+}
+
+int sortKeyCompare(const void *a, const void *b) {
+  const sortKey *x = a;
+  const sortKey *y = b;
+
+  if (x->prefix != y->prefix)
+    return x->prefix < y->prefix ? -1 : 1;
+
+  size_t x_len = x->row->chars.len;
+  size_t y_len = y->row->chars.len;
+  size_t len = x_len < y_len ? x_len : y_len;
+  int c = len ? memcmp(x->row->chars.buf, y->row->chars.buf, len) : 0;
+
+  if (c != 0)
+    return c;
+  return (x_len > y_len) - (x_len < y_len);
+}
+
+/// Keys `from` to `to` for a thread to sort, or the sorted ones from `from`
+/// to `mid` and from `mid` to `to` to merge, through `tmp`.
+typedef struct sortJob {
+  pthread_t thread;
+  sortKey *keys;
+  sortKey *tmp;
+  size_t from;
+  size_t mid;
+  size_t to;
+} sortJob;
+
+/// Sorts a slice by the first bytes with a radix sort, a byte at a time from
+/// the last one, and then the rows that start the same by the rest.
+void *sortSlice(void *arg) {
+  sortJob *j = arg;
+  sortKey *keys = &j->keys[j->from];
+  sortKey *tmp = &j->tmp[j->from];
+  size_t n = j->to - j->from;
+
+  for (size_t shift = 0; shift < 64; shift += 8) {
+    size_t count[257] = {0};
+
+    for (size_t i = 0; i < n; i++)
+      count[((keys[i].prefix >> shift) & 0xff) + 1]++;
+
+    // All the same byte, they stay where they are.
+    if (n == 0 || count[((keys[0].prefix >> shift) & 0xff) + 1] == n)
+      continue;
+
+    for (size_t b = 1; b < 257; b++)
+      count[b] += count[b - 1];
+    for (size_t i = 0; i < n; i++)
+      tmp[count[(keys[i].prefix >> shift) & 0xff]++] = keys[i];
+
+    sortKey *swap = keys;
+    keys = tmp;
+    tmp = swap;
+  }
+
+  if (keys != &j->keys[j->from])
+    memcpy(&j->keys[j->from], keys, sizeof(sortKey) * n);
+  keys = &j->keys[j->from];
+
+  for (size_t i = 0, end = 0; i < n; i = end) {
+    for (end = i + 1; end < n && keys[end].prefix == keys[i].prefix;)
+      end++;
+
+    if (end - i > 1)
+      qsort(&keys[i], end - i, sizeof(sortKey), sortKeyCompare);
+  }
+
+  return NULL;
+}
+
+void *mergeSlices(void *arg) {
+  sortJob *j = arg;
+  size_t a = j->from;
+  size_t b = j->mid;
+  size_t out = j->from;
+
+  while (a < j->mid && b < j->to)
+    j->tmp[out++] = sortKeyCompare(&j->keys[b], &j->keys[a]) < 0
+                        ? j->keys[b++]
+                        : j->keys[a++];
+  while (a < j->mid)
+    j->tmp[out++] = j->keys[a++];
+  while (b < j->to)
+    j->tmp[out++] = j->keys[b++];
+
+  memcpy(&j->keys[j->from], &j->tmp[j->from],
+         sizeof(sortKey) * (j->to - j->from));
+  return NULL;
+}
+
+/// Runs the jobs, all but the first on threads of their own.
+void sortRunJobs(sortJob *jobs, size_t n, void *(*run)(void *)) {
+  for (size_t i = 1; i < n; i++)
+    if (pthread_create(&jobs[i].thread, NULL, run, &jobs[i]) != 0)
+      jobs[i].thread = 0;
+
+  run(&jobs[0]);
+
+  for (size_t i = 1; i < n; i++) {
+    if (jobs[i].thread)
+      pthread_join(jobs[i].thread, NULL);
+    else
+      run(&jobs[i]);
+  }
+}
+
+/// Sorts `n` keys by the bytes of their rows. Each core sorts a slice, and
+/// the slices are merged in pairs, also in parallel.
+void sortKeys(sortKey *keys, size_t n) {
+  size_t cores = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t slices = 1;
+
+  while (slices * 2 <= cores && n / (slices * 2) >= SORT_MIN_SLICE)
+    slices *= 2;
+
+  sortKey *tmp = malloc(sizeof(sortKey) * (n + 1));
+  sortJob *jobs = calloc(slices, sizeof(sortJob));
+
+  for (size_t i = 0; i < slices; i++)
+    jobs[i] = (sortJob){.keys = keys,
+                        .tmp = tmp,
+                        .from = n * i / slices,
+                        .to = n * (i + 1) / slices};
+  sortRunJobs(jobs, slices, sortSlice);
+
+  for (size_t width = 1; width < slices; width *= 2) {
+    size_t count = 0;
+
+    for (size_t i = 0; i < slices; i += width * 2)
+      jobs[count++] = (sortJob){.keys = keys,
+                                .tmp = tmp,
+                                .from = n * i / slices,
+                                .mid = n * (i + width) / slices,
+                                .to = n * (i + width * 2) / slices};
+    sortRunJobs(jobs, count, mergeSlices);
+  }
+
+  free(jobs);
+  free(tmp);
+}
+
+/// `:sort` sorts the rows by their bytes, `:sort!` in reverse.
+void exSort(size_t from, size_t to, uint_fast8_t reverse) {
+  uint64_t start = traceBegin();
+  size_t n = to - from + 1;
+
+  undoBreak();
+  undoRecord(from, n, n);
+  undoBreak();
+
+  sortKey *keys = malloc(sizeof(sortKey) * n);
+  row *sorted = malloc(sizeof(row) * n);
+
+  for (size_t i = 0; i < n; i++)
+    keys[i] = sortKeyOf(&E.buf->rows[from + i]);
+  sortKeys(keys, n);
+
+  for (size_t i = 0; i < n; i++)
+    sorted[i] = *keys[reverse ? n - 1 - i : i].row;
+  memcpy(&E.buf->rows[from], sorted, sizeof(row) * n);
+  wrapRowsChanged(from, from + n);
+
+  free(sorted);
+  free(keys);
+
+  E.buf->cy = from;
+  E.buf->cx = 0;
+  E.buf->dirty = 1;
+  setStatusMessage("%zu lines sorted", n);
+  traceEnd("exSort", start);
+}
+
+/// Splits the output of a filter into rows.
+row *exSplitRows(const char *s, size_t len, size_t *num_rows) {
+  size_t cap = 64;
+  row *rows = malloc(sizeof(row) * cap);
+  const char *end = s + len;
+
+  *num_rows = 0;
+  for (const char *p = s; p < end;) {
+    const char *nl = memchr(p, '\n', end - p);
+    const char *line_end = nl ? nl : end;
+
+    if (*num_rows == cap) {
+      cap *= 2;
+      rows = realloc(rows, sizeof(row) * cap);
+    }
+
+    row *r = &rows[(*num_rows)++];
+    *r = (row){0};
+    abAppendN(&r->chars, p, diskLineLen(p, line_end - p));
+    updateRow(r);
+
+    p = nl ? nl + 1 : end;
+  }
+
+  return rows;
+}
+
+/// `:!command` replaces the rows with what `command` writes, to stdout or
+/// stderr, when they are its input. They are written and read at the same
+/// time, so neither side waits for the other with a full pipe.
+///
+/// The editor waits for the command to finish and doesn't read keys or draw
+/// meanwhile, so Ctrl-C doesn't stop it: one that never ends has to be killed
+/// from another terminal.
+void exFilter(size_t from, size_t to, const char *cmd) {
+  int in[2] = {-1, -1};
+  int out[2] = {-1, -1};
+
+  if (pipe2(in, O_CLOEXEC) == -1 || pipe2(out, O_CLOEXEC) == -1) {
+    setStatusMessage("Can't run %s: %s", cmd, strerror(errno));
+    return;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // The editor blocks the signals it reads from a signalfd, not the command.
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
+    dup2(in[0], STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    dup2(out[1], STDERR_FILENO);
+    execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+    _exit(127);
+  }
+
+  close(in[0]);
+  close(out[1]);
+  if (pid == -1) {
+    close(in[1]);
+    close(out[0]);
+    setStatusMessage("Can't run %s: %s", cmd, strerror(errno));
+    return;
+  }
+
+  uint64_t start = traceBegin();
+  void (*sigpipe)(int) = signal(SIGPIPE, SIG_IGN); // It may not read it all.
+  fcntl(in[1], F_SETFL, O_NONBLOCK);
+
+  appendBuffer output = newAppendBuffer();
+  appendBuffer line = newAppendBuffer();
+  size_t y = from;
+  size_t written = 0; // Of the row `y`, and its line break.
+  char *chunk = malloc(FILTER_CHUNK);
+
+  while (out[0] != -1) {
+    struct pollfd fds[2] = {{.fd = out[0], .events = POLLIN},
+                            {.fd = in[1], .events = POLLOUT}};
+
+    if (poll(fds, in[1] != -1 ? 2 : 1, -1) == -1 && errno != EINTR)
+      break;
+
+    if (fds[0].revents) {
+      ssize_t n = read(out[0], chunk, FILTER_CHUNK);
+      if (n > 0) {
+        abAppendN(&output, chunk, n);
+      } else if (n == 0 || errno != EINTR) {
+        close(out[0]);
+        out[0] = -1;
+      }
+    }
+
+    if (in[1] != -1 && fds[1].revents) {
+      // A row and its line break at a time.
+      if (written == 0) {
+        abClear(&line);
+        abAppendN(&line, E.buf->rows[y].chars.buf, E.buf->rows[y].chars.len);
+        abAppendN(&line, "\n", 1);
+      }
+
+      ssize_t n = write(in[1], &line.buf[written], line.len - written);
+      if (n > 0)
+        written += n;
+
+      if (n == -1 && errno != EAGAIN && errno != EINTR)
+        y = to + 1; // It stopped reading.
+      else if (written == line.len) {
+        written = 0;
+        y++;
+      }
+
+      if (y > to) {
+        close(in[1]);
+        in[1] = -1;
+      }
+    }
+  }
+
+  if (in[1] != -1)
+    close(in[1]);
+  int status = 0;
+  waitpid(pid, &status, 0);
+  signal(SIGPIPE, sigpipe);
+
+  size_t num_rows = 0;
+  row *rows = exSplitRows(output.buf, output.len, &num_rows);
+  exPutRows(from, to - from + 1, rows, num_rows);
+
+  if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+    setStatusMessage("%s exited with %d", cmd, WEXITSTATUS(status));
+  else
+    setStatusMessage("%zu lines filtered", to - from + 1);
+
+  free(rows);
+  free(chunk);
+  abFree(&line);
+  abFree(&output);
+  traceEnd("exFilter", start);
+}
+
+/// Runs an ex command, like `:%sort`, `:g/TODO/d` or `:10,20!fmt`. The whole
+/// range is changed in one pass and is one change to undo.
+void editorExCommand(const char *cmd) {
+  const char *p = cmd;
+  size_t from = E.buf->cy;
+  size_t to = E.buf->cy;
+
+  while (*p == ' ' || *p == ':')
+    p++;
+
+  uint_fast8_t has_range = exRange(&p, &from, &to);
+  while (*p == ' ')
+    p++;
+
+  // Commands that go over the whole file unless told otherwise.
+  if (!has_range && (*p == 'g' || *p == 'v' || strncmp(p, "sort", 4) == 0 ||
+                     strcmp(p, "uniq") == 0)) {
+    from = 0;
+    to = E.buf->num_rows > 0 ? E.buf->num_rows - 1 : 0;
+  }
+
+  if (*p == '\0') {
+    E.buf->cy = to; // Go to the line.
+    E.buf->cx = 0;
+  } else if (strcmp(p, "w") == 0) {
+    editorSave();
+  } else if (strcmp(p, "q") == 0 || strcmp(p, "q!") == 0 ||
+             strcmp(p, "wq") == 0 || strcmp(p, "x") == 0) {
+    if (p[0] == 'w' || p[0] == 'x')
+      editorSave();
+
+    buffer *modified = buffersModified();
+    if (modified && p[1] != '!') {
+      setStatusMessage("%s has unsaved changes, :q! to quit anyway",
+                       modified->filename ? modified->filename : "[No Name]");
+      return;
+    }
+    editorWrite("\x1b[2J\x1b[H", 7); // Clear screen.
+    exit(0);
+  } else if (strncmp(p, "e ", 2) == 0 && p[2] != '\0') {
+    bufferEdit(p + 2);
+  } else if (strcmp(p, "bn") == 0 || strcmp(p, "bp") == 0) {
+    bufferCycle(p[1] == 'n' ? 1 : -1);
+  } else if (p[0] == 'b' && (p[1] == ' ' || isdigit((unsigned char)p[1]))) {
+    size_t n = strtoul(p + 1, NULL, 10);
+
+    if (n >= 1 && n <= Buffers.len)
+      bufferShow(Buffers.list[n - 1]);
+    else
+      setStatusMessage("No buffer %zu", n);
+  } else if (strcmp(p, "ls") == 0) {
+    buffersList();
+  } else if (strcmp(p, "diff") == 0) {
+    diffToggle();
+  } else if (strncmp(p, "grep ", 5) == 0 && p[5] != '\0') {
+    grepCommand(p + 5);
+  } else if (E.buf->num_rows == 0) {
+    setStatusMessage("The file is empty");
+  } else if (strcmp(p, "d") == 0) {
+    uint8_t *keep = calloc(to - from + 1, 1);
+    setStatusMessage("%zu fewer lines", exKeepRows(from, to - from + 1, keep));
+    free(keep);
+  } else if (*p == 'g' || *p == 'v') {
+    exGlobal(from, to, p + 1, *p == 'v');
+  } else if (strcmp(p, "sort") == 0 || strcmp(p, "sort!") == 0) {
+    exSort(from, to, p[4] == '!');
+  } else if (strcmp(p, "uniq") == 0) {
+    exUniq(from, to);
+  } else if (*p == '!' && has_range) {
+    exFilter(from, to, p + 1);
+  } else if (*p == '!') {
+    setStatusMessage("Filters need a range, like :%%!sort");
+  } else {
+    setStatusMessage("Not a command: %s", p);
+  }
+}
+
+void editorExPrompt() {
+  char *cmd = editorPrompt(":%s", NULL);
+
+  if (cmd == NULL)
+    return;
+
+  editorExCommand(cmd);
+  free(cmd);
+}
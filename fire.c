@@ -1,9 +1,30 @@
 #include "base.c"
+#include "buffer.c"
+#include "cache.c"
+#include "complete.c"
+#include "diff.c"
+#include "event.c"
+#include "ex.c"
+#include "follow.c"
+#include "grep.c"
 #include "insertMode.c"
+#include "loader.c"
+#include "longLine.c"
+#include "macro.c"
 #include "normalMode.c"
+#include "pager.c"
+#include "register.c"
+#include "reload.c"
+#include "theme.c"
+#include "trace.c"
+#include "undo.c"
+#include "watch.c"
+#include "word.c"
+#include "wrap.c"
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <sys/ioctl.h>
@@ -17,11 +38,34 @@ void die(const char *s) {
   exit(1);
 }
 
+/// Writes to the terminal, or only counts the bytes when running headless.
+void editorWrite(const char *buf, size_t len) {
+  E.bytes_written += len;
+
+  if (!E.headless)
+    write(STDOUT_FILENO, buf, len);
+}
+
 void disableRawMode() {
+  editorWrite("\x1b[?2004l", 8); // Disable bracketed paste.
+
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
     die("tcsetattr");
 }
 
+/// Takes the text piped into stdin and puts the terminal in its place, so
+/// keys are read from it as usual. Returns the descriptor of the pipe.
+int reopenTerminal() {
+  int fd = dup(STDIN_FILENO);
+  int tty = open("/dev/tty", O_RDWR);
+
+  if (fd == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1)
+    die("/dev/tty");
+
+  close(tty);
+  return fd;
+}
+
 void enableRawMode() {
   if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1)
     die("tcgetattr");
@@ -35,91 +79,76 @@ void enableRawMode() {
   raw.c_cflag |= (CS8);
   raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
 
-  // Control Characters
+  // Control Characters. Reads never block, waiting is left to `poll`.
   raw.c_cc[VMIN] = 0;
-  raw.c_cc[VTIME] = 1;
+  raw.c_cc[VTIME] = 0;
 
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
     die("tcsetattr");
+
+  // Enable bracketed paste, so pastes arrive as a single `PASTE` key.
+  editorWrite("\x1b[?2004h", 8);
 }
 
-uint64_t readKey() {
-  uint64_t c = '\0';
-  int32_t nread = 0;
-
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN)
-      die("read");
-  }
-
-  // Handle multibyte sequences.
-  if (c == '\x1b') {
-    uint64_t seq[3] = {0};
-    if (read(STDIN_FILENO, &seq[0], 1) != 1)
-      return c;
-
-    if (read(STDIN_FILENO, &seq[1], 1) != 1)
-      return c;
-
-    if (seq[0] == '[') {
-      if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1)
-          return (int64_t)'\x1b';
-
-        if (seq[2] == '~') {
-          switch (seq[1]) {
-          case '1':
-            return HOME_KEY;
-          case '4':
-            return END_KEY;
-          case '5':
-            return PAGE_UP;
-          case '6':
-            return PAGE_DOWN;
-          case '7':
-            return HOME_KEY;
-          case '8':
-            return END_KEY;
-          }
-        }
-      } else {
-        switch (seq[1]) {
-        // Arrow keys
-        case 'A':
-          return ARROW_UP;
-        case 'B':
-          return ARROW_DOWN;
-        case 'C':
-          return ARROW_RIGHT;
-        case 'D':
-          return ARROW_LEFT;
-        case 'H':
-          return HOME_KEY;
-        case 'F':
-          return END_KEY;
-        }
-      }
-    } else if (seq[0] == 'O') {
-      switch (seq[1]) {
-      case 'H':
-        return HOME_KEY;
-      case 'F':
-        return END_KEY;
-      }
+/// Blocks until a key is available, serving the other events (background
+/// loading, timers, signals) and redrawing the screen for them meanwhile.
+uint64_t readTypedKey() {
+  uint64_t key = 0;
+  uint64_t esc_deadline = 0;
+
+  // The whole script is there already, running out of it cancels any prompt.
+  while (E.headless && !inputDecodeKey(&key, 1)) {
+    size_t pending = inputPending();
+    inputFill();
+
+    if (inputPending() == pending)
+      return ESC;
+  }
+  if (E.headless)
+    return key;
+
+  while (!inputDecodeKey(&key, esc_deadline && nowMs() >= esc_deadline)) {
+    int64_t wait = -1;
+
+    // Half an escape sequence, give the rest of it a moment to arrive.
+    if (inputPending() != 0 && !inputPasting()) {
+      if (esc_deadline == 0)
+        esc_deadline = nowMs() + ESC_SEQ_TIMEOUT_MS;
+      wait = esc_deadline > nowMs() ? (int64_t)(esc_deadline - nowMs()) : 0;
     }
+
+    if (eventWait(wait))
+      editorRefreshScreen();
   }
 
-  return c;
+  return key;
 }
 
-void getCursorPosition() {
+/// The next key, typed or from the macro being replayed. Typed keys go into
+/// the macro being recorded, the ones typed at prompts too.
+uint64_t readKey() {
+  if (macroReplaying())
+    return macroNextKey();
+
+  uint64_t key = readTypedKey();
+  macroKeyTyped(key);
+
+  return key;
+}
+
+/// Asks the terminal where the cursor is, from 1.
+void getCursorPosition(unsigned long *row, unsigned long *col) {
   char buf[32] = {0};
   uint_fast16_t i = 0;
 
   write(STDOUT_FILENO, "\x1b[6n", 4);
 
+  // Reads don't wait in raw mode, the reply is given a moment to arrive.
   while (i < (sizeof(buf) - 1)) {
-    if (read(STDIN_FILENO, &buf[i], 1) != 1)
+    struct pollfd in = {.fd = STDIN_FILENO, .events = POLLIN};
+
+    if (poll(&in, 1, CURSOR_REPLY_MS) != 1 ||
+        read(STDIN_FILENO, &buf[i], 1) != 1)
       break;
     if (buf[i] == 'R')
       break;
@@ -131,7 +160,7 @@ void getCursorPosition() {
   if (buf[0] != '\x1b' || buf[1] != '[')
     die("cursor");
 
-  if (sscanf(&buf[2], "%lu;%lu", &E.cx, &E.cy) != 2)
+  if (sscanf(&buf[2], "%lu;%lu", row, col) != 2)
     die("cursor");
 }
 
@@ -140,11 +169,14 @@ void getWindowSize() {
 
   if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
     // Put cursor at the end of the screen and read the position.
+    unsigned long rows = 0;
+    unsigned long cols = 0;
+
     write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12);
-    getCursorPosition();
+    getCursorPosition(&rows, &cols);
 
-    E.screen_cols = E.cx;
-    E.screen_rows = E.cy;
+    E.screen_cols = cols;
+    E.screen_rows = rows;
   } else {
     E.screen_cols = ws.ws_col;
     E.screen_rows = ws.ws_row;
@@ -154,190 +186,542 @@ void getWindowSize() {
 /*** syntax highlighting ***/
 
 void editorUpdateSyntax(row *row) {
-  row->hl = realloc(row->hl, row->render.len + 1);
-  memset(row->hl, HL_NORMAL, row->render.len);
+  // Rows without highlighted areas don't need a highlight map.
+  free(row->hl);
+  row->hl = NULL;
 
   // TODO Add logic that sets the highlighted areas.
 }
 
-uint8_t editorSyntaxToColor(uint8_t hl) {
+themeColor editorSyntaxToColor(uint8_t hl) {
   switch (hl) {
   case HL_NUMBER:
-    return 31;
+    return THEME_NUMBER;
 
   case HL_MATCH:
-    return 34;
+    return THEME_MATCH;
 
   default:
-    return 37;
+    return THEME_TEXT;
   }
 }
 
 /*** row operations ***/
 
+/// Walks `len` chars of a row that start at column `start`, expanding tabs to
+/// the next tab stop and replacing invalid UTF-8. Writes the result to `out`
+/// unless it's NULL. Returns the bytes of the result, and the columns it takes
+/// and the layout flags of the chars through `cols` and `flags`.
+size_t rowRenderChars(const char *s, size_t len, size_t start, char *out,
+                      size_t *cols, uint8_t *flags) {
+  size_t col = start;
+  size_t idx = 0;
+
+  *flags = ROW_LAID_OUT | ROW_ASCII;
+
+  for (size_t j = 0; j < len;) {
+    size_t ascii = utf8AsciiPrefix(&s[j], len - j);
+    const char *tab = NULL;
+
+    while (ascii > 0 && (tab = memchr(&s[j], '\t', ascii))) {
+      size_t before = tab - &s[j];
+      size_t spaces = TAB_STOP - (col + before) % TAB_STOP;
+
+      if (out) {
+        memcpy(&out[idx], &s[j], before);
+        memset(&out[idx + before], ' ', spaces);
+      }
+
+      col += before + spaces;
+      idx += before + spaces;
+      j += before + 1;
+      ascii -= before + 1;
+      *flags |= ROW_TABS;
+    }
+
+    if (out)
+      memcpy(&out[idx], &s[j], ascii);
+    col += ascii;
+    idx += ascii;
+    j += ascii;
+
+    if (j == len)
+      break;
+
+    uint32_t cp = 0;
+    size_t n = utf8Decode(&s[j], len - j, &cp);
+
+    if (cp == UTF8_REPLACEMENT) {
+      // Also covers a valid replacement char, it has the same bytes.
+      if (out)
+        memcpy(&out[idx], UTF8_REPLACEMENT_STR, 3);
+      idx += 3;
+    } else {
+      if (out)
+        memcpy(&out[idx], &s[j], n);
+      idx += n;
+    }
+
+    size_t width = codepointWidth(cp);
+    if (width > 1)
+      *flags |= ROW_WIDE;
+
+    col += width;
+    j += n;
+    *flags &= ~ROW_ASCII;
+  }
+
+  *cols = col - start;
+  return idx;
+}
+
+/// Makes sure `width` and `flags` describe the row. Rows loaded from a file
+/// share the render with the chars and are only checked when first needed,
+/// the ones that turn out to have invalid UTF-8 get their own render.
+void rowLayout(row *r) {
+  if (r->flags & ROW_LAID_OUT)
+    return;
+
+  if (r->chars.buf == NULL || r->render.buf != r->chars.buf ||
+      r->chars.len >= LONG_LINE) {
+    updateRow(r);
+    return;
+  }
+
+  size_t cols = 0;
+  uint8_t flags = 0;
+  size_t len =
+      rowRenderChars(r->chars.buf, r->chars.len, 0, NULL, &cols, &flags);
+
+  if (len != r->chars.len || (flags & ROW_TABS)) {
+    updateRow(r);
+    return;
+  }
+
+  r->width = cols;
+  r->flags = flags;
+}
+
 /// Translates the pointer position from actual to render.
 uint_fast32_t editorRowCxToRx(row *row, uint_fast32_t cx) {
-  uint_fast32_t rx = 0;
+  uint8_t flags = 0;
+  size_t rx = 0;
 
-  for (uint_fast32_t j = 0; j < cx; j++) {
-    if (row->chars.buf[j] == '\t')
-      rx += TAB_STOP - (rx % TAB_STOP);
+  rowLayout(row);
 
-    rx++;
-  }
+  if (cx > row->chars.len)
+    cx = row->chars.len;
+
+  if ((row->flags & (ROW_ASCII | ROW_TABS)) == ROW_ASCII)
+    return cx;
 
-  return rx;
+  // Long lines only walk the chunk with `cx`.
+  size_t start = 0;
+  size_t col = 0;
+  if (row->index)
+    lineIndexFindByte(row, cx, &start, &col);
+
+  rowRenderChars(&row->chars.buf[start], cx - start, col, NULL, &rx, &flags);
+  return col + rx;
 }
 
+/// Translates the render position to the chars one, of the char that covers
+/// column `rx`.
 uint_fast32_t editorRowRxToCx(row *row, uint_fast32_t rx) {
-  uint_fast32_t cur_rx = 0;
-  uint_fast32_t cx = 0;
-
-  for (cx = 0; cx < row->chars.len; cx++) {
-    if (row->chars.buf[cx] == '\t')
-      cur_rx += (TAB_STOP - 1) - (cur_rx % TAB_STOP);
-    cur_rx++;
+  const char *s = row->chars.buf;
+  size_t len = row->chars.len;
+  size_t col = 0;
+  size_t cx = 0;
+
+  rowLayout(row);
+
+  if ((row->flags & (ROW_ASCII | ROW_TABS)) == ROW_ASCII)
+    return rx < len ? rx : len;
+
+  // Long lines only walk the chunk shown at `rx`.
+  if (row->index)
+    lineIndexFindCol(row, rx, &cx, &col);
+
+  while (cx < len) {
+    size_t n = 1;
+    size_t w = 1;
+
+    if (s[cx] == '\t') {
+      w = TAB_STOP - col % TAB_STOP;
+    } else if ((unsigned char)s[cx] >= 0x80) {
+      uint32_t cp = 0;
+      n = utf8Decode(&s[cx], len - cx, &cp);
+      w = codepointWidth(cp);
+    }
 
-    if (cur_rx > rx)
+    if (col + w > rx)
       return cx;
+
+    col += w;
+    cx += n;
   }
 
   return cx;
 }
 
-/// Copies Chars into Renders and replaces tabs for spaces
-void updateRow(row *r) {
-  size_t tabs = 0;
+/// Start of the char after the one at `cx`, combining marks go with the char
+/// they modify.
+size_t editorRowNextChar(row *row, size_t cx) {
+  const char *s = row->chars.buf;
+  size_t len = row->chars.len;
+  uint32_t cp = 0;
 
-  for (size_t j = 0; j < r->chars.len; j++)
-    if (r->chars.buf[j] == '\t')
-      tabs++;
+  if (cx >= len)
+    return len;
 
-  // More memory for the spaces.
-  abResize(&r->render, r->chars.len + tabs * (TAB_STOP - 1) + 1);
+  cx += utf8Decode(&s[cx], len - cx, &cp);
 
-  // Replace tabs for 8 spaces.
-  size_t idx = 0;
+  while (cx < len && (unsigned char)s[cx] >= 0x80) {
+    size_t n = utf8Decode(&s[cx], len - cx, &cp);
 
-  for (size_t j = 0; j < r->chars.len; j++) {
-    if (r->chars.buf[j] == '\t') {
-      for (int_fast8_t i = 0; i < TAB_STOP; i++)
-        r->render.buf[idx++] = ' ';
-    } else {
-      r->render.buf[idx++] = r->chars.buf[j];
+    if (codepointWidth(cp) != 0)
+      break;
+    cx += n;
+  }
+
+  return cx;
+}
+
+/// Start of the char before `cx`, skipping back over combining marks.
+size_t editorRowPrevChar(row *row, size_t cx) {
+  const char *s = row->chars.buf;
+
+  while (cx > 0) {
+    size_t start = cx - 1;
+    uint32_t cp = 0;
+
+    // Up to 3 continuation bytes, as long as they make a char that ends at
+    // `cx`, otherwise invalid bytes are single chars.
+    for (size_t back = 1; back <= 4 && back <= cx; back++) {
+      if (!utf8IsContinuation(s[cx - back])) {
+        if (utf8Decode(&s[cx - back], back, &cp) == back)
+          start = cx - back;
+        break;
+      }
     }
+
+    if (start == cx - 1)
+      utf8Decode(&s[start], 1, &cp);
+
+    cx = start;
+    if (codepointWidth(cp) != 0)
+      break;
   }
 
-  r->render.buf[idx] = '\0';
-  r->render.len = idx;
+  return cx;
+}
 
-  editorUpdateSyntax(r);
+/// Long lines stay long until they are half as long, so editing around the
+/// limit doesn't switch them back and forth.
+uint_fast8_t rowIsLong(row *r) {
+  return r->chars.len >= (r->index ? LONG_LINE / 2 : LONG_LINE);
 }
 
-void insertRowAt(char *s, size_t at) {
-  if (at > E.num_rows)
+/// Copies Chars into Renders, with tabs expanded to the next tab stop.
+void updateRow(row *r) {
+  uint64_t start = traceBeginMain();
+  size_t cols = 0;
+  uint8_t flags = 0;
+
+  // Rows are never left without a buffer, even if empty.
+  if (r->chars.buf == NULL) {
+    abResize(&r->chars, 0);
+    r->chars.buf[0] = '\0'; // Null terminated
+  }
+  rowWordsFree(r);
+
+  // Rows loaded from a file without tabs share the render with the chars.
+  if (r->render.cap == 0)
+    r->render = (appendBuffer){0};
+
+  // Rows put from a register hold it until they have chars of their own.
+  if (r->shared && r->chars.cap != 0) {
+    rowStoreRelease(r->shared);
+    r->shared = NULL;
+  }
+
+  if (rowIsLong(r)) {
+    // Drawn straight from the chars, see `editorDrawLongRow`.
+    abFree(&r->render);
+    r->render = (appendBuffer){0};
+    lineIndexBuild(r);
+
+    editorUpdateSyntax(r);
+    traceEnd("updateRow", start);
     return;
+  }
+  lineIndexFree(r);
+
+  size_t len =
+      rowRenderChars(r->chars.buf, r->chars.len, 0, NULL, &cols, &flags);
 
-  // TODO efficient resize.
-  E.rows = realloc(E.rows, sizeof(row) * (E.num_rows + 1));
-  memmove(&E.rows[at + 1], &E.rows[at], sizeof(row) * (E.num_rows - at));
+  abResize(&r->render, len);
+  rowRenderChars(r->chars.buf, r->chars.len, 0, r->render.buf, &cols, &flags);
 
-  E.rows[at] = new_row();
-  abAppend(&E.rows[at].chars, s);
-  updateRow(&E.rows[at]);
+  r->render.buf[len] = '\0';
+  r->render.len = len;
+  r->width = cols;
+  r->flags = flags;
 
-  E.num_rows++;
+  editorUpdateSyntax(r);
+  traceEnd("updateRow", start);
+}
+
+/// Like `updateRow`, after `removed` bytes at `at` were replaced with
+/// `inserted` ones. Long lines only lay out the chunks around them again.
+void updateRowRange(row *r, size_t at, size_t removed, size_t inserted) {
+  if (r->index == NULL || !rowIsLong(r)) {
+    updateRow(r);
+    return;
+  }
+
+  uint64_t start = traceBeginMain();
+  rowWordsFree(r);
+  lineIndexEdit(r, at, removed, inserted);
+  editorUpdateSyntax(r);
+  traceEnd("updateRowRange", start);
 }
 
 void editorFreeRow(row *row) {
   abFree(&row->chars);
   abFree(&row->render);
   free(row->hl);
+  lineIndexFree(row);
+  rowWordsFree(row);
+  rowStoreRelease(row->shared);
 }
 
-void editorDelRow(size_t at) {
-  if (at >= (size_t)E.num_rows)
+/// Replaces `remove` rows at `at` with `insert` zeroed rows, shifting the rows
+/// after them only once. The new rows must go through `updateRow` before they
+/// are displayed. Returns the first inserted row.
+row *editorSpliceRows(size_t at, size_t remove, size_t insert) {
+  wrapSplice(at, remove, insert);
+
+  for (size_t i = 0; i < remove; i++)
+    editorFreeRow(&E.buf->rows[at + i]);
+
+  size_t num_rows = E.buf->num_rows - remove + insert;
+
+  if (num_rows > E.buf->rows_cap) {
+    E.buf->rows_cap =
+        num_rows > E.buf->rows_cap * 2 ? num_rows : E.buf->rows_cap * 2;
+    E.buf->rows = realloc(E.buf->rows, sizeof(row) * E.buf->rows_cap);
+  }
+
+  size_t after = E.buf->num_rows - at - remove;
+
+  if (remove != insert && after)
+    memmove(&E.buf->rows[at + insert], &E.buf->rows[at + remove],
+            sizeof(row) * after);
+  if (insert)
+    memset(&E.buf->rows[at], 0, sizeof(row) * insert);
+  E.buf->num_rows = num_rows;
+
+  return &E.buf->rows[at];
+}
+
+void insertRowAt(char *s, size_t at) {
+  if (at > E.buf->num_rows)
     return;
 
-  editorFreeRow(&E.rows[at]);
+  undoRecord(at, 0, 1);
+  row *r = editorSpliceRows(at, 0, 1);
+  abAppend(&r->chars, s);
+  updateRow(r);
+}
 
-  memmove(&E.rows[at], &E.rows[at + 1], sizeof(row) * (E.num_rows - at - 1));
+/// Deletes `n` rows from `at` on, or as many as there are.
+void editorDelRows(size_t at, size_t n) {
+  if (at >= (size_t)E.buf->num_rows)
+    return;
+  if (n > E.buf->num_rows - at)
+    n = E.buf->num_rows - at;
 
-  E.num_rows--;
-  E.dirty = 1; // Mark file as dirty.
+  undoRecord(at, n, 0);
+  editorSpliceRows(at, n, 0);
+  E.buf->dirty = 1; // Mark file as dirty.
 }
 
-void rowInsertChar(row *row, size_t at, size_t c) {
-  abInsertAt(&row->chars, at, c);
-  updateRow(row);
+void editorDelRow(size_t at) { editorDelRows(at, 1); }
+
+/// Finds the next line break, either `\n`, `\r` or `\r\n`.
+const char *findLineBreak(const char *p, const char *end) {
+  while (p < end && *p != '\n' && *p != '\r')
+    p++;
+
+  return p;
 }
 
-void rowDelChar(row *row, size_t at) {
-  abRemoveAt(&row->chars, at);
-  updateRow(row);
+const char *skipLineBreak(const char *p, const char *end) {
+  if (p + 1 < end && p[0] == '\r' && p[1] == '\n')
+    return p + 2;
 
-  E.dirty = 1; // Mark file as dirty.
+  return p + 1;
 }
 
-void editorRowAppendString(row *src, row *dst) {
-  abAppend(&dst->chars, src->chars.buf);
-  updateRow(dst);
+/// Moves `pos` inside the text of the file.
+textPos editorClampPos(textPos pos) {
+  if (pos.y >= E.buf->num_rows) {
+    pos.y = E.buf->num_rows - 1;
+    pos.x = E.buf->rows[pos.y].chars.len;
+  }
+  if (pos.x > E.buf->rows[pos.y].chars.len)
+    pos.x = E.buf->rows[pos.y].chars.len;
 
-  E.dirty = 1; // Mark file as dirty.
+  return pos;
 }
 
-void editorInsertNewline() {
-  if (E.cx == 0) {
-    insertRowAt("", E.cy);
-  } else {
-    row *row = &E.rows[E.cy];
+/// Replaces the text from `from` up to `to` (exclusive) with `len` bytes of
+/// `s`, which may span several lines. Rows are joined, split and shifted only
+/// once no matter how many lines are involved, and each touched row is
+/// rendered once. Returns the position right after the inserted text.
+textPos editorReplaceRange(textPos from, textPos to, const char *s,
+                           size_t len) {
+  uint64_t start = traceBegin();
+  const char *end = s + len;
+  const char *line_end = findLineBreak(s, end);
+  size_t new_rows = 0;
+
+  for (const char *p = line_end; p < end;
+       p = findLineBreak(skipLineBreak(p, end), end))
+    new_rows++;
+
+  // An empty file gets a row to edit, which wasn't there to undo.
+  uint_fast8_t was_empty = E.buf->num_rows == 0;
+  if (was_empty)
+    editorSpliceRows(0, 0, 1);
+
+  from = editorClampPos(from);
+  to = editorClampPos(to);
+  undoRecord(from.y, was_empty ? 0 : to.y - from.y + 1, new_rows + 1);
+
+  // What is left of the last row after `to` goes after the inserted text.
+  row *last = &E.buf->rows[to.y];
+  const char *tail = &last->chars.buf[to.x];
+  size_t tail_len = last->chars.len - to.x;
+  textPos pos = {.y = from.y + new_rows, .x = 0};
+
+  // Build the rows after the first one, before the tail is overwritten.
+  row *built = new_rows ? malloc(sizeof(row) * new_rows) : NULL;
+  const char *p = line_end;
+
+  for (size_t i = 0; i < new_rows; i++) {
+    const char *start = skipLineBreak(p, end);
+    p = findLineBreak(start, end);
+
+    // Empty lines keep borrowing an empty string, like the rows of a file.
+    built[i] = (row){.chars = abBorrow("", 0)};
+    abAppendN(&built[i].chars, start, p - start);
+
+    if (i == new_rows - 1) {
+      pos.x = built[i].chars.len;
+      abAppendN(&built[i].chars, tail, tail_len);
+    }
+    updateRow(&built[i]);
+  }
 
-    insertRowAt(&row->chars.buf[E.cx], E.cy + 1); // TODO fix length maybe
-    row = &E.rows[E.cy];
-    row->chars.len = E.cx;
-    row->chars.buf[row->chars.len] = '\0';
+  row *first = &E.buf->rows[from.y];
+
+  if (new_rows == 0 && from.y == to.y) {
+    abRemoveRange(&first->chars, from.x, to.x - from.x);
+    abInsertN(&first->chars, from.x, s, len);
+    pos.x = from.x + len;
+  } else {
+    abTruncate(&first->chars, from.x);
+    abAppendN(&first->chars, s, line_end - s);
 
-    updateRow(row);
+    if (new_rows == 0) {
+      pos.x = first->chars.len;
+      abAppendN(&first->chars, tail, tail_len);
+    }
   }
 
-  E.cx = 0;
-  E.cy++;
+  editorSpliceRows(from.y + 1, to.y - from.y, new_rows);
+  if (new_rows)
+    memcpy(&E.buf->rows[from.y + 1], built, sizeof(row) * new_rows);
+
+  if (new_rows == 0 && from.y == to.y)
+    updateRowRange(&E.buf->rows[from.y], from.x, to.x - from.x, len);
+  else
+    updateRow(&E.buf->rows[from.y]);
+  wrapRowsChanged(from.y, from.y + 1);
+
+  free(built);
+  E.buf->dirty = 1; // Mark file as dirty.
+  traceEnd("editorReplaceRange", start);
+
+  return pos;
+}
+
+textPos editorInsertTextAt(textPos at, const char *s, size_t len) {
+  return editorReplaceRange(at, at, s, len);
+}
+
+void editorDeleteRange(textPos from, textPos to) {
+  editorReplaceRange(from, to, "", 0);
+}
+
+/*** editor operations ***/
+
+/// Inserts `len` bytes of `s` at the cursor and leaves the cursor after them.
+void editorInsertText(const char *s, size_t len) {
+  if (E.buf->cy == E.buf->num_rows)
+    insertRowAt("", E.buf->num_rows);
+
+  textPos pos =
+      editorInsertTextAt((textPos){.y = E.buf->cy, .x = E.buf->cx}, s, len);
+  E.buf->cy = pos.y;
+  E.buf->cx = pos.x;
+}
+
+void editorInsertChar(size_t c) {
+  char ch = c;
+  editorInsertText(&ch, 1);
 }
 
+void editorInsertNewline() { editorInsertText("\n", 1); }
+
 void editorDelChar() {
-  if (E.cy == E.num_rows)
+  if (E.buf->cy == E.buf->num_rows)
     return;
 
   // On the first char of the file.
-  if (E.cx == 0 && E.cy == 0)
+  if (E.buf->cx == 0 && E.buf->cy == 0)
     return;
 
-  row *row = &E.rows[E.cy];
+  textPos to = {.y = E.buf->cy, .x = E.buf->cx};
 
-  if (E.cx > 0) {
-    rowDelChar(row, E.cx - 1);
-    E.cx--;
+  if (E.buf->cx > 0) {
+    E.buf->cx = editorRowPrevChar(&E.buf->rows[E.buf->cy], E.buf->cx);
   } else {
     // At the beginning of a line, we have to move the contents of the current
     // line to the one above it.
-    E.cx = E.rows[E.cy - 1].chars.len;
-    editorRowAppendString(row, &E.rows[E.cy - 1]);
-    editorDelRow(E.cy);
-    E.cy--;
+    E.buf->cy--;
+    E.buf->cx = E.buf->rows[E.buf->cy].chars.len;
   }
 
-  E.dirty = 1;
+  editorDeleteRange((textPos){.y = E.buf->cy, .x = E.buf->cx}, to);
 }
 
-/*** editor operations ***/
-void editorInsertChar(size_t c) {
-  if (E.cy == E.num_rows) {
-    insertRowAt("", 0);
-  }
+/// Joins the line below the cursor to the end of the current one, separated
+/// by a space and without its indentation.
+void editorJoinLines() {
+  if (E.buf->cy + 1 >= E.buf->num_rows)
+    return;
+
+  row *next = &E.buf->rows[E.buf->cy + 1];
+  size_t indent = strspn(next->chars.buf, " \t");
+  uint_fast8_t space =
+      E.buf->rows[E.buf->cy].chars.len != 0 && indent != next->chars.len;
 
-  rowInsertChar(&E.rows[E.cy], E.cx, c);
-  E.cx++;
-  E.dirty = 1; // Mark file as dirty.
+  E.buf->cx = E.buf->rows[E.buf->cy].chars.len;
+  editorReplaceRange((textPos){.y = E.buf->cy, .x = E.buf->cx},
+                     (textPos){.y = E.buf->cy + 1, .x = indent}, " ", space);
 }
 
 /*** file I/O ***/
@@ -346,58 +730,54 @@ void editorInsertChar(size_t c) {
 appendBuffer editorRowsToString() {
   appendBuffer ab = newAppendBuffer();
 
-  for (uint_fast32_t idx = 0; idx < E.num_rows; idx++) {
-    abAppend(&ab, E.rows[idx].chars.buf);
-    abAppend(&ab, "\n");
+  for (uint_fast32_t idx = 0; idx < E.buf->num_rows; idx++) {
+    // By length, rows can have null bytes in them.
+    abAppendN(&ab, E.buf->rows[idx].chars.buf, E.buf->rows[idx].chars.len);
+    abAppendChar(&ab, '\n');
   }
 
   return ab;
 }
 
+/// Opens the file and starts loading it in the background, returns as soon as
+/// the first screen is available.
 void editorOpen(char *filename) {
-  FILE *fp = fopen(filename, "r");
-
-  if (!fp)
-    die("fopen");
-
-  E.filename = strdup(filename);
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen = -1;
+  int fd = open(filename, O_RDONLY);
 
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+  if (fd == -1)
+    die("open");
 
-    while (linelen > 0 &&
-           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-      linelen--;
-
-    line[linelen] = '\0';
-    insertRowAt(line, E.num_rows);
-  }
-
-  free(line);
-  fclose(fp);
+  uint64_t start = traceBegin();
+  E.buf->filename = strdup(filename);
+  editorLoadStart(fd);
+  traceEnd("editorOpen", start);
 }
 
 void editorSave() {
   // TODO Will this block the UI? Probably. Make the save async.
-  if (E.filename == NULL) {
-    E.filename = editorPrompt("Save as: %s", NULL);
+  if (E.buf->loader) {
+    setStatusMessage("Can't save while the file is still loading");
+    return;
+  }
+
+  if (E.buf->filename == NULL) {
+    E.buf->filename = editorPrompt("Save as: %s", NULL);
 
-    if (E.filename == NULL) {
+    if (E.buf->filename == NULL) {
       setStatusMessage("Save aborted");
       return;
     }
   }
 
   // 0644: Owner can read an write, everyone else just read.
-  int64_t fd = open(E.filename, O_RDWR | O_CREAT, 0644);
+  int64_t fd = open(E.buf->filename, O_RDWR | O_CREAT, 0644);
 
   if (fd == -1) {
     close(fd);
     return;
   }
 
+  uint64_t start = traceBegin();
   appendBuffer file_content = editorRowsToString();
 
   if (ftruncate(fd, file_content.len) == -1 ||
@@ -406,11 +786,19 @@ void editorSave() {
     setStatusMessage("Can't save! I/O error: %s", strerror(errno));
   } else {
     setStatusMessage("%d bytes written to disk", file_content.len);
-    E.dirty = 0; // Mark file as clean.
+    E.buf->dirty = 0; // Mark file as clean.
+
+    // Not a change to reload.
+    struct stat st = {0};
+    if (fstat(fd, &st) == 0)
+      E.buf->file_stamp = fileStampOf(&st);
+    watchStart();
+    diffSchedule(); // The file is the rows now.
   }
 
   close(fd);
   abFree(&file_content);
+  traceEnd("editorSave", start);
 }
 
 /*** find ***/
@@ -419,15 +807,15 @@ void editorFindCallback(char *query, size_t key) {
   static ssize_t last_match = -1;
   static ssize_t direction = 1;
 
-  static size_t saved_hl_line = 0;
-  static char *saved_hl = NULL;
+  static ssize_t saved_hl_line = -1;
+  static uint8_t *saved_hl = NULL;
 
-  if (saved_hl) {
+  if (saved_hl_line != -1) {
     // Restore previous highlighted match.
-    memcpy(E.rows[saved_hl_line].hl, saved_hl,
-           E.rows[saved_hl_line].render.len);
-    free(saved_hl);
+    free(E.buf->rows[saved_hl_line].hl);
+    E.buf->rows[saved_hl_line].hl = saved_hl;
     saved_hl = NULL;
+    saved_hl_line = -1;
   }
 
   if (key == ENTER || key == ESC) {
@@ -449,43 +837,66 @@ void editorFindCallback(char *query, size_t key) {
     direction = 1;
 
   ssize_t current = last_match;
+  size_t query_len = strlen(query);
+  uint64_t start = traceBegin();
 
-  for (uint_fast32_t i = 0; i < E.num_rows; i++) {
+  for (uint_fast32_t i = 0; i < E.buf->num_rows; i++) {
     current += direction;
 
     if (current == -1)
-      current = E.num_rows - 1;
-    else if (current == (ssize_t)E.num_rows)
+      current = E.buf->num_rows - 1;
+    else if (current == (ssize_t)E.buf->num_rows)
       current = 0;
 
-    row *row = &E.rows[current];
-    char *match = strstr(row->render.buf, query);
+    row *row = &E.buf->rows[current];
+    char *match = memmem(row->chars.buf, row->chars.len, query, query_len);
 
     if (match) {
       last_match = current;
-      E.cy = current;
-      E.cx = editorRowRxToCx(row, match - row->render.buf);
-      E.row_offset = E.num_rows;
+      E.buf->cy = current;
+      E.buf->cx = match - row->chars.buf;
+      E.buf->row_offset = E.buf->num_rows;
+
+      // Long lines have no render to highlight.
+      if (rowIsLong(row))
+        break;
+      rowLayout(row);
+
+      // Where the match is in the render.
+      size_t cols = 0;
+      uint8_t flags = 0;
+      size_t hl_start =
+          rowRenderChars(row->chars.buf, E.buf->cx, 0, NULL, &cols, &flags);
+      size_t hl_len =
+          rowRenderChars(match, query_len, cols, NULL, &cols, &flags);
 
       // Highlight the match, and save the line to restore it later.
       saved_hl_line = current;
-      saved_hl = calloc(sizeof(row->render.buf), row->render.len);
-      memcpy(saved_hl, row->hl, row->render.len);
-      memset(&row->hl[match - row->render.buf], HL_MATCH, strlen(query));
+      saved_hl = row->hl;
+      row->hl = malloc(row->render.len + 1);
+
+      if (saved_hl)
+        memcpy(row->hl, saved_hl, row->render.len);
+      else
+        memset(row->hl, HL_NORMAL, row->render.len);
+
+      memset(&row->hl[hl_start], HL_MATCH, hl_len);
 
       break;
     }
   }
+
+  traceEnd("search", start);
 }
 
 /// Prompts the user for a string and moves the cursor to the first match in
 /// the file.
 void editorFind() {
   // TODO Highlight all the matches.
-  uint_fast32_t saved_cx = E.cx;
-  uint_fast32_t saved_cy = E.cy;
-  uint_fast32_t saved_rowoff = E.row_offset;
-  uint_fast32_t saved_coloff = E.col_offset;
+  uint_fast32_t saved_cx = E.buf->cx;
+  uint_fast32_t saved_cy = E.buf->cy;
+  uint_fast32_t saved_rowoff = E.buf->row_offset;
+  uint_fast32_t saved_coloff = E.buf->col_offset;
 
   char *query =
       editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
@@ -494,10 +905,10 @@ void editorFind() {
     free(query);
   } else {
     // Restore the cursor position.
-    E.cx = saved_cx;
-    E.cy = saved_cy;
-    E.row_offset = saved_rowoff;
-    E.col_offset = saved_coloff;
+    E.buf->cx = saved_cx;
+    E.buf->cy = saved_cy;
+    E.buf->row_offset = saved_rowoff;
+    E.buf->col_offset = saved_coloff;
   }
 }
 
@@ -515,9 +926,20 @@ char *editorPrompt(char *prompt, void (*callback)(char *, size_t)) {
 
     switch (c) {
     case BACKSPACE:
+      // The whole char, not just its last byte.
+      while (input.len > 1 && utf8IsContinuation(input.buf[input.len - 1]))
+        abPop(&input);
       abPop(&input);
       break;
 
+    case PASTE: {
+      // Only the first line, the prompt is a single line.
+      appendBuffer *paste = inputPaste();
+      abAppendN(&input, paste->buf,
+                findLineBreak(paste->buf, paste->buf + paste->len) -
+                    paste->buf);
+    } break;
+
     case ESC:
       setStatusMessage("");
       if (callback)
@@ -537,7 +959,8 @@ char *editorPrompt(char *prompt, void (*callback)(char *, size_t)) {
       break;
 
     default:
-      if (!iscntrl(c) && c < 128)
+      // Bytes of UTF-8 chars arrive one by one.
+      if (c < 256 && (c >= 128 || !iscntrl(c)))
         abAppendChar(&input, c);
       break;
     }
@@ -550,211 +973,508 @@ char *editorPrompt(char *prompt, void (*callback)(char *, size_t)) {
 void moveCursor(uint64_t key) {
   static uint_fast32_t last_non_zero_pos = 1;
   static uint_fast32_t last_pos = 0;
-  appendBuffer *row = (E.cy >= E.num_rows) ? NULL : &E.rows[E.cy].chars;
+  appendBuffer *row =
+      (E.buf->cy >= E.buf->num_rows) ? NULL : &E.buf->rows[E.buf->cy].chars;
 
   switch (key) {
   case ARROW_DOWN:
-    if (E.cy < (E.num_rows - 1))
-      E.cy++;
+    if (E.buf->cy < (E.buf->num_rows - 1))
+      E.buf->cy++;
     break;
   case ARROW_UP:
-    if (E.cy != 0)
-      E.cy--;
+    if (E.buf->cy != 0)
+      E.buf->cy--;
     break;
   case ARROW_LEFT:
-    if (E.cx != 0)
-      E.cx--;
+    if (E.buf->cx != 0)
+      E.buf->cx = editorRowPrevChar(&E.buf->rows[E.buf->cy], E.buf->cx);
     break;
   case ARROW_RIGHT:
-    if (row && E.cx < (uint_fast32_t)row->len) {
-      E.cx++;
+    if (row && E.buf->cx < (uint_fast32_t)row->len) {
+      E.buf->cx = editorRowNextChar(&E.buf->rows[E.buf->cy], E.buf->cx);
     }
     break;
   }
 
   // If you change to a shorter line, the cursor column position should
   // move too.
-  row = (E.cy >= E.num_rows) ? NULL : &E.rows[E.cy].chars;
+  row = (E.buf->cy >= E.buf->num_rows) ? NULL : &E.buf->rows[E.buf->cy].chars;
   uint_fast32_t rowlen = row ? row->len : 0;
-  if (E.cx > rowlen) {
-    E.cx = rowlen;
+  if (E.buf->cx > rowlen) {
+    E.buf->cx = rowlen;
   }
 
   // Keep ~the same x position while scrolling down/up.
   if (key == ARROW_UP || key == ARROW_DOWN)
-    if (E.cx == 0 && row && last_pos == 0) {
+    if (E.buf->cx == 0 && row && last_pos == 0) {
       // https://graphics.stanford.edu/~seander/bithacks.html#IntegerMinOrMax
       // Just for fun.
       uint_fast32_t x = row->len;
       uint_fast32_t y = last_non_zero_pos;
-      E.cx = y ^ ((x ^ y) & -(x < y)); // min(x, y)
+      E.buf->cx = y ^ ((x ^ y) & -(x < y)); // min(x, y)
     }
 
-  if (E.cx != 0)
-    last_non_zero_pos = E.cx;
-  last_pos = E.cx;
+  // Don't land in the middle of a multi-byte char.
+  while (row && E.buf->cx > 0 && E.buf->cx < row->len &&
+         utf8IsContinuation(row->buf[E.buf->cx]))
+    E.buf->cx--;
+
+  if (E.buf->cx != 0)
+    last_non_zero_pos = E.buf->cx;
+  last_pos = E.buf->cx;
 }
 
-void processKeypress() {
-  uint64_t c = readKey();
+/// Handles a key, whether it was typed or it is replayed.
+void processKey(uint64_t c) {
+  if (E.buf->pager) {
+    handlePagerKey(c);
+    return;
+  }
 
-  if (E.mode == NORMAL)
+  macroKeyBegin(c);
+  if (E.mode == NORMAL) {
+    undoBreak(); // Every command is a change of its own.
     handleNormalKey(c);
-  else
+  } else {
     handleInsertKey(c);
+  }
+  macroKeyEnd();
+}
+
+void processKeypress() {
+  uint64_t c = readKey();
+  uint64_t start = traceBegin();
+
+  processKey(c);
+
+  traceEnd("processKeypress", start);
 }
 
 /*** output ***/
 
+/// Number of decimal digits of `n`.
+size_t numDigits(uint64_t n) {
+  size_t digits = 1;
+
+  while (n >= 10) {
+    n /= 10;
+    digits++;
+  }
+
+  return digits;
+}
+
+/// Columns left for the text next to the line numbers.
+uint_fast32_t editorTextCols() {
+  uint_fast32_t gutter = E.left_margin ? E.left_margin + 1 : 0;
+
+  return E.screen_cols > gutter ? E.screen_cols - gutter : 1;
+}
+
+/// Keeps the visual line of the cursor on the screen, when rows are wrapped.
+/// Rows may start above the screen, `wrap->skip` of their lines are hidden.
+void editorScrollWrapped() {
+  struct wrapIndex *w = E.buf->wrap;
+  size_t cols = editorTextCols();
+  size_t line = 0;
+  size_t col = E.rx;
+
+  wrapUpdate(cols);
+  E.buf->col_offset = 0;
+
+  if (E.buf->cy < E.buf->num_rows)
+    wrapRowPos(&E.buf->rows[E.buf->cy], E.rx, cols, &line, &col);
+
+  // Rows past the end are where the file ends.
+  size_t top_row = E.buf->row_offset;
+  if (top_row > E.buf->num_rows)
+    top_row = E.buf->num_rows;
+  size_t cursor_row = E.buf->cy < E.buf->num_rows ? E.buf->cy : E.buf->num_rows;
+
+  size_t cursor = wrapPrefix(cursor_row) + line;
+  size_t top = wrapPrefix(top_row);
+
+  // The row at the top may have shrunk since.
+  if (top_row < E.buf->num_rows && w->skip < w->lines[top_row])
+    top += w->skip;
+
+  if (cursor < top)
+    top = cursor;
+  if (cursor >= top + E.screen_rows)
+    top = cursor - E.screen_rows + 1;
+
+  E.buf->row_offset = wrapFind(top, &w->skip);
+  w->cursor_y = cursor - top;
+  w->cursor_x = col;
+}
+
 void editorScroll() {
+  if (E.buf->pager)
+    // Lines on the screen.
+    pagerScan(E.buf->row_offset + E.screen_rows, SIZE_MAX);
+
+  // A space, the digits of the last line number and a space.
+  size_t lines = E.buf->pager ? pagerNumLines() : E.buf->num_rows;
+  E.left_margin = lines != 0 ? numDigits(lines) + 1 : 0;
+
   E.rx = 0;
-  if (E.cy < E.num_rows) {
-    E.rx = editorRowCxToRx(&E.rows[E.cy], E.cx);
+  uint_fast32_t rx_end = 1; // Column after the char under the cursor.
+  if (E.buf->pager) {
+    pagerCursorCols(&E.rx, &rx_end);
+  } else if (E.buf->cy < E.buf->num_rows) {
+    row *row = &E.buf->rows[E.buf->cy];
+
+    E.rx = editorRowCxToRx(row, E.buf->cx);
+    rx_end = editorRowCxToRx(row, editorRowNextChar(row, E.buf->cx));
+    if (rx_end <= E.rx)
+      rx_end = E.rx + 1;
+  }
+
+  if (E.buf->wrap) {
+    editorScrollWrapped();
+    return;
+  }
+
+  if (E.buf->cy < (uint_fast32_t)E.buf->row_offset) {
+    E.buf->row_offset = E.buf->cy;
+  }
+  if (E.buf->cy >= E.buf->row_offset + E.screen_rows) {
+    E.buf->row_offset = E.buf->cy - E.screen_rows + 1;
+  }
+
+  if (E.rx < (uint_fast32_t)E.buf->col_offset) {
+    E.buf->col_offset = E.rx;
+  }
+  // Show the whole char, wide ones may not fit in the last column.
+  if (rx_end > E.buf->col_offset + editorTextCols()) {
+    E.buf->col_offset = rx_end - editorTextCols();
+  }
+}
+
+/// Row in the middle of the screen, or of the rows on it when the file ends
+/// before the screen does.
+size_t editorMiddleRow() {
+  if (E.buf->num_rows == 0)
+    return 0;
+
+  size_t middle = 0;
+
+  if (E.buf->wrap) {
+    size_t skip = 0;
+
+    wrapUpdate(editorTextCols());
+    size_t top = (size_t)E.buf->row_offset < E.buf->num_rows
+                     ? wrapPrefix(E.buf->row_offset) + E.buf->wrap->skip
+                     : wrapPrefix(E.buf->num_rows);
+    size_t shown = wrapPrefix(E.buf->num_rows) - top;
+
+    if (shown > E.screen_rows)
+      shown = E.screen_rows;
+    middle = wrapFind(top + shown / 2, &skip);
+  } else {
+    size_t top = E.buf->row_offset;
+    size_t shown = E.buf->num_rows > top ? E.buf->num_rows - top : 0;
+
+    if (shown > E.screen_rows)
+      shown = E.screen_rows;
+    middle = top + shown / 2;
+  }
+
+  return middle < E.buf->num_rows ? middle : E.buf->num_rows - 1;
+}
+
+/// Line numbers are 1 based, 0 leaves the gutter blank for the lines a wrapped
+/// row goes on.
+void add_line_number(appendBuffer *ab, uint_fast32_t line, size_t width) {
+  // Right aligned to `width` and followed by a space.
+  char buf[24] = {0};
+  char *p = &buf[width];
+
+  *p = ' ';
+  for (uint_fast32_t n = line; n != 0; n /= 10)
+    *--p = '0' + n % 10;
+  memset(buf, ' ', p - buf);
+
+  // The space before the number marks what changed from the file on disk.
+  themeColor color = THEME_LINE_NUMBER;
+  char mark = line != 0 && E.buf->diff ? diffMark(line - 1, &color) : 0;
+  if (mark) {
+    themeSet(ab, color);
+    abAppendChar(ab, mark);
   }
 
-  if (E.cy < (uint_fast32_t)E.row_offset) {
-    E.row_offset = E.cy;
+  if (line - 1 == E.buf->cy)
+    themeSet(ab, THEME_CURRENT_LINE_NUMBER);
+  else
+    themeSet(ab, THEME_LINE_NUMBER);
+
+  abAppendN(ab, &buf[mark != 0], width + 1 - (mark != 0));
+  themeSet(ab, THEME_TEXT);
+}
+
+/// Finds the bytes of the render shown in the `cols` columns from `offset` on.
+/// Returns the columns of a wide char cut by the left edge, to be padded.
+size_t editorRowVisible(row *row, size_t offset, size_t cols, size_t *from,
+                        size_t *to) {
+  rowLayout(row);
+
+  const char *s = row->render.buf;
+  size_t len = row->render.len;
+  size_t col = 0;
+  size_t i = 0;
+
+  if (row->flags & ROW_ASCII) {
+    *from = offset < len ? offset : len;
+    *to = *from + cols < len ? *from + cols : len;
+    return 0;
   }
-  if (E.cy >= E.row_offset + E.screen_rows) {
-    E.row_offset = E.cy - E.screen_rows + 1;
+
+  // Skip what is left of the screen.
+  while (i < len && col < offset) {
+    uint32_t cp = 0;
+    i += utf8Decode(&s[i], len - i, &cp);
+    col += codepointWidth(cp);
   }
 
-  if (E.rx < (uint_fast32_t)E.col_offset) {
-    E.col_offset = E.rx;
+  // Combining marks of the last skipped char.
+  while (i < len && (unsigned char)s[i] >= 0x80) {
+    uint32_t cp = 0;
+    size_t n = utf8Decode(&s[i], len - i, &cp);
+
+    if (codepointWidth(cp) != 0)
+      break;
+    i += n;
   }
-  if (E.rx >= E.col_offset + E.screen_cols) {
-    E.col_offset = E.rx - E.screen_cols + 1;
+
+  size_t pad = col > offset ? col - offset : 0;
+  if (pad > cols)
+    pad = cols;
+
+  *from = i;
+  *to = i + utf8FitColumns(&s[i], len - i, cols - pad);
+  return pad;
+}
+
+/// Draws the `cols` columns from `offset` on of `len` chars of `s`, that
+/// aren't rendered, walking them from byte `i` which is at column `col`.
+void editorDrawChars(appendBuffer *ab, const char *s, size_t len, size_t i,
+                     size_t col, size_t offset, size_t cols) {
+  size_t end_col = offset + cols;
+
+  // Up to the last column, and the combining marks right after it.
+  while (i < len && col <= end_col) {
+    uint32_t cp = (unsigned char)s[i];
+    size_t n = 1;
+    size_t w = 1;
+
+    if (cp == '\t')
+      w = TAB_STOP - col % TAB_STOP;
+    else if (cp >= 0x80) {
+      n = utf8Decode(&s[i], len - i, &cp);
+      w = codepointWidth(cp);
+    }
+
+    if (col + w > offset) {
+      size_t from = col < offset ? offset : col;
+      size_t to = col + w < end_col ? col + w : end_col;
+
+      if (cp == '\t' || col < offset) {
+        // Tabs and wide chars cut by the left edge are spaces.
+        for (size_t c = from; c < to; c++)
+          abAppendChar(ab, ' ');
+      } else if (col + w > end_col) {
+        break; // A wide char that doesn't fit.
+      } else if (cp == UTF8_REPLACEMENT) {
+        abAppend(ab, UTF8_REPLACEMENT_STR);
+      } else {
+        abAppendN(ab, &s[i], n);
+      }
+    }
+
+    col += w;
+    i += n;
   }
 }
 
-char *foreground_from_rgb(char *buf, uint8_t r, uint8_t g, uint8_t b) {
-  snprintf(buf, 32, "\033[48;2;%i;%i;%im", r, g, b);
-  return buf;
+/// Draws the `cols` columns of a long line from `offset` on, straight from
+/// its chars, starting at the chunk under the left edge.
+void editorDrawLongRow(appendBuffer *ab, row *row, size_t offset,
+                       size_t cols) {
+  size_t col = 0;
+  size_t i = 0;
+
+  lineIndexFindCol(row, offset, &i, &col);
+  editorDrawChars(ab, row->chars.buf, row->chars.len, i, col, offset, cols);
 }
 
-char *background_from_rgb(char *buf, uint8_t r, uint8_t g, uint8_t b) {
-  snprintf(buf, 32, "\033[38;2;%i;%i;%im", r, g, b);
-  return buf;
+/// Draws the bytes of the render from `from` to `to`, with their highlighting.
+void editorDrawRender(appendBuffer *ab, row *row, size_t from, size_t to) {
+  uint8_t *hl = row->hl;
+
+  if (hl == NULL) {
+    abAppendN(ab, &row->render.buf[from], to - from);
+    return;
+  }
+
+  // Append runs of chars with the same highlighting.
+  for (size_t j = from; j < to;) {
+    uint8_t kind = hl[j];
+    size_t run = j + 1;
+
+    while (run < to && hl[run] == kind)
+      run++;
+
+    themeSet(ab, editorSyntaxToColor(kind));
+    abAppendN(ab, &row->render.buf[j], run - j);
+    j = run;
+  }
 }
 
-void add_line_number(appendBuffer *ab, uint_fast32_t line, size_t max_width) {
-  if (E.num_rows == 0 || line > E.num_rows) {
-    // File content is smaller than the height of the screen.
+/// Draws the `cols` columns of the row from `offset` on.
+void editorDrawRow(appendBuffer *ab, row *row, size_t offset, size_t cols) {
+  if (rowIsLong(row)) {
+    rowLayout(row);
+    editorDrawLongRow(ab, row, offset, cols);
     return;
   }
 
-  char back[32] = {0};
-  char buf[16] = {0};
-  char pad[8] = {0};
+  size_t from = 0;
+  size_t to = 0;
+  size_t pad = editorRowVisible(row, offset, cols, &from, &to);
 
-  size_t idx = 0;
-  size_t num_digits = (size_t)floor(log10(line));
+  while (pad-- > 0)
+    abAppendChar(ab, ' ');
+
+  editorDrawRender(ab, row, from, to);
+}
 
-  while (idx != (max_width - num_digits))
-    pad[idx++] = ' ';
+/// Draws the visual lines from the top of the screen, starting `wrap->skip`
+/// lines into the row at `row_offset`.
+void drawRowsWrapped(appendBuffer *ab) {
+  size_t cols = editorTextCols();
+  size_t file_row = E.buf->row_offset;
+  size_t line = E.buf->wrap->skip;
+  size_t from = 0; // Start of the line in the render, for rows with wide chars.
 
-  if (getCy() == (line - 1 - E.row_offset))   // Current row.
-    background_from_rgb(back, 150, 188, 100); // Green.
-  else                                        // Grey.
-    background_from_rgb(back, 60, 65, 72);
+  for (uint_fast32_t y = 0; y < E.screen_rows; y++) {
+    if (file_row < E.buf->num_rows) {
+      row *row = &E.buf->rows[file_row];
+      rowLayout(row); // It may have been released while hidden.
+      uint_fast8_t wide = (row->flags & ROW_WIDE) && !rowIsLong(row);
+
+      // Lines of the first row above the screen.
+      if (y == 0 && wide)
+        for (size_t i = 0; i < line; i++)
+          from = wrapLineEnd(row, from, cols);
+
+      add_line_number(ab, line == 0 ? file_row + 1 : 0, E.left_margin);
+
+      if (wide) {
+        size_t to = wrapLineEnd(row, from, cols);
+        editorDrawRender(ab, row, from, to);
+        from = to;
+      } else {
+        editorDrawRow(ab, row, line * cols, cols);
+      }
 
-  abAppend(ab, back);
-  snprintf(buf, 16, "%s%lu ", pad, line);
-  abAppend(ab, buf);
+      if (++line >= E.buf->wrap->lines[file_row]) {
+        file_row++;
+        line = 0;
+        from = 0;
+      }
+    }
 
-  abAppend(ab, background_from_rgb(back, 194, 179, 149)); // Restore, blueish
+    abAppend(ab, "\x1b[K\r\n");
+  }
 }
 
 void drawRows(appendBuffer *ab) {
-  size_t row_num_width = 0;
+  size_t text_cols = editorTextCols();
 
-  if (E.num_rows != 0) {
-    row_num_width = (size_t)ceil(log10(E.num_rows));
-    E.left_margin = row_num_width + 1; // Number of digits plus a space.
-  } else {
-    E.left_margin = 0;
+  if (E.buf->pager) {
+    pagerDrawRows(ab);
+    return;
+  }
+  if (E.buf->wrap) {
+    drawRowsWrapped(ab);
+    return;
   }
 
   for (uint_fast32_t y = 0; y < E.screen_rows; y++) {
-    uint_fast32_t file_row = y + E.row_offset;
-    add_line_number(ab, file_row + 1, row_num_width);
-
-    if (file_row < E.num_rows) {
-      int_fast32_t len = E.rows[file_row].render.len - E.col_offset;
-
-      if (len < 0)
-        len = 0;
-
-      if (E.screen_cols < (uint_fast32_t)len)
-        len = E.screen_cols - 1;
-
-      char *c = &E.rows[file_row].render.buf[E.col_offset];
-      uint8_t *hl = &E.rows[file_row].hl[E.col_offset];
-      int8_t current_color = -1;
-      char buf[32] = {0};
-
-      // Append to the buffer char by char, while adding highlighting.
-      for (int_fast32_t j = 0; j < len; j++) {
-        if (hl[j] == HL_NORMAL) {
-          if (current_color != -1) {
-            abAppend(ab, background_from_rgb(buf, 194, 179, 149));
-            current_color = -1;
-          }
-        } else {
-          uint8_t color = editorSyntaxToColor(hl[j]);
-
-          if (color != current_color) {
-            current_color = color;
-            abAppend(ab, background_from_rgb(buf, 255, 165, 0));
-            abAppend(ab, buf);
-          }
-        }
-
-        abAppendChar(ab, c[j]);
-      }
+    uint_fast32_t file_row = y + E.buf->row_offset;
+
+    // File content may be smaller than the height of the screen.
+    if (file_row < E.buf->num_rows) {
+      add_line_number(ab, file_row + 1, E.left_margin);
+      editorDrawRow(ab, &E.buf->rows[file_row], E.buf->col_offset, text_cols);
     }
 
     // Erases from current position to the end of the line and jumps to
     // new line.
     abAppend(ab, "\x1b[K\r\n");
   }
-
-  write(STDOUT_FILENO, ab->buf, ab->len);
 }
 
 void drawStatusBar(appendBuffer *ab) {
   // TODO Handle narrow terminals.
   char status[256] = {0};
-  char rstatus[16] = {0};
-  char back[32] = {0};
-  char *mode = E.mode == NORMAL ? "Normal" : "Insert";
+  char rstatus[64] = {0};
+  char *mode = E.buf->pager ? "Pager" : E.mode == NORMAL ? "Normal" : "Insert";
+  char recording[8] = {0};
+  if (Macros.recording)
+    snprintf(recording, sizeof(recording), " @%c", (int)Macros.recording);
+
+  char buffers[32] = {0};
+  if (Buffers.len > 1)
+    snprintf(buffers, sizeof(buffers), " [%zu/%zu]", bufferIndex(E.buf) + 1,
+             Buffers.len);
+
+  themeSet(ab, E.mode == NORMAL ? THEME_NORMAL_MODE : THEME_INSERT_MODE);
+
+  char loading[32] = {0};
+  if (E.buf->loader)
+    editorLoadStatus(loading, sizeof(loading));
+
+  // The pager only knows the lines it has looked at so far.
+  char lines[32] = {0};
+  if (E.buf->pager)
+    snprintf(lines, sizeof(lines), "%zu%sL", pagerNumLines(),
+             E.buf->pager->complete ? "" : "+");
+  else
+    snprintf(lines, sizeof(lines), "%ldL", E.buf->num_rows);
 
-  if (E.mode == NORMAL) {
-    abAppend(ab, background_from_rgb(back, 242, 198, 128)); // Orange
-  } else {
-    abAppend(ab, background_from_rgb(back, 93, 198, 128)); // Green
-  }
+  // The results of a search go by what was searched for.
+  const char *name = E.buf->filename ? E.buf->filename : "[No Name]";
+  if (E.buf->grep && E.buf->grep->title)
+    name = E.buf->grep->title;
 
-  size_t len = snprintf(status, sizeof(status), "%s > \"%.20s\" - %ldL %s",
-                        mode, E.filename ? E.filename : "[No Name]", E.num_rows,
-                        E.dirty ? "(modified)" : "");
+  size_t len = snprintf(status, sizeof(status), "%s%s > \"%.20s\"%s - %s %s%s",
+                        mode, recording, name, buffers, lines, loading,
+                        E.buf->dirty ? "(modified)" : "");
 
-  size_t rlen =
-      snprintf(rstatus, sizeof(rstatus), "%ld,%ld", E.cy + 1, E.cx + 1);
+  size_t rlen = snprintf(rstatus, sizeof(rstatus), "%ld,%ld", E.buf->cy + 1,
+                         E.buf->cx + 1);
 
+  // Time it took to draw the last frame and how much was written for it.
+  if (E.hud)
+    rlen = snprintf(rstatus, sizeof(rstatus), "%.2fms %luB | %ld,%ld",
+                    E.last_frame_ns / 1e6, (unsigned long)E.last_frame_bytes,
+                    E.buf->cy + 1, E.buf->cx + 1);
+
+  len = utf8Width(status, len); // The file name may not be ASCII.
   if (len > (size_t)E.screen_cols) {
     len = E.screen_cols;
   }
 
   abAppend(ab, "\x1b[7m");              // Invert colors.
   abAppend(ab, status);                 // Filename and number of lines.
-  while (E.screen_cols - len != rlen) { // Fill with white space.
+  while (len + rlen < E.screen_cols) { // Fill with white space.
     abAppend(ab, " ");
     len++;
   }
   abAppend(ab, rstatus); // Ruler: line and column position of the cursor.
-  abAppend(ab,
-           "\x1b[m\r\n"); // Revert inverted colors and move to new line.
+  themeResetAttributes(ab); // Revert inverted colors.
+  abAppend(ab, "\r\n");
 }
 
 void drawMessageBar(appendBuffer *ab) {
@@ -766,36 +1486,66 @@ void drawMessageBar(appendBuffer *ab) {
     return;
   }
 
-  if (E.status_msg.len > (size_t)E.screen_cols) {
-    E.status_msg.buf[E.screen_cols] = '\0';
-    E.status_msg.len = E.screen_cols;
+  size_t fits = utf8FitColumns(E.status_msg.buf, E.status_msg.len,
+                                E.screen_cols);
+  if (fits < E.status_msg.len) {
+    E.status_msg.buf[fits] = '\0';
+    E.status_msg.len = fits;
   }
 
   abAppend(ab, E.status_msg.buf);
 }
 
 void editorRefreshScreen() {
-  // TODO take into account screen resize.
+  if (macroReplaying())
+    return; // Only the end of it is drawn.
+
   char buf[64] = {0};
+  uint64_t frame_start = nowNs();
+  uint64_t frame_trace = traceBegin();
+  uint64_t start = traceBegin();
   editorScroll();
+  traceEnd("editorScroll", start);
 
   abClear(&E.screen);
 
   // https: // vt100.net/docs/vt100-ug/chapter3.html#ED
   // Hide cursor and put it at the top left.
   abAppend(&E.screen, "\x1b[?25l\x1b[H");
-  abAppend(&E.screen, foreground_from_rgb(buf, 38, 42, 51)); // gray
+  themeForget(); // The terminal may have been written to since last frame.
+  themeSet(&E.screen, THEME_BACKGROUND);
 
+  start = traceBegin();
   drawRows(&E.screen);
+  traceEnd("drawRows", start);
+
+  start = traceBegin();
   drawStatusBar(&E.screen);
   drawMessageBar(&E.screen);
+  traceEnd("drawStatusBar", start);
 
   // Put cursor at his position and show it as a beam or block.
-  snprintf(buf, 64, "\x1b[%lu;%luH\033[%i q\x1b[?25h", getCy() + 1,
-           getCx() + 2 + E.left_margin, E.mode == NORMAL ? 2 : 6);
+  size_t cursor_y = E.buf->wrap ? E.buf->wrap->cursor_y : getCy();
+  size_t cursor_x = E.buf->wrap ? E.buf->wrap->cursor_x : getCx();
+  snprintf(buf, 64, "\x1b[%lu;%luH\033[%i q\x1b[?25h", cursor_y + 1,
+           cursor_x + 2 + E.left_margin, E.mode == NORMAL ? 2 : 6);
   abAppend(&E.screen, buf);
 
-  write(STDOUT_FILENO, E.screen.buf, E.screen.len); // Write to screen.
+  start = traceBegin();
+  uint64_t bytes_written = E.bytes_written;
+  editorWrite(E.screen.buf, E.screen.len); // Write to screen.
+  traceEnd("write", start);
+
+  E.frames++;
+  E.last_frame_bytes = E.bytes_written - bytes_written;
+  E.last_frame_ns = nowNs() - frame_start;
+  traceEnd("editorRefreshScreen", frame_trace);
+}
+
+/// Redraws the screen once the status message times out.
+uint_fast8_t statusMessageExpired(int fd) {
+  (void)fd;
+  return E.status_msg.len != 0;
 }
 
 void setStatusMessage(const char *fmt, ...) {
@@ -808,31 +1558,87 @@ void setStatusMessage(const char *fmt, ...) {
   va_end(ap);
 
   E.status_msg_time = time(NULL);
+  eventSetTimer(statusMessageExpired, (STATUS_MSG_TIMEOUT + 1) * 1000);
 }
 
 /*** init ***/
 
+uint_fast8_t editorHandleSignal(int fd) {
+  struct signalfd_siginfo si = {0};
+
+  while (read(fd, &si, sizeof(si)) == sizeof(si)) {
+    if (si.ssi_signo != SIGWINCH) {
+      editorWrite("\x1b[2J\x1b[H", 7); // Clear screen.
+      exit(0);
+    }
+
+    getWindowSize();
+    E.screen_rows -= 2;
+  }
+
+  return 1;
+}
+
+/// Sets up the terminal, unless running headless in which case the screen
+/// size has to be set beforehand.
 void initEditor() {
-  getWindowSize();
-  enableRawMode();
+  if (!E.headless) {
+    enableRawMode(); // The terminal may be asked for its size.
+    getWindowSize();
+    eventInit(editorHandleSignal);
+    atexit(openStatesSave);
+  }
+
+  traceInit();
+  themeInit();
+  E.hud = getenv("FIRE_HUD") != NULL;
 
   // Leave space for the status bar and message bar.
   E.screen_rows -= 2;
   E.mode = NORMAL;
+
+  if (E.buf == NULL)
+    E.buf = bufferAdd(NULL);
 }
 
+#ifndef FIRE_NO_MAIN
 int main(int argc, char *argv[]) {
+  // Text piped in, like `make 2>&1 | fire` or `fire -`.
+  int pipe_fd = -1;
+  if ((argc >= 2 && strcmp(argv[1], "-") == 0) ||
+      (argc < 2 && !isatty(STDIN_FILENO)))
+    pipe_fd = reopenTerminal();
+
   initEditor();
 
-  if (argc >= 2) {
-    editorOpen(argv[1]);
+  if (argc >= 3 && strcmp(argv[1], "-R") == 0) {
+    pagerOpen(argv[2]);
+    setStatusMessage("HELP: q = quit | / = search | n = next match");
+  } else {
+    if (pipe_fd != -1) {
+      editorLoadStart(pipe_fd);
+    } else if (argc >= 2) {
+      editorOpen(argv[1]);
+      watchStart();
+
+      // The other files are read when they are first shown.
+      for (int i = 2; i < argc; i++)
+        bufferAdd(argv[i]);
+    }
+    setStatusMessage("HELP: Ctrl-S = save | Ctrl-C = quit | / = search");
   }
-  setStatusMessage("HELP: Ctrl-S = save | Ctrl-C = quit | / = search");
 
   while (1) {
     editorRefreshScreen();
-    processKeypress();
+
+    // Handle every key that already arrived before drawing the next frame,
+    // but keep drawing while a long burst of input is being processed.
+    uint64_t deadline = nowMs() + BURST_BUDGET_MS;
+    do {
+      processKeypress();
+    } while (inputHasKey() && nowMs() < deadline);
   }
 
   return 0;
 }
+#endif
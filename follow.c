@@ -0,0 +1,203 @@
+#pragma once
+
+#include "base.c"
+#include "event.c"
+#include "trace.c"
+#include "watch.c"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*** follow ***/
+#define FOLLOW_MAX_READ (16 << 20) // Bytes appended per frame, at most.
+
+/// Appends to the rows what gets written to the end of the file, like
+/// `tail -f`. The file is watched by `watchStart`.
+struct follow {
+  int fd;
+  size_t size; // Bytes of the file that are in the rows.
+  uint_fast8_t ends_with_break;
+};
+
+/// Opens the file being followed, from byte `size` on.
+uint_fast8_t followOpen(struct follow *f, size_t size) {
+  if (f->fd != -1)
+    close(f->fd);
+
+  f->fd = open(E.buf->filename, O_RDONLY | O_CLOEXEC);
+  f->size = size;
+  f->ends_with_break = 1;
+
+  char last = '\n';
+  if (f->fd != -1 && size > 0 && pread(f->fd, &last, 1, size - 1) == 1)
+    f->ends_with_break = last == '\n' || last == '\r';
+
+  return f->fd != -1;
+}
+
+/// Loads the file again, after it was truncated or replaced. Unsaved changes
+/// are not thrown away, what is written to the file from now on goes after
+/// them instead, like `tail -f` does.
+void followReload(struct follow *f) {
+  uint_fast8_t at_end = E.buf->cy + 1 >= E.buf->num_rows;
+
+  if (E.buf->dirty) {
+    struct stat st = {0};
+
+    followOpen(f, stat(E.buf->filename, &st) == 0 ? (size_t)st.st_size : 0);
+    watchFile(); // It may be another file now.
+    setStatusMessage("%s was truncated or replaced, the unsaved changes are "
+                     "kept",
+                     E.buf->filename);
+    return;
+  }
+
+  if (!editorReload())
+    return;
+
+  if (at_end && E.buf->num_rows > 0) {
+    E.buf->cy = E.buf->num_rows - 1;
+    E.buf->cx = 0;
+  }
+
+  followOpen(f, E.buf->file_stamp.size);
+}
+
+/// Appends the bytes written to the file since it was last read. Returns
+/// whether there are more.
+uint_fast8_t followAppend(struct follow *f, size_t size) {
+  uint64_t start = traceBegin();
+  size_t len = size - f->size;
+
+  if (len > FOLLOW_MAX_READ)
+    len = FOLLOW_MAX_READ;
+
+  // A line break that ended the file now starts the new text.
+  appendBuffer text = newAppendBuffer();
+  abResize(&text, len + 1);
+  text.buf[0] = '\n';
+
+  ssize_t n = pread(f->fd, &text.buf[1], len, f->size);
+  if (n <= 0) {
+    abFree(&text);
+    return 0;
+  }
+
+  f->size += n;
+  text.len = n + 1;
+
+  size_t skip = f->ends_with_break ? 0 : 1;
+  uint_fast8_t at_end =
+      E.buf->num_rows == 0 || E.buf->cy + 1 >= E.buf->num_rows;
+  uint_fast8_t dirty = E.buf->dirty;
+
+  // The line break at the end goes with the next text.
+  f->ends_with_break = 0;
+  if (text.buf[text.len - 1] == '\n' || text.buf[text.len - 1] == '\r') {
+    f->ends_with_break = 1;
+    text.len--;
+
+    if (text.len > 1 && text.buf[text.len] == '\n' &&
+        text.buf[text.len - 1] == '\r')
+      text.len--;
+  }
+
+  // An empty file has no line to break.
+  if (E.buf->num_rows == 0)
+    skip = 1;
+
+  textPos end = {0};
+  if (E.buf->num_rows > 0)
+    end = (textPos){.y = E.buf->num_rows - 1,
+                    .x = E.buf->rows[E.buf->num_rows - 1].chars.len};
+
+  undoPause(1); // The file grew, nothing to undo.
+  editorInsertTextAt(end, &text.buf[skip], text.len - skip);
+  undoPause(0);
+  E.buf->dirty = dirty; // The rows are still what is in the file.
+
+  // Keep following the end.
+  if (at_end) {
+    E.buf->cy = E.buf->num_rows > 0 ? E.buf->num_rows - 1 : 0;
+    E.buf->cx = 0;
+  }
+
+  abFree(&text);
+  traceEnd("followAppend", start);
+  return f->size < size;
+}
+
+/// Looks at what happened to the file since the last check.
+uint_fast8_t followCheck() {
+  struct follow *f = E.buf->follow;
+  struct stat path_st = {0};
+  struct stat fd_st = {0};
+
+  // The rows of a file still loading go before anything appended.
+  if (E.buf->loader) {
+    watchSchedule(WATCH_BATCH_MS);
+    return 0;
+  }
+
+  // Gone, wait for it to come back.
+  if (stat(E.buf->filename, &path_st) == -1)
+    return 0;
+
+  if (f->fd == -1 || fstat(f->fd, &fd_st) == -1 ||
+      fd_st.st_ino != path_st.st_ino || fd_st.st_dev != path_st.st_dev) {
+    // Rotated, another file has its name now.
+    followReload(f);
+    return 1;
+  }
+
+  if ((size_t)fd_st.st_size < f->size) {
+    followReload(f); // Truncated.
+    return 1;
+  }
+
+  if ((size_t)fd_st.st_size > f->size && followAppend(f, fd_st.st_size))
+    watchSchedule(0);
+
+  E.buf->file_stamp = fileStampOf(&fd_st);
+  E.buf->file_stamp.size = f->size;
+
+  return 1;
+}
+
+void followStop() {
+  if (E.buf->follow->fd != -1)
+    close(E.buf->follow->fd);
+  free(E.buf->follow);
+  E.buf->follow = NULL;
+}
+
+/// Starts following the file, or stops it.
+void followToggle() {
+  if (E.buf->follow) {
+    followStop();
+    setStatusMessage("Stopped following %s", E.buf->filename);
+    return;
+  }
+
+  if (!watchStart()) {
+    setStatusMessage("Only files open for editing can be followed");
+    return;
+  }
+
+  struct follow *f = calloc(1, sizeof(struct follow));
+  f->fd = -1;
+  E.buf->follow = f;
+
+  if (!followOpen(f, E.buf->file_stamp.size)) {
+    setStatusMessage("Can't follow %s: %s", E.buf->filename, strerror(errno));
+    followStop();
+    return;
+  }
+
+  setStatusMessage("Following %s, F to stop", E.buf->filename);
+
+  // What was written while it was open.
+  watchSchedule(0);
+}
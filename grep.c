@@ -0,0 +1,447 @@
+#pragma once
+
+#include "base.c"
+#include "buffer.c"
+#include "complete.c"
+#include "event.c"
+#include "loader.c"
+#include "pager.c"
+#include "register.c"
+#include "trace.c"
+#include "undo.c"
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*** grep ***/
+#define GREP_BINARY_PROBE 8192 // Bytes looked at for a NUL, binaries have one.
+#define GREP_MAX_TEXT 256      // Of the line shown for a hit, at most.
+#define GREP_MAP_MIN (1 << 20) // Smaller files are read, it's cheaper.
+
+/// A search for `pattern` in every file under a directory, shown as it goes
+/// in a buffer of its own, one `path:line:text` row per line that matches.
+///
+/// Workers take paths from a shared stack: directories push what they have,
+/// files are read, skipped if they look binary and searched with `memmem`.
+/// Lines are only counted up to the hits. The hits of a file are handed over
+/// at once, and the editor adds them to the rows when it is woken.
+struct grepPath {
+  char *path;
+  uint_fast8_t dir;
+};
+
+struct grepSearch {
+  char *pattern;
+  size_t pattern_len;
+  char *title; // Shown as the name of the buffer.
+  uint64_t started_ms;
+
+  pthread_t *workers;
+  size_t num_workers;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  int wake_fd; // Signaled when there are hits, and when it's over.
+
+  // Everything below is guarded by `lock`.
+
+  struct grepPath *paths; // Still to look at, directories and files.
+  size_t num_paths;
+  size_t cap_paths;
+  size_t busy;    // Workers looking at a path, which may push more.
+  size_t running; // Workers that haven't finished.
+
+  appendBuffer hits; // Not in the rows yet.
+  size_t num_hits;
+  size_t num_files;
+  uint_fast8_t done;
+};
+
+void grepPushPath(struct grepSearch *g, char *path, uint_fast8_t dir) {
+  pthread_mutex_lock(&g->lock);
+
+  if (g->num_paths == g->cap_paths) {
+    g->cap_paths = g->cap_paths ? g->cap_paths * 2 : 256;
+    g->paths = realloc(g->paths, sizeof(struct grepPath) * g->cap_paths);
+  }
+  g->paths[g->num_paths++] = (struct grepPath){.path = path, .dir = dir};
+
+  pthread_cond_signal(&g->work);
+  pthread_mutex_unlock(&g->lock);
+}
+
+/// Pushes what is in the directory, but not hidden files and directories,
+/// like `.git`, nor symbolic links.
+void grepDir(struct grepSearch *g, const char *path) {
+  DIR *dir = opendir(path);
+  struct dirent *entry = NULL;
+
+  if (dir == NULL)
+    return;
+
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
+
+    char *child = NULL;
+    if (strcmp(path, ".") == 0)
+      child = strdup(entry->d_name);
+    else if (asprintf(&child, "%s/%s", path, entry->d_name) == -1)
+      continue;
+
+    unsigned char type = entry->d_type;
+    struct stat st = {0};
+
+    if (type == DT_UNKNOWN && lstat(child, &st) == 0)
+      type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : 0;
+
+    if (type == DT_DIR || type == DT_REG)
+      grepPushPath(g, child, type == DT_DIR);
+    else
+      free(child);
+  }
+
+  closedir(dir);
+}
+
+/// Adds the lines of the file that have the pattern to `out`. Returns how
+/// many there were. Small files are read into `text`, big ones mapped.
+size_t grepFile(struct grepSearch *g, const char *path, appendBuffer *text,
+                appendBuffer *out) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st = {0};
+  size_t hits = 0;
+
+  if (fd == -1)
+    return 0;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+
+  size_t size = st.st_size;
+  const char *map = NULL;
+
+  if (size < GREP_MAP_MIN) {
+    abResize(text, size);
+    ssize_t got = 0;
+
+    for (size_t n = 0; n < size; n += got)
+      if ((got = read(fd, text->buf + n, size - n)) <= 0) {
+        size = n;
+        break;
+      }
+    map = text->buf;
+  } else {
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+      map = NULL;
+  }
+  close(fd);
+
+  if (map == NULL)
+    return 0;
+
+  const char *end = map + size;
+  const char *counted = map; // Lines are counted up to here.
+  const char *line_start = map;
+  size_t line = 1;
+
+  if (memchr(map, '\0', size < GREP_BINARY_PROBE ? size : GREP_BINARY_PROBE))
+    end = map;
+
+  for (const char *p = map; p < end;) {
+    const char *hit = memmem(p, end - p, g->pattern, g->pattern_len);
+    if (hit == NULL)
+      break;
+
+    size_t breaks = 0;
+    size_t after = skipLines(counted, hit - counted, SIZE_MAX, &breaks);
+    if (breaks > 0)
+      line_start = counted + after;
+    line += breaks;
+
+    const char *line_end = memchr(hit, '\n', end - hit);
+    if (line_end == NULL)
+      line_end = end;
+
+    size_t len = line_end - line_start;
+    while (len > 0 && line_start[len - 1] == '\r')
+      len--;
+    if (len > GREP_MAX_TEXT)
+      len = GREP_MAX_TEXT;
+
+    char prefix[32] = {0};
+    int prefix_len = snprintf(prefix, sizeof(prefix), ":%zu:", line);
+
+    abAppend(out, path);
+    abAppendN(out, prefix, prefix_len);
+    abAppendN(out, line_start, len);
+    abAppendChar(out, '\n');
+    hits++;
+
+    // One hit per line, the search goes on from the next one.
+    counted = p = line_end;
+  }
+
+  if (map != text->buf)
+    munmap((void *)map, size);
+  return hits;
+}
+
+void *grepWorker(void *arg) {
+  struct grepSearch *g = arg;
+  appendBuffer text = {0};
+  appendBuffer out = {0};
+
+  traceThreadName("grep");
+  pthread_mutex_lock(&g->lock);
+
+  while (1) {
+    // Paths can still come while another worker reads a directory.
+    while (g->num_paths == 0 && g->busy > 0)
+      pthread_cond_wait(&g->work, &g->lock);
+    if (g->num_paths == 0)
+      break;
+
+    struct grepPath p = g->paths[--g->num_paths];
+    g->busy++;
+    pthread_mutex_unlock(&g->lock);
+
+    size_t hits = 0;
+
+    abClear(&out);
+    if (p.dir)
+      grepDir(g, p.path);
+    else
+      hits = grepFile(g, p.path, &text, &out);
+    free(p.path);
+
+    pthread_mutex_lock(&g->lock);
+    g->busy--;
+    g->num_files += !p.dir;
+
+    if (hits > 0) {
+      abAppendN(&g->hits, out.buf, out.len);
+      g->num_hits += hits;
+
+      uint64_t one = 1;
+      write(g->wake_fd, &one, sizeof(one));
+    }
+
+    // The last one done wakes the others, there is nothing left.
+    if (g->busy == 0 && g->num_paths == 0)
+      pthread_cond_broadcast(&g->work);
+  }
+
+  if (--g->running == 0) {
+    g->done = 1;
+
+    uint64_t one = 1;
+    write(g->wake_fd, &one, sizeof(one));
+  }
+
+  pthread_mutex_unlock(&g->lock);
+  abFree(&text);
+  abFree(&out);
+  return NULL;
+}
+
+/// Adds the hits found since the last time to the rows of the buffer, which
+/// is the one shown.
+uint_fast8_t grepWoken(int fd) {
+  struct grepSearch *g = E.buf->grep;
+  uint64_t count = 0;
+
+  read(fd, &count, sizeof(count));
+
+  pthread_mutex_lock(&g->lock);
+  appendBuffer hits = g->hits;
+  size_t num_hits = g->num_hits;
+  size_t num_files = g->num_files;
+  uint_fast8_t done = g->done;
+  g->hits = (appendBuffer){0};
+  pthread_mutex_unlock(&g->lock);
+
+  size_t n = 0;
+  for (size_t i = 0; i < hits.len; i++)
+    n += hits.buf[i] == '\n';
+
+  row *r = editorSpliceRows(E.buf->num_rows, 0, n);
+  const char *s = hits.buf;
+
+  for (size_t i = 0; i < n; i++) {
+    const char *nl = memchr(s, '\n', hits.buf + hits.len - s);
+
+    abAppendN(&r[i].chars, s, nl - s);
+    updateRow(&r[i]);
+    s = nl + 1;
+  }
+  abFree(&hits);
+
+  if (done) {
+    eventUnwatch(g->wake_fd);
+    close(g->wake_fd);
+    for (size_t i = 0; i < g->num_workers; i++)
+      pthread_join(g->workers[i], NULL);
+    free(g->workers);
+    free(g->paths);
+    g->workers = NULL;
+    g->paths = NULL;
+    g->num_workers = 0;
+
+    setStatusMessage("%zu lines match in %zu files, %lu ms", num_hits,
+                     num_files, (unsigned long)(nowMs() - g->started_ms));
+  } else {
+    setStatusMessage("%zu lines match so far", num_hits);
+  }
+
+  return 1;
+}
+
+/// Stops adding hits to the buffer while it is hidden, the workers go on.
+void grepHide(buffer *b) {
+  if (b->grep && b->grep->workers)
+    eventUnwatch(b->grep->wake_fd);
+}
+
+/// Adds the hits found while the buffer was hidden.
+void grepResume(buffer *b) {
+  if (b->grep && b->grep->workers) {
+    eventWatch(b->grep->wake_fd, grepWoken);
+    grepWoken(b->grep->wake_fd);
+  }
+}
+
+/// Searches the files under `dir` for `pattern`, into a buffer for the
+/// results. The buffer of a search that is over is used again.
+void grepStart(const char *pattern, const char *dir) {
+  buffer *b = NULL;
+
+  for (size_t i = 0; i < Buffers.len && b == NULL; i++)
+    if (Buffers.list[i]->grep && Buffers.list[i]->grep->workers == NULL)
+      b = Buffers.list[i];
+
+  if (b) {
+    struct grepSearch *old = b->grep;
+    free(old->pattern);
+    free(old->title);
+    free(old);
+    b->grep = NULL;
+  } else {
+    b = bufferAdd(NULL);
+  }
+
+  struct grepSearch *g = calloc(1, sizeof(struct grepSearch));
+  g->pattern = strdup(pattern);
+  g->pattern_len = strlen(pattern);
+  if (asprintf(&g->title, "grep %s", pattern) == -1)
+    g->title = NULL;
+  g->started_ms = nowMs();
+
+  g->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (g->wake_fd == -1)
+    die("eventfd");
+
+  pthread_mutex_init(&g->lock, NULL);
+  pthread_cond_init(&g->work, NULL);
+  grepPushPath(g, strdup(dir), 1);
+
+  // Shown before the workers start, the hits of the last search go.
+  bufferShow(b);
+  b->grep = g;
+  registersChanging(0, E.buf->num_rows, 0);
+  completeChanging(0, E.buf->num_rows, 0);
+  editorSpliceRows(0, E.buf->num_rows, 0);
+  undoForget();
+  E.buf->dirty = 0;
+  E.buf->cy = 0;
+  E.buf->cx = 0;
+  E.buf->row_offset = 0;
+  eventWatch(g->wake_fd, grepWoken);
+
+  size_t cores = sysconf(_SC_NPROCESSORS_ONLN);
+  g->workers = calloc(cores, sizeof(pthread_t));
+
+  // The workers that started count down `running` under the lock too, they
+  // wait for the ones that couldn't start to be taken off it.
+  pthread_mutex_lock(&g->lock);
+  g->running = cores;
+
+  for (size_t i = 0; i < cores; i++) {
+    if (pthread_create(&g->workers[g->num_workers], NULL, grepWorker, g) == 0)
+      g->num_workers++;
+    else
+      g->running--;
+  }
+
+  if (g->num_workers == 0)
+    g->running = 1; // Searched on this thread.
+  pthread_mutex_unlock(&g->lock);
+
+  if (g->num_workers == 0)
+    grepWorker(g);
+
+  setStatusMessage("Searching for \"%s\" in %s", pattern, dir);
+}
+
+/// Runs `:grep pattern [dir]`. The last word is the directory to search if
+/// there is one by that name, the pattern is everything before it.
+void grepCommand(const char *args) {
+  const char *space = strrchr(args, ' ');
+  struct stat st = {0};
+
+  if (space && space[1] != '\0' && stat(space + 1, &st) == 0 &&
+      S_ISDIR(st.st_mode)) {
+    char *pattern = strndup(args, space - args);
+    grepStart(pattern, space + 1);
+    free(pattern);
+  } else {
+    grepStart(args, ".");
+  }
+}
+
+/// Opens the file of the hit under the cursor, at its line. Rows are read as
+/// `path:line:`, so they can be edited before.
+void grepOpenHit() {
+  if (E.buf->cy >= E.buf->num_rows)
+    return;
+
+  appendBuffer *s = &E.buf->rows[E.buf->cy].chars;
+  size_t line = 0;
+  size_t colon = 0;
+
+  for (; colon < s->len; colon++) {
+    size_t i = colon + 1;
+
+    if (s->buf[colon] != ':' || i >= s->len ||
+        !isdigit((unsigned char)s->buf[i]))
+      continue;
+
+    for (line = 0; i < s->len && isdigit((unsigned char)s->buf[i]); i++)
+      line = line * 10 + s->buf[i] - '0';
+    if (i < s->len && s->buf[i] == ':')
+      break;
+  }
+
+  if (colon == s->len || line == 0) {
+    setStatusMessage("Not a hit, they look like path:line:text");
+    return;
+  }
+
+  char *path = strndup(s->buf, colon);
+  bufferEdit(path);
+  free(path);
+
+  editorLoadWait(line);
+  E.buf->cy = line <= E.buf->num_rows ? line - 1 : E.buf->num_rows;
+  E.buf->cx = 0;
+  if (E.buf->cy > E.screen_rows / 2)
+    E.buf->row_offset = E.buf->cy - E.screen_rows / 2;
+  moveCursor(0); // Stay inside the file.
+}
@@ -1,24 +1,30 @@
 #pragma once
 
 #include "base.c"
+#include "buffer.c"
+#include "complete.c"
+#include "event.c"
 
 void handleInsertKey(uint64_t c) {
   static uint_fast8_t quit_times = QUIT_TIMES;
 
+  if (c != CTRL_KEY('n') && c != CTRL_KEY('p'))
+    completeEnd();
+
   switch (c) {
   case ENTER:
     editorInsertNewline();
     break;
 
   case CTRL_KEY('c'):
-    if (E.dirty && quit_times > 0) {
+    if (buffersModified() && quit_times > 0) {
       setStatusMessage("¡WARNING! File has unsaved changes. Press Ctrl-C %d "
                        "more times to quit.",
                        quit_times);
       quit_times--;
       return;
     }
-    write(STDOUT_FILENO, "\x1b[2J\x1b[H", 7); // Clear screen.
+    editorWrite("\x1b[2J\x1b[H", 7); // Clear screen.
     exit(0);
     break;
 
@@ -26,6 +32,19 @@ void handleInsertKey(uint64_t c) {
     editorSave();
     break;
 
+  // Complete the word before the cursor with the words of the file.
+  case CTRL_KEY('n'):
+    completeStep(1);
+    break;
+
+  case CTRL_KEY('p'):
+    completeStep(-1);
+    break;
+
+  case PASTE:
+    editorInsertText(inputPaste()->buf, inputPaste()->len);
+    break;
+
   case BACKSPACE:
   case CTRL_KEY('h'):
     editorDelChar();
@@ -0,0 +1,509 @@
+#pragma once
+
+#include "base.c"
+#include "event.c"
+#include "trace.c"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/*** background loading ***/
+#define LOAD_CHUNK_SIZE (1 << 20)
+#define LOAD_MAX_BATCH (1 << 16)
+#define ARENA_BLOCK_SIZE (1 << 22)
+#define INGEST_MIN_CHUNK (1 << 22)
+#define LOAD_FIRST_WAIT_MS 100 // For the first screen of a slow pipe, at most.
+
+/// The blocks of the arenas a file was read into. The rows of its buffer
+/// borrow their chars from them, and so do the registers that took some of
+/// those rows, which hold a reference each. Freed when the last one goes.
+typedef struct rowText {
+  size_t refs;
+  char **blocks;
+  size_t num_blocks;
+} rowText;
+
+void rowTextHold(rowText *t) {
+  if (t)
+    t->refs++;
+}
+
+void rowTextRelease(rowText *t) {
+  if (t == NULL || --t->refs > 0)
+    return;
+
+  for (size_t i = 0; i < t->num_blocks; i++)
+    free(t->blocks[i]);
+  free(t->blocks);
+  free(t);
+}
+
+/// State shared between the editor and the thread reading a file.
+typedef struct fileLoader {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t published;
+
+  int fd;
+  int wake_fd; // Signaled every time rows are published.
+  size_t total_bytes;
+  size_t first_batch; // Rows needed to fill the first screen.
+  rowText *text;      // Of the buffer, where the arenas go once done.
+
+  // Bytes already split into rows, updated by every ingest thread.
+  atomic_size_t bytes_read;
+
+  // Everything below is guarded by `lock`.
+
+  // Rows already read but not yet handed over to the editor.
+  row *pending;
+  size_t num_pending;
+
+  uint_fast8_t done;
+} fileLoader;
+
+/// Bump allocator holding the contents of the rows of a file. Each ingest
+/// thread owns one, so building rows never contends on `malloc`. Its blocks
+/// go to the text of the file when it's done, see `loaderTakeArena`.
+typedef struct rowArena {
+  char *block;
+  size_t used;
+  size_t cap;
+
+  char **blocks; // All of them, the current one last.
+  size_t num_blocks;
+} rowArena;
+
+/// Copies `len` bytes of `s` into the arena, null terminated.
+char *arenaCopy(rowArena *a, const char *s, size_t len) {
+  if (a->cap - a->used < len + 1) {
+    a->cap = len + 1 > ARENA_BLOCK_SIZE ? len + 1 : ARENA_BLOCK_SIZE;
+    a->block = malloc(a->cap);
+    a->used = 0;
+
+    a->blocks = realloc(a->blocks, sizeof(char *) * (a->num_blocks + 1));
+    a->blocks[a->num_blocks++] = a->block;
+  }
+
+  char *dst = &a->block[a->used];
+  memcpy(dst, s, len);
+  dst[len] = '\0';
+  a->used += len + 1;
+
+  return dst;
+}
+
+/// Builds a row from `len` bytes of `s`, dropping the trailing `\r` of CRLF
+/// line endings. The row borrows its contents from the arena, and its render
+/// too unless it has tabs to expand. Empty ones borrow an empty string.
+row rowFromBytes(rowArena *a, const char *s, size_t len) {
+  while (len > 0 && s[len - 1] == '\r')
+    len--;
+
+  row r = {0};
+  r.chars = abBorrow(len ? arenaCopy(a, s, len) : "", len);
+
+  // Long lines are laid out in chunks here, away from the main thread.
+  if (len >= LONG_LINE || memchr(s, '\t', len))
+    updateRow(&r);
+  else
+    r.render = r.chars;
+
+  return r;
+}
+
+/// Hands a batch of rows over to the editor. The batch is consumed.
+void loaderPublish(fileLoader *l, row **batch, size_t *batch_len,
+                   uint_fast8_t done) {
+  pthread_mutex_lock(&l->lock);
+
+  if (l->pending == NULL) {
+    // Nothing waiting, just give away the whole batch.
+    l->pending = *batch;
+    l->num_pending = *batch_len;
+    *batch = NULL;
+  } else if (*batch_len) {
+    l->pending =
+        realloc(l->pending, sizeof(row) * (l->num_pending + *batch_len));
+    memcpy(&l->pending[l->num_pending], *batch, sizeof(row) * *batch_len);
+    l->num_pending += *batch_len;
+  }
+  *batch_len = 0;
+  l->done = done;
+
+  pthread_cond_signal(&l->published);
+  pthread_mutex_unlock(&l->lock);
+
+  uint64_t one = 1;
+  write(l->wake_fd, &one, sizeof(one));
+}
+
+/// Moves the blocks of an arena that is done into the text of the file.
+void loaderTakeArena(fileLoader *l, rowArena *a) {
+  rowText *t = l->text;
+
+  pthread_mutex_lock(&l->lock);
+  if (a->num_blocks) {
+    t->blocks =
+        realloc(t->blocks, sizeof(char *) * (t->num_blocks + a->num_blocks));
+    memcpy(&t->blocks[t->num_blocks], a->blocks,
+           sizeof(char *) * a->num_blocks);
+    t->num_blocks += a->num_blocks;
+  }
+  pthread_mutex_unlock(&l->lock);
+
+  free(a->blocks);
+  *a = (rowArena){0};
+}
+
+/// A newline aligned slice of a mapped file, split into rows by one thread.
+typedef struct ingestJob {
+  pthread_t thread;
+  fileLoader *loader;
+  const char *start;
+  const char *end;
+
+  // Publish rows as they are built instead of keeping them in `rows`.
+  uint_fast8_t publish;
+
+  rowArena arena;
+  size_t batch_target;
+  row *rows;
+  size_t num_rows;
+  size_t cap_rows;
+} ingestJob;
+
+/// Splits the slice of the job into rows. The first slice publishes its rows
+/// in batches that start at the size of a screen, so the first frame can be
+/// drawn right away, and grow up to `LOAD_MAX_BATCH`.
+void ingestChunk(ingestJob *job) {
+  uint64_t start = traceBegin();
+  fileLoader *l = job->loader;
+  const char *p = job->start;
+  const char *reported = p;
+  const char *nl = NULL;
+
+  if (job->batch_target == 0)
+    job->batch_target = l->first_batch;
+
+  while (p < job->end) {
+    nl = memchr(p, '\n', job->end - p);
+    const char *line_end = nl ? nl : job->end;
+
+    if (job->num_rows == job->cap_rows) {
+      job->cap_rows = job->cap_rows ? job->cap_rows * 2 : job->batch_target;
+      job->rows = realloc(job->rows, sizeof(row) * job->cap_rows);
+    }
+    job->rows[job->num_rows++] = rowFromBytes(&job->arena, p, line_end - p);
+    p = nl ? nl + 1 : job->end;
+
+    if (p - reported >= LOAD_CHUNK_SIZE) {
+      atomic_fetch_add_explicit(&l->bytes_read, p - reported,
+                                memory_order_relaxed);
+      reported = p;
+    }
+
+    if (job->publish && job->num_rows >= job->batch_target) {
+      loaderPublish(l, &job->rows, &job->num_rows, 0);
+      job->cap_rows = job->rows == NULL ? 0 : job->cap_rows;
+      if (job->batch_target < LOAD_MAX_BATCH)
+        job->batch_target *= 2;
+    }
+  }
+
+  atomic_fetch_add_explicit(&l->bytes_read, p - reported,
+                            memory_order_relaxed);
+  traceEnd("ingestChunk", start);
+}
+
+void *ingestThread(void *arg) {
+  traceThreadName("ingest");
+  ingestChunk(arg);
+  return NULL;
+}
+
+/// Splits a mapped file into one newline aligned chunk per core. The first
+/// chunk is ingested on this thread and published as it goes, the rest are
+/// built in parallel and stitched together in order as they finish.
+void loaderIngestMapped(fileLoader *l, const char *map) {
+  size_t size = l->total_bytes;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t num_jobs = size / INGEST_MIN_CHUNK;
+
+  if (num_jobs > (size_t)cores)
+    num_jobs = cores;
+  if (num_jobs == 0)
+    num_jobs = 1;
+
+  ingestJob *jobs = calloc(num_jobs, sizeof(ingestJob));
+  const char *start = map;
+  const char *file_end = map + size;
+
+  for (size_t i = 0; i < num_jobs; i++) {
+    const char *end = map + (size / num_jobs) * (i + 1);
+
+    if (i == num_jobs - 1 || end <= start) {
+      end = i == num_jobs - 1 ? file_end : start;
+    } else {
+      const char *nl = memchr(end - 1, '\n', file_end - end + 1);
+      end = nl ? nl + 1 : file_end;
+    }
+
+    jobs[i].loader = l;
+    jobs[i].start = start;
+    jobs[i].end = end;
+    start = end;
+  }
+
+  jobs[0].publish = 1;
+  for (size_t i = 1; i < num_jobs; i++)
+    if (pthread_create(&jobs[i].thread, NULL, ingestThread, &jobs[i]) != 0)
+      jobs[i].publish = 1; // Mark it to be ingested on this thread instead.
+
+  ingestChunk(&jobs[0]);
+  loaderPublish(l, &jobs[0].rows, &jobs[0].num_rows, 0);
+  loaderTakeArena(l, &jobs[0].arena);
+  free(jobs[0].rows);
+
+  for (size_t i = 1; i < num_jobs; i++) {
+    if (jobs[i].publish)
+      ingestChunk(&jobs[i]);
+    else
+      pthread_join(jobs[i].thread, NULL);
+
+    loaderPublish(l, &jobs[i].rows, &jobs[i].num_rows, 0);
+    loaderTakeArena(l, &jobs[i].arena);
+    free(jobs[i].rows);
+  }
+
+  free(jobs);
+}
+
+/// Reads a file that can't be mapped in chunks, splitting it into rows.
+void loaderIngestStream(fileLoader *l) {
+  char *chunk = malloc(LOAD_CHUNK_SIZE);
+  appendBuffer carry = newAppendBuffer(); // Line split between two chunks.
+  ingestJob job = {.loader = l, .publish = 1};
+  ssize_t n = 0;
+
+  while ((n = read(l->fd, chunk, LOAD_CHUNK_SIZE)) != 0) {
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    char *end = chunk + n;
+    char *nl = memchr(chunk, '\n', n);
+
+    if (nl == NULL) {
+      abAppendN(&carry, chunk, n);
+      continue;
+    }
+
+    // Finish the line started in the previous chunk, then split the rest.
+    char *rest = chunk;
+    if (carry.len != 0) {
+      abAppendN(&carry, chunk, nl + 1 - chunk);
+      job.start = carry.buf;
+      job.end = carry.buf + carry.len;
+      ingestChunk(&job);
+      abClear(&carry);
+      rest = nl + 1;
+    }
+
+    char *last_nl = memrchr(rest, '\n', end - rest);
+    if (last_nl) {
+      job.start = rest;
+      job.end = last_nl + 1;
+      ingestChunk(&job);
+      rest = last_nl + 1;
+    }
+
+    abAppendN(&carry, rest, end - rest);
+
+    // Publish at least once per chunk to keep the rows up to date.
+    loaderPublish(l, &job.rows, &job.num_rows, 0);
+    job.cap_rows = job.rows == NULL ? 0 : job.cap_rows;
+  }
+
+  // Last line without a trailing new line.
+  if (carry.len != 0) {
+    job.start = carry.buf;
+    job.end = carry.buf + carry.len;
+    ingestChunk(&job);
+  }
+  loaderPublish(l, &job.rows, &job.num_rows, 0);
+  loaderTakeArena(l, &job.arena);
+
+  free(job.rows);
+  free(chunk);
+  abFree(&carry);
+}
+
+void *loaderThread(void *arg) {
+  traceThreadName("loader");
+  fileLoader *l = arg;
+  char *map = MAP_FAILED;
+
+  if (l->total_bytes != 0)
+    map = mmap(NULL, l->total_bytes, PROT_READ, MAP_PRIVATE, l->fd, 0);
+
+  if (map != MAP_FAILED) {
+    madvise(map, l->total_bytes, MADV_SEQUENTIAL);
+    loaderIngestMapped(l, map);
+    munmap(map, l->total_bytes);
+  } else {
+    loaderIngestStream(l);
+  }
+
+  row *none = NULL;
+  size_t zero = 0;
+  loaderPublish(l, &none, &zero, 1);
+
+  return NULL;
+}
+
+/// Moves the rows published by the loader into the editor. Returns whether
+/// the contents of the file changed.
+uint_fast8_t editorLoadPoll() {
+  fileLoader *l = E.buf->loader;
+
+  if (l == NULL)
+    return 0;
+
+  uint64_t start = traceBegin();
+  pthread_mutex_lock(&l->lock);
+  row *rows = l->pending;
+  size_t n = l->num_pending;
+  uint_fast8_t done = l->done;
+  l->pending = NULL;
+  l->num_pending = 0;
+  pthread_mutex_unlock(&l->lock);
+
+  if (n != 0)
+    memcpy(editorSpliceRows(E.buf->num_rows, 0, n), rows, sizeof(row) * n);
+  free(rows);
+
+  if (E.buf->reopen)
+    openStateApply();
+
+  if (done) {
+    // The thread may still be waking the editor up for the last time.
+    pthread_join(l->thread, NULL);
+    eventUnwatch(l->wake_fd);
+    close(l->wake_fd);
+    pthread_mutex_destroy(&l->lock);
+    pthread_cond_destroy(&l->published);
+    close(l->fd);
+    free(l);
+    E.buf->loader = NULL;
+  }
+
+  traceEnd("editorLoadPoll", start);
+  return n != 0 || done;
+}
+
+/// Lets go of the text of the file once no row of `b` borrows from it, they
+/// were all edited or replaced. Registers with lines of it still keep it.
+void rowTextDrop(buffer *b) {
+  if (b->text == NULL || b->loader)
+    return;
+
+  for (size_t i = 0; i < b->num_rows; i++) {
+    row *r = &b->rows[i];
+
+    if (r->chars.cap == 0 && r->shared == NULL && r->chars.len > 0)
+      return;
+  }
+
+  rowTextRelease(b->text);
+  b->text = NULL;
+}
+
+uint_fast8_t loaderWoken(int fd) {
+  uint64_t count = 0;
+  read(fd, &count, sizeof(count));
+
+  return editorLoadPoll();
+}
+
+/// Describes how much of the file has been read so far, for the status bar.
+/// Pipes have no size, they say how much came through them.
+void editorLoadStatus(char *buf, size_t size) {
+  fileLoader *l = E.buf->loader;
+  size_t bytes_read =
+      atomic_load_explicit(&l->bytes_read, memory_order_relaxed);
+
+  if (l->total_bytes == 0)
+    snprintf(buf, size, "(reading %zuK) ", bytes_read >> 10);
+  else
+    snprintf(buf, size, "(loading %u%%) ",
+             (unsigned)((bytes_read * 100) / l->total_bytes));
+}
+
+/// Starts reading `fd` in the background and waits until there are enough
+/// rows to fill the screen (or the whole file, if it is smaller). A pipe may
+/// take its time to fill it, the rows show up as they come then.
+void editorLoadStart(int fd) {
+  struct stat st = {0};
+  fileLoader *l = calloc(1, sizeof(fileLoader));
+
+  l->fd = fd;
+  l->first_batch = E.screen_rows > 0 ? E.screen_rows : 1;
+  E.buf->file_stamp = (fileStamp){0};
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    l->total_bytes = st.st_size;
+    E.buf->file_stamp = fileStampOf(&st);
+  }
+
+  pthread_mutex_init(&l->lock, NULL);
+  pthread_cond_init(&l->published, NULL);
+  l->text = calloc(1, sizeof(rowText));
+  l->text->refs = 1; // The one of the buffer.
+  E.buf->text = l->text;
+  E.buf->loader = l;
+  openStateRestore(); // The first screen may be further down.
+
+  l->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (l->wake_fd == -1)
+    die("eventfd");
+  eventWatch(l->wake_fd, loaderWoken);
+
+  if (pthread_create(&l->thread, NULL, loaderThread, l) != 0)
+    die("pthread_create");
+
+  struct timespec deadline = {0};
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += LOAD_FIRST_WAIT_MS * 1000000L;
+  deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+  deadline.tv_nsec %= 1000000000L;
+
+  pthread_mutex_lock(&l->lock);
+  while (!l->done && l->num_pending < l->first_batch)
+    if (pthread_cond_timedwait(&l->published, &l->lock, &deadline) != 0)
+      break;
+  pthread_mutex_unlock(&l->lock);
+
+  editorLoadPoll();
+}
+
+/// Waits until the file has more than `rows` rows, or it is fully loaded.
+void editorLoadWait(size_t rows) {
+  while (E.buf->loader && E.buf->num_rows <= rows) {
+    fileLoader *l = E.buf->loader;
+
+    pthread_mutex_lock(&l->lock);
+    while (l->num_pending == 0 && !l->done)
+      pthread_cond_wait(&l->published, &l->lock);
+    pthread_mutex_unlock(&l->lock);
+
+    editorLoadPoll();
+  }
+}
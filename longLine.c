@@ -0,0 +1,196 @@
+#pragma once
+
+#include "base.c"
+#include <stdlib.h>
+#include <string.h>
+
+/*** long lines ***/
+
+/// Layout of a piece of a long line. How many columns it takes depends on the
+/// column it starts at when it has tabs, so they are kept for every start
+/// column modulo `TAB_STOP`.
+typedef struct lineChunk {
+  uint32_t bytes;
+  uint32_t cols[TAB_STOP];
+  uint8_t flags; // `ROW_ASCII` and `ROW_TABS` of its chars.
+} lineChunk;
+
+/// Long lines are not rendered as a whole, they are split in chunks of about
+/// `LINE_CHUNK` bytes, which are laid out on their own. Drawing only looks at
+/// the chunk under the left edge of the screen, and edits only lay out again
+/// the chunks they touch.
+struct lineIndex {
+  lineChunk *chunks;
+  size_t num_chunks;
+  size_t cap_chunks;
+};
+
+/// End of the chunk of about `size` bytes that starts at `start`, on a char
+/// boundary.
+size_t lineChunkEnd(const char *s, size_t len, size_t start, size_t size) {
+  if (len - start <= size)
+    return len;
+
+  size_t end = start + size;
+
+  // Back to the first byte of the char, if it's a valid one.
+  for (size_t back = 0; back < 3 && utf8IsContinuation(s[end - back]);
+       back++) {
+    if (!utf8IsContinuation(s[end - back - 1])) {
+      end -= back + 1;
+      break;
+    }
+  }
+
+  return end;
+}
+
+lineChunk lineChunkLayout(const char *s, size_t len) {
+  lineChunk chunk = {.bytes = len};
+  size_t cols = 0;
+
+  rowRenderChars(s, len, 0, NULL, &cols, &chunk.flags);
+
+  for (size_t phase = 0; phase < TAB_STOP; phase++) {
+    if (phase > 0 && (chunk.flags & ROW_TABS))
+      rowRenderChars(s, len, phase, NULL, &cols, &chunk.flags);
+    chunk.cols[phase] = cols;
+  }
+
+  return chunk;
+}
+
+/// Lays out again the bytes from `start` to `end` of the row, which replace
+/// `remove` chunks from chunk `at` on.
+void lineIndexRelayout(row *r, size_t at, size_t remove, size_t start,
+                       size_t end) {
+  struct lineIndex *idx = r->index;
+  size_t insert = 0;
+
+  // Chunks of the same size, an edit that makes a chunk a bit too big would
+  // leave a tiny one otherwise.
+  size_t pieces = (end - start + LINE_CHUNK - 1) / LINE_CHUNK;
+  size_t size = pieces ? (end - start + pieces - 1) / pieces : LINE_CHUNK;
+
+  for (size_t p = start; p < end; p = lineChunkEnd(r->chars.buf, end, p, size))
+    insert++;
+
+  size_t num_chunks = idx->num_chunks - remove + insert;
+  if (num_chunks > idx->cap_chunks) {
+    idx->cap_chunks = num_chunks * 2;
+    idx->chunks = realloc(idx->chunks, sizeof(lineChunk) * idx->cap_chunks);
+  }
+
+  memmove(&idx->chunks[at + insert], &idx->chunks[at + remove],
+          sizeof(lineChunk) * (idx->num_chunks - at - remove));
+  idx->num_chunks = num_chunks;
+
+  for (size_t p = start, i = at; p < end; i++) {
+    size_t chunk_end = lineChunkEnd(r->chars.buf, end, p, size);
+
+    idx->chunks[i] = lineChunkLayout(&r->chars.buf[p], chunk_end - p);
+    p = chunk_end;
+  }
+
+  // Width and flags of the whole row.
+  size_t col = 0;
+  r->flags = ROW_LAID_OUT | ROW_ASCII;
+
+  for (size_t i = 0; i < idx->num_chunks; i++) {
+    col += idx->chunks[i].cols[col % TAB_STOP];
+    r->flags &= idx->chunks[i].flags | ~ROW_ASCII;
+    r->flags |= idx->chunks[i].flags & ROW_TABS;
+  }
+
+  r->width = col;
+}
+
+void lineIndexBuild(row *r) {
+  if (r->index == NULL)
+    r->index = calloc(1, sizeof(struct lineIndex));
+
+  lineIndexRelayout(r, 0, r->index->num_chunks, 0, r->chars.len);
+}
+
+void lineIndexFree(row *r) {
+  if (r->index == NULL)
+    return;
+
+  free(r->index->chunks);
+  free(r->index);
+  r->index = NULL;
+}
+
+/// Finds the chunk with the byte at `byte`, and the byte and column it starts
+/// at. The end of the row is in the last chunk.
+size_t lineIndexFindByte(row *r, size_t byte, size_t *start, size_t *col) {
+  struct lineIndex *idx = r->index;
+  size_t i = 0;
+
+  *start = *col = 0;
+
+  for (; i + 1 < idx->num_chunks; i++) {
+    if (*start + idx->chunks[i].bytes > byte)
+      break;
+
+    *start += idx->chunks[i].bytes;
+    *col += idx->chunks[i].cols[*col % TAB_STOP];
+  }
+
+  return i;
+}
+
+/// Finds the chunk shown at column `target`, and the byte and column it
+/// starts at.
+size_t lineIndexFindCol(row *r, size_t target, size_t *start, size_t *col) {
+  struct lineIndex *idx = r->index;
+  size_t i = 0;
+
+  *start = *col = 0;
+
+  for (; i + 1 < idx->num_chunks; i++) {
+    size_t cols = idx->chunks[i].cols[*col % TAB_STOP];
+
+    if (*col + cols > target)
+      break;
+
+    *start += idx->chunks[i].bytes;
+    *col += cols;
+  }
+
+  return i;
+}
+
+/// Updates the chunks after `removed` bytes at `at` were replaced with
+/// `inserted` ones.
+void lineIndexEdit(row *r, size_t at, size_t removed, size_t inserted) {
+  size_t start = 0;
+  size_t col = 0;
+  size_t first = lineIndexFindByte(r, at, &start, &col);
+
+  // An edit at the start of a chunk may change the last char of the one
+  // before, e.g. when typing a multi-byte char one byte at a time.
+  if (first > 0 && at == start) {
+    first--;
+    start -= r->index->chunks[first].bytes;
+  }
+
+  // Chunks up to the end of the removed bytes.
+  size_t last = first;
+  size_t end = start + r->index->chunks[first].bytes;
+
+  while (end < at + removed && last + 1 < r->index->num_chunks)
+    end += r->index->chunks[++last].bytes;
+
+  // Take in small neighbors, so edits don't leave lots of tiny chunks.
+  if (last + 1 < r->index->num_chunks &&
+      end - start + r->index->chunks[last + 1].bytes <= LINE_CHUNK)
+    end += r->index->chunks[++last].bytes;
+
+  if (first > 0 &&
+      end - start + r->index->chunks[first - 1].bytes <= LINE_CHUNK)
+    start -= r->index->chunks[--first].bytes;
+
+  end = end - removed + inserted;
+  lineIndexRelayout(r, first, last - first + 1, start, end);
+}
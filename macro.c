@@ -0,0 +1,279 @@
+#pragma once
+
+#include "base.c"
+#include "event.c"
+#include "undo.c"
+#include <stdlib.h>
+#include <string.h>
+
+/*** repeat and macros ***/
+#define MACRO_REGISTERS 26 // `a` to `z`.
+#define MACRO_MAX_DEPTH 32 // Macros that run themselves stop there.
+
+/// Keys as they were decoded. A `PASTE` is followed by the length of its
+/// text, which is kept in `pastes`.
+typedef struct keyList {
+  uint64_t *keys;
+  size_t len;
+  size_t cap;
+  appendBuffer pastes;
+} keyList;
+
+/// Keys being replayed instead of read from the terminal.
+typedef struct keyReplay {
+  keyList *keys;
+  size_t pos;
+  size_t paste_pos;
+} keyReplay;
+
+/// The keys of the command being typed. Once it is over, it is the change
+/// that `.` repeats if it edited something.
+typedef struct keyCommand {
+  keyList keys;
+  uint64_t recorded;     // Changes recorded when it started.
+  uint_fast8_t active;   // It started and is not over yet.
+  uint_fast8_t replayed; // It ran a replay, it is not a change itself.
+} keyCommand;
+
+/// Replays run every key through the same path as typed ones, but without
+/// drawing frames or waiting for the terminal, so a macro run over a whole
+/// file costs only its edits and a single frame at the end. The edits of a
+/// replay are undone as one.
+struct macros {
+  keyList registers[MACRO_REGISTERS];
+  uint64_t recording; // Register the typed keys go to, 0 when none.
+  uint64_t last_run;  // For `@@`.
+
+  keyCommand command;
+  keyList repeat;   // The last change, for `.`.
+  keyList counted;  // The last change with another count.
+  size_t repeating; // Replays of the last change, which don't replace it.
+
+  keyReplay replays[MACRO_MAX_DEPTH];
+  size_t depth;
+  uint_fast8_t failed; // A motion failed, the replays stop.
+};
+
+struct macros Macros = {0};
+
+void keyListAdd(keyList *l, uint64_t key) {
+  if (l->len + 2 > l->cap) {
+    l->cap = l->cap ? l->cap * 2 : 16;
+    l->keys = realloc(l->keys, sizeof(uint64_t) * l->cap);
+  }
+
+  l->keys[l->len++] = key;
+
+  if (key == PASTE) {
+    appendBuffer *paste = inputPaste();
+
+    l->keys[l->len++] = paste->len;
+    abAppendN(&l->pastes, paste->buf, paste->len);
+  }
+}
+
+void keyListClear(keyList *l) {
+  l->len = 0;
+  abClear(&l->pastes);
+}
+
+void keyListSwap(keyList *a, keyList *b) {
+  keyList t = *a;
+  *a = *b;
+  *b = t;
+}
+
+/// Whether keys come from a replay rather than the terminal.
+uint_fast8_t macroReplaying() { return Macros.depth > 0; }
+
+/// Whether the replay has keys left, like the rest of a multi-byte char.
+uint_fast8_t macroHasKey() {
+  if (Macros.depth == 0 || Macros.failed)
+    return 0;
+
+  keyReplay *r = &Macros.replays[Macros.depth - 1];
+  return r->pos < r->keys->len;
+}
+
+/// The key `macroNextKey` gives next, left in the replay.
+uint64_t macroPeekKey() {
+  if (!macroHasKey())
+    return ESC;
+
+  keyReplay *r = &Macros.replays[Macros.depth - 1];
+  return r->keys->keys[r->pos];
+}
+
+/// The next key of the innermost replay. It is an `ESC` once the replay runs
+/// out, which cancels prompts that the keys did not finish.
+uint64_t macroNextKey() {
+  if (!macroHasKey())
+    return ESC;
+
+  keyReplay *r = &Macros.replays[Macros.depth - 1];
+  uint64_t key = r->keys->keys[r->pos++];
+
+  if (key == PASTE) {
+    size_t len = r->keys->keys[r->pos++];
+
+    abClear(inputPaste());
+    abAppendN(inputPaste(), &r->keys->pastes.buf[r->paste_pos], len);
+    r->paste_pos += len;
+  }
+
+  return key;
+}
+
+/// A motion could not move, the replays running are over. This is how
+/// `1000@a` stops at the end of the file.
+void macroFail() {
+  if (Macros.depth > 0)
+    Macros.failed = 1;
+}
+
+/// Called with every key read from the terminal.
+void macroKeyTyped(uint64_t key) {
+  if (Macros.recording)
+    keyListAdd(&Macros.registers[Macros.recording - 'a'], key);
+}
+
+/// Called with every key before it is handled.
+void macroKeyBegin(uint64_t key) {
+  keyCommand *cmd = &Macros.command;
+
+  if (!cmd->active) {
+    keyListClear(&cmd->keys);
+    cmd->recorded = undoLog()->recorded;
+    cmd->active = 1;
+    cmd->replayed = 0;
+    undoGroup(1); // Undone as one, even when it edits a few places.
+  }
+
+  keyListAdd(&cmd->keys, key);
+}
+
+/// Called after every key is handled. The command is over unless it waits
+/// for more keys or went into insert mode.
+void macroKeyEnd() {
+  keyCommand *cmd = &Macros.command;
+
+  if (!cmd->active || E.mode != NORMAL || normalPending())
+    return;
+
+  cmd->active = 0;
+  undoGroup(0);
+
+  if (!cmd->replayed && Macros.repeating == 0 &&
+      cmd->recorded != undoLog()->recorded)
+    keyListSwap(&cmd->keys, &Macros.repeat);
+}
+
+/// Handles `keys` `times` times as if they were typed.
+void macroReplay(keyList *keys, size_t times) {
+  if (Macros.depth == MACRO_MAX_DEPTH) {
+    setStatusMessage("Macros nested too deep");
+    macroFail();
+    return;
+  }
+
+  // The keys replayed are commands of their own.
+  keyCommand outer = Macros.command;
+  outer.replayed = 1;
+  Macros.command = (keyCommand){0};
+
+  keyReplay *r = &Macros.replays[Macros.depth++];
+  *r = (keyReplay){.keys = keys};
+
+  for (size_t i = 0; i < times && !Macros.failed; i++) {
+    r->pos = 0;
+    r->paste_pos = 0;
+
+    while (r->pos < keys->len && !Macros.failed)
+      processKey(readKey());
+  }
+
+  Macros.depth--;
+  if (Macros.depth == 0)
+    Macros.failed = 0;
+
+  if (Macros.command.active) {
+    // The replay stopped halfway through a command, like in insert mode,
+    // and the keys typed next finish it.
+    undoGroup(0);
+    free(outer.keys.keys);
+    abFree(&outer.keys.pastes);
+  } else {
+    free(Macros.command.keys.keys);
+    abFree(&Macros.command.keys.pastes);
+    Macros.command = outer;
+  }
+}
+
+/// Repeats the last change, with `count` instead of its own if it is not 0.
+void macroRepeat(size_t count) {
+  keyList *keys = &Macros.repeat;
+
+  if (keys->len == 0)
+    return;
+
+  if (count > 0) {
+    char digits[24] = {0};
+    int len = snprintf(digits, sizeof(digits), "%zu", count);
+    size_t skip = 0;
+
+    keyListClear(&Macros.counted);
+    for (int i = 0; i < len; i++)
+      keyListAdd(&Macros.counted, digits[i]);
+
+    // Without the count it was typed with.
+    while (skip < keys->len && keys->keys[skip] >= '0' &&
+           keys->keys[skip] <= '9' && (skip > 0 || keys->keys[skip] != '0'))
+      skip++;
+
+    for (size_t i = skip; i < keys->len; i++)
+      keyListAdd(&Macros.counted, keys->keys[i]);
+    abAppendN(&Macros.counted.pastes, keys->pastes.buf, keys->pastes.len);
+    keys = &Macros.counted;
+  }
+
+  Macros.repeating++;
+  macroReplay(keys, 1);
+  Macros.repeating--;
+}
+
+/// Runs the macro in register `reg`, `@` being the last one run.
+void macroRun(uint64_t reg, size_t count) {
+  if (reg == '@')
+    reg = Macros.last_run;
+  if (reg < 'a' || reg > 'z')
+    return;
+
+  Macros.last_run = reg;
+  macroReplay(&Macros.registers[reg - 'a'], count ? count : 1);
+}
+
+/// Records the keys typed from now on into register `reg`, or appends them
+/// to it if it is upper case.
+void macroRecord(uint64_t reg) {
+  if (reg >= 'A' && reg <= 'Z') {
+    reg += 'a' - 'A';
+  } else if (reg >= 'a' && reg <= 'z') {
+    keyListClear(&Macros.registers[reg - 'a']);
+  } else {
+    return;
+  }
+
+  Macros.recording = reg;
+  setStatusMessage("recording @%c", (int)reg);
+}
+
+/// Stops recording, the key that stopped it is not part of the macro.
+void macroStop() {
+  keyList *l = &Macros.registers[Macros.recording - 'a'];
+
+  if (l->len > 0)
+    l->len--;
+
+  setStatusMessage("recorded @%c", (int)Macros.recording);
+  Macros.recording = 0;
+}
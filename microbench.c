@@ -0,0 +1,344 @@
+// Micro benchmarks for the append buffer and the row operations.
+//
+//   make microbench && ./microbench [-r REPS] [-m MAX_LINES] [filter...]
+//
+// Each benchmark runs REPS times (5 by default) and prints one JSON object
+// per line with the best and the median time per operation, so results can
+// be diffed between commits or between buffer implementations. Filters are
+// substrings of the benchmark names, e.g. `./microbench ab_insert open`.
+// Files from 1K up to MAX_LINES lines (1M by default) are generated in a
+// temporary directory for the open, save and search benchmarks.
+
+#define FIRE_NO_MAIN
+#include "fire.c"
+
+#include <dirent.h>
+
+#define MICRO_OPS 10000
+
+struct microConfig {
+  size_t reps;
+  size_t max_lines;
+  char **filters;
+  size_t num_filters;
+  char dir[64];
+};
+
+struct microConfig Micro = {.reps = 5, .max_lines = 1000000};
+
+/// Runs one repetition of a benchmark with `param`, returns the number of
+/// operations it did.
+typedef size_t (*microFn)(size_t param);
+
+uint_fast8_t microSelected(const char *name) {
+  if (Micro.num_filters == 0)
+    return 1;
+
+  for (size_t i = 0; i < Micro.num_filters; i++)
+    if (strstr(name, Micro.filters[i]))
+      return 1;
+
+  return 0;
+}
+
+int compareDouble(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+void microRun(const char *name, microFn fn, size_t param) {
+  if (!microSelected(name))
+    return;
+
+  double *ns_per_op = calloc(Micro.reps, sizeof(double));
+  size_t ops = 0;
+
+  fn(param); // Warm up.
+
+  for (size_t r = 0; r < Micro.reps; r++) {
+    uint64_t start = nowNs();
+    ops = fn(param);
+    ns_per_op[r] = (double)(nowNs() - start) / (ops ? ops : 1);
+  }
+
+  qsort(ns_per_op, Micro.reps, sizeof(double), compareDouble);
+  printf("{\"bench\": \"%s\", \"param\": %zu, \"ops\": %zu, \"reps\": %zu, "
+         "\"min_ns_per_op\": %.2f, \"median_ns_per_op\": %.2f}\n",
+         name, param, ops, Micro.reps, ns_per_op[0],
+         ns_per_op[Micro.reps / 2]);
+  fflush(stdout);
+
+  free(ns_per_op);
+}
+
+/*** append buffer ***/
+
+size_t benchAbAppend(size_t param) {
+  appendBuffer ab = newAppendBuffer();
+
+  for (size_t i = 0; i < param; i++)
+    abAppend(&ab, "0123456789abcdef");
+
+  abFree(&ab);
+  return param;
+}
+
+size_t benchAbAppendChar(size_t param) {
+  appendBuffer ab = newAppendBuffer();
+
+  for (size_t i = 0; i < param; i++)
+    abAppendChar(&ab, 'x');
+
+  abFree(&ab);
+  return param;
+}
+
+size_t benchAbResize(size_t param) {
+  appendBuffer ab = {0};
+
+  for (size_t i = 0; i < param; i++)
+    abResize(&ab, i);
+
+  abFree(&ab);
+  return param;
+}
+
+/// A line of `len` chars to type into.
+appendBuffer microLine(size_t len) {
+  appendBuffer ab = newAppendBuffer();
+
+  for (size_t i = 0; i < len; i++)
+    abAppendChar(&ab, 'a' + i % 26);
+
+  return ab;
+}
+
+/// Inserts at the start, middle or end of a line, depending on `where`.
+size_t abInsertBench(size_t len, int where) {
+  appendBuffer ab = microLine(len);
+
+  for (size_t i = 0; i < MICRO_OPS; i++) {
+    size_t at = where == 0 ? 0 : where == 1 ? ab.len / 2 : ab.len;
+    abInsertAt(&ab, at, 'x');
+  }
+
+  abFree(&ab);
+  return MICRO_OPS;
+}
+
+size_t benchAbInsertStart(size_t len) { return abInsertBench(len, 0); }
+size_t benchAbInsertMiddle(size_t len) { return abInsertBench(len, 1); }
+size_t benchAbInsertEnd(size_t len) { return abInsertBench(len, 2); }
+
+size_t abRemoveBench(size_t len, int where) {
+  appendBuffer ab = microLine(len + MICRO_OPS);
+
+  for (size_t i = 0; i < MICRO_OPS; i++) {
+    size_t at = where == 0 ? 0 : where == 1 ? ab.len / 2 : ab.len - 1;
+    abRemoveAt(&ab, at);
+  }
+
+  abFree(&ab);
+  return MICRO_OPS;
+}
+
+size_t benchAbRemoveStart(size_t len) { return abRemoveBench(len, 0); }
+size_t benchAbRemoveMiddle(size_t len) { return abRemoveBench(len, 1); }
+size_t benchAbRemoveEnd(size_t len) { return abRemoveBench(len, 2); }
+
+/*** row operations ***/
+
+/// Drops every row and puts the editor back to an empty buffer.
+void microReset() {
+  editorSpliceRows(0, E.buf->num_rows, 0);
+  free(E.buf->filename);
+  E.buf->filename = NULL;
+  E.buf->cx = E.buf->cy = E.buf->row_offset = E.buf->col_offset = 0;
+  E.buf->dirty = 0;
+}
+
+/// Types chars at the start, middle or end of a row through the editor, which
+/// also renders the row after each of them.
+size_t rowTypeBench(size_t len, int where) {
+  appendBuffer line = microLine(len);
+
+  microReset();
+  insertRowAt(line.buf, 0);
+
+  for (size_t i = 0; i < MICRO_OPS; i++) {
+    E.buf->cx = where == 0 ? 0 : where == 1 ? E.buf->rows[0].chars.len / 2
+                                       : E.buf->rows[0].chars.len;
+    editorInsertChar('x');
+  }
+
+  abFree(&line);
+  return MICRO_OPS;
+}
+
+size_t benchRowTypeStart(size_t len) { return rowTypeBench(len, 0); }
+size_t benchRowTypeMiddle(size_t len) { return rowTypeBench(len, 1); }
+size_t benchRowTypeEnd(size_t len) { return rowTypeBench(len, 2); }
+
+size_t benchRowNewline(size_t len) {
+  appendBuffer line = microLine(len);
+
+  microReset();
+  insertRowAt(line.buf, 0);
+
+  for (size_t i = 0; i < MICRO_OPS; i++) {
+    E.buf->cx = E.buf->rows[E.buf->cy].chars.len / 2;
+    editorInsertNewline();
+  }
+
+  abFree(&line);
+  return MICRO_OPS;
+}
+
+/*** files ***/
+
+char *microFilePath(char *buf, size_t lines) {
+  snprintf(buf, 128, "%s/%zu.txt", Micro.dir, lines);
+  return buf;
+}
+
+/// Generates a file of `lines` lines, with a `needle` on the last one.
+void microWriteFile(size_t lines) {
+  char path[128] = {0};
+  FILE *fp = fopen(microFilePath(path, lines), "w");
+
+  if (!fp)
+    die("fopen");
+
+  for (size_t i = 0; i < lines - 1; i++)
+    fprintf(fp, "%zu\tlorem ipsum dolor sit amet, consectetur elit %zu\n", i,
+            i * 7919);
+  fprintf(fp, "the needle is here\n");
+
+  fclose(fp);
+}
+
+void microOpen(size_t lines) {
+  char path[128] = {0};
+
+  microReset();
+  editorOpen(microFilePath(path, lines));
+
+  while (E.buf->loader)
+    eventWait(-1);
+}
+
+size_t benchOpen(size_t lines) {
+  microOpen(lines);
+  return lines;
+}
+
+size_t benchSave(size_t lines) {
+  char path[128] = {0};
+
+  free(E.buf->filename);
+  E.buf->filename = strdup(microFilePath(path, 0));
+  editorSave();
+
+  return lines;
+}
+
+size_t benchSearch(size_t lines) {
+  editorFindCallback("needle", 'e');
+  editorFindCallback("needle", ENTER);
+
+  return lines;
+}
+
+void microCleanUp() {
+  DIR *dir = opendir(Micro.dir);
+  struct dirent *entry = NULL;
+  char path[512] = {0};
+
+  while (dir && (entry = readdir(dir))) {
+    if (entry->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", Micro.dir, entry->d_name);
+    unlink(path);
+  }
+
+  if (dir)
+    closedir(dir);
+  rmdir(Micro.dir);
+}
+
+int main(int argc, char *argv[]) {
+  int opt = 0;
+
+  while ((opt = getopt(argc, argv, "r:m:")) != -1) {
+    if (opt == 'r') {
+      Micro.reps = strtoul(optarg, NULL, 10);
+    } else if (opt == 'm') {
+      Micro.max_lines = strtoul(optarg, NULL, 10);
+    } else {
+      fprintf(stderr, "usage: microbench [-r REPS] [-m MAX_LINES] "
+                      "[filter...]\n");
+      return 1;
+    }
+  }
+
+  if (Micro.reps == 0)
+    Micro.reps = 1;
+
+  Micro.filters = &argv[optind];
+  Micro.num_filters = argc - optind;
+
+  E.headless = 1;
+  E.screen_cols = 80;
+  E.screen_rows = 24;
+  initEditor();
+
+  microRun("ab_append", benchAbAppend, 1000000);
+  microRun("ab_append_char", benchAbAppendChar, 1000000);
+  microRun("ab_resize", benchAbResize, 1000000);
+
+  size_t line_lengths[] = {80, 4096};
+  for (size_t i = 0; i < 2; i++) {
+    size_t len = line_lengths[i];
+
+    microRun("ab_insert_start", benchAbInsertStart, len);
+    microRun("ab_insert_middle", benchAbInsertMiddle, len);
+    microRun("ab_insert_end", benchAbInsertEnd, len);
+    microRun("ab_remove_start", benchAbRemoveStart, len);
+    microRun("ab_remove_middle", benchAbRemoveMiddle, len);
+    microRun("ab_remove_end", benchAbRemoveEnd, len);
+    microRun("row_type_start", benchRowTypeStart, len);
+    microRun("row_type_middle", benchRowTypeMiddle, len);
+    microRun("row_type_end", benchRowTypeEnd, len);
+    microRun("row_newline", benchRowNewline, len);
+  }
+
+  // A long line, laid out in chunks.
+  microRun("row_type_middle", benchRowTypeMiddle, 1 << 20);
+
+  if (!microSelected("open") && !microSelected("save") &&
+      !microSelected("search"))
+    return 0;
+
+  strcpy(Micro.dir, "/tmp/fire-microbench-XXXXXX");
+  if (!mkdtemp(Micro.dir))
+    die("mkdtemp");
+  atexit(microCleanUp);
+
+  for (size_t lines = 1000; lines <= Micro.max_lines; lines *= 10) {
+    microWriteFile(lines);
+
+    microRun("open", benchOpen, lines);
+
+    // Save and search work on the file left open by the last run.
+    if (!microSelected("open"))
+      microOpen(lines);
+    microRun("save", benchSave, lines);
+    microRun("search", benchSearch, lines);
+
+    microReset();
+  }
+
+  return 0;
+}
@@ -1,52 +1,211 @@
 #pragma once
 
 #include "base.c"
+#include "buffer.c"
+#include "diff.c"
+#include "event.c"
+#include "grep.c"
+#include "macro.c"
+#include "register.c"
+#include "word.c"
 #include <string.h>
 
-void handleDoubleNormalKey(uint64_t c, uint64_t last_command) {
-  switch (c) {
-  case 'g': // gg: go to top of the file
-    if (last_command == 'g')
-      E.cy = 0;
+#define NORMAL_MAX_COUNT 99999999 // Typing more digits doesn't grow it.
+
+/// The command being typed: a count, a register, and a key like `d` that
+/// waits for the next one.
+struct normalCommand {
+  size_t count; // 0 when none was typed.
+  uint64_t reg; // Typed after `"`, 0 when none was.
+  uint64_t pending;
+};
+
+struct normalCommand Normal = {0};
+
+/// Whether the command being typed waits for more keys.
+uint_fast8_t normalPending() {
+  return Normal.pending != 0 || Normal.count != 0 || Normal.reg != 0;
+}
+
+/// Moves `count` times, or as far as it goes. Not moving at all stops the
+/// macro being replayed.
+void normalMove(uint64_t key, size_t count) {
+  uint_fast32_t y = E.buf->cy;
+  uint_fast32_t x = E.buf->cx;
+
+  for (size_t i = 0; i < count; i++) {
+    uint_fast32_t last_y = E.buf->cy;
+    uint_fast32_t last_x = E.buf->cx;
+
+    moveCursor(key);
+    if (E.buf->cy == last_y && E.buf->cx == last_x)
+      break;
+  }
+
+  if (E.buf->cy == y && E.buf->cx == x)
+    macroFail();
+}
+
+/// Moves `count` words with the motion `key`, like `normalMove`.
+void normalWordMove(uint64_t key, size_t count) {
+  textPos from = {.y = E.buf->cy, .x = E.buf->cx};
+  textPos p = from;
+
+  for (size_t i = 0; i < count; i++) {
+    textPos next = wordMotion(p, key);
+
+    if (next.y == p.y && next.x == p.x)
+      break;
+    p = next;
+  }
+
+  if (p.y == from.y && p.x == from.x)
+    macroFail();
+
+  E.buf->cy = p.y;
+  E.buf->cx = p.x;
+}
+
+/// Handles the key that follows the pending one of `cmd`.
+void handleDoubleNormalKey(uint64_t c, struct normalCommand cmd) {
+  size_t count = cmd.count;
+  size_t times = count ? count : 1;
+
+  switch (cmd.pending) {
+  case 'g': // gg: go to top of the file, or to line `count`.
+    if (c == 'g') {
+      size_t line = count < E.buf->num_rows ? count : E.buf->num_rows;
+      E.buf->cy = line == 0 ? 0 : line - 1;
+      moveCursor(0); // Stay inside the row.
+    }
     break;
 
-  case 'd':
-    if (last_command == 'd') {
-      if (E.cx >= E.rows[E.cy + 1].render.len)
-        E.cx = E.rows[E.cy + 1].chars.len;
-      abClear(&E.rows[E.cy].chars);
-      editorDelRow(E.cy);
+  case '"': // The register for the command that follows.
+    if (registerNamed(c))
+      Normal = (struct normalCommand){.count = count, .reg = c};
+    break;
+
+  case 'y': // yy: yank `count` lines, they are not copied.
+    if (c == 'y') {
+      registerYank(cmd.reg, E.buf->cy, times);
+      if (times > 2)
+        setStatusMessage("%zu lines yanked", times);
     }
     break;
 
-  default:
-    if (last_command == 'r' && c != ESC) {
-      // Replace one char with just typed char.
-      E.rows[E.cy].chars.buf[E.cx] = c;
-      updateRow(&E.rows[E.cy]);
+  case 'd': // dd: delete `count` lines in one go, into a register.
+    if (c == 'd' && E.buf->cy < E.buf->num_rows) {
+      registerYank(cmd.reg, E.buf->cy, times);
+      editorDelRows(E.buf->cy, times);
+      if (E.buf->cy >= E.buf->num_rows && E.buf->num_rows > 0)
+        E.buf->cy = E.buf->num_rows - 1;
+      moveCursor(0);
+    }
+    break;
+
+  case ']': // ]c: go to the next change from the file on disk, [c back.
+  case '[':
+    if (c == 'c') {
+      int64_t step = times;
+      if (!diffJump(cmd.pending == ']' ? step : -step))
+        macroFail();
+    }
+    break;
+
+  case 'q': // Record a macro into the register.
+    macroRecord(c);
+    break;
+
+  case '@': // Run the macro in the register, `count` times.
+    macroRun(c, count);
+    break;
+
+  case 'r':
+    if (c != ESC && c < 256 && E.buf->cy < E.buf->num_rows) {
+      // Replace `count` chars with just typed char, which may take a few
+      // bytes.
+      char typed[4] = {c};
+      size_t want = utf8SequenceLength(c);
+      size_t len = 1;
+
+      while (len < want && (macroReplaying() ? macroHasKey() : inputHasKey())) {
+        uint64_t next = macroReplaying() ? macroPeekKey() : inputPeekKey();
+        if (next >= 256 || !utf8IsContinuation(next))
+          break;
+        typed[len++] = readKey();
+      }
+
+      // A char cut short or not valid UTF-8 isn't written, the keys after it
+      // are left for the commands they belong to.
+      uint32_t cp = 0;
+      if (len < want || utf8Decode(typed, len, &cp) != len ||
+          (len == 1 && c >= 0x80)) {
+        macroFail();
+        break;
+      }
+
+      // Like Vim, nothing is replaced when the row hasn't `count` chars left.
+      row *r = &E.buf->rows[E.buf->cy];
+      size_t end = E.buf->cx;
+      size_t found = 0;
+      for (; found < times && end < r->chars.len; found++)
+        end = editorRowNextChar(r, end);
+
+      if (found < times) {
+        macroFail();
+        break;
+      }
+
+      appendBuffer with = newAppendBuffer();
+      for (size_t i = 0; i < times; i++)
+        abAppendN(&with, typed, len);
+
+      editorReplaceRange((textPos){.y = E.buf->cy, .x = E.buf->cx},
+                         (textPos){.y = E.buf->cy, .x = end}, with.buf,
+                         with.len);
+      abFree(&with);
     }
     break;
   }
 }
 
 void handleNormalKey(uint64_t c) {
-  static uint64_t last_command = '\0';
   static uint_fast8_t quit_times = QUIT_TIMES;
+  struct normalCommand cmd = Normal;
+  size_t count = cmd.count;
+  size_t times = count ? count : 1;
+
+  if (cmd.pending) {
+    Normal = (struct normalCommand){0};
+    handleDoubleNormalKey(c, cmd);
+    return;
+  }
+
+  // A count for the command that follows, a `0` alone is not one.
+  if (c >= '0' && c <= '9' && (c != '0' || count > 0)) {
+    if (count < NORMAL_MAX_COUNT)
+      Normal.count = count * 10 + (c - '0');
+    return;
+  }
+  Normal = (struct normalCommand){0};
 
   switch (c) {
   case ENTER:
-    E.cy += 1; // Move to the line below.
+    if (E.buf->grep)
+      grepOpenHit(); // Of the results of a search.
+    else
+      E.buf->cy += 1; // Move to the line below.
     break;
 
   case CTRL_KEY('c'):
-    if (E.dirty && quit_times > 0) {
+    if (buffersModified() && quit_times > 0) {
       setStatusMessage("¡WARNING! File has unsaved changes. Press Ctrl-C %d "
                        "more times to quit.",
                        quit_times);
       quit_times--;
       return;
     }
-    write(STDOUT_FILENO, "\x1b[2J\x1b[H", 7); // Clear screen.
+    editorWrite("\x1b[2J\x1b[H", 7); // Clear screen.
     exit(0);
     break;
 
@@ -54,21 +213,40 @@ void handleNormalKey(uint64_t c) {
     editorSave();
     break;
 
+  case PASTE:
+    editorInsertText(inputPaste()->buf, inputPaste()->len);
+    break;
+
   case BACKSPACE:
-    E.cx -= 1;
+    normalMove(ARROW_LEFT, times);
     break;
 
   case 'H': // Move to beginning of line.
-    E.cx = 0;
+    E.buf->cx = 0;
     break;
   case 'L': // Move to end of line.
-    E.cx = E.rows[E.cy].render.len;
+    E.buf->cx = E.buf->rows[E.buf->cy].chars.len;
+    break;
+  case 'G': // Move to the end of the file, or to line `count`.
+    E.buf->cy =
+        (count && count < E.buf->num_rows ? count : E.buf->num_rows) - 1;
+    moveCursor(0);
     break;
-  case 'G': // Move to the end of the file.
-    E.cy = E.num_rows - 1;
+  case 'M': // Move to the middle of the screen.
+    E.buf->cy = editorMiddleRow();
+    moveCursor(0); // Stay inside the row.
+    break;
+
+  case 'F': // Follow what gets appended to the file, like tail -f.
+    followToggle();
+    break;
+
+  case CTRL_KEY('w'): // Wrap lines longer than the screen, or stop it.
+    wrapToggle();
+    setStatusMessage("Soft wrap %s", E.buf->wrap ? "on" : "off");
     break;
   case 'O': { // Insert new line above the line of the cursor.
-    E.cx = 0;
+    E.buf->cx = 0;
     editorInsertNewline();
     moveCursor(ARROW_UP);
     E.mode = INSERT;
@@ -79,62 +257,103 @@ void handleNormalKey(uint64_t c) {
   case ARROW_UP:
   case ARROW_LEFT:
   case ARROW_RIGHT:
-    moveCursor(c);
+    normalMove(c, times);
     break;
   case 'j':
-    moveCursor(ARROW_DOWN);
+    normalMove(ARROW_DOWN, times);
     break;
   case 'k':
-    moveCursor(ARROW_UP);
+    normalMove(ARROW_UP, times);
     break;
   case 'h':
-    moveCursor(ARROW_LEFT);
+    normalMove(ARROW_LEFT, times);
     break;
   case 'l':
-    moveCursor(ARROW_RIGHT);
+    normalMove(ARROW_RIGHT, times);
     break;
 
   case '/':
     editorFind();
     break;
 
+  case ':': // Ex command, like :%sort or :g/pattern/d.
+    editorExPrompt();
+    break;
+
   case 'i':
     E.mode = INSERT;
     break;
 
-  case 'x': // Delete the char under the cursor.
-    rowDelChar(&E.rows[E.cy], E.cx);
+  case 'x': // Delete `count` chars from the cursor on.
+    if (E.buf->cy < E.buf->num_rows) {
+      size_t end = E.buf->cx;
+      for (size_t i = 0; i < times; i++)
+        end = editorRowNextChar(&E.buf->rows[E.buf->cy], end);
+
+      editorDeleteRange((textPos){.y = E.buf->cy, .x = E.buf->cx},
+                        (textPos){.y = E.buf->cy, .x = end});
+    }
     break;
 
+  case 'J': // Join the lines below to this one, `count` lines in total.
+    for (size_t i = 1; i < times || i == 1; i++)
+      editorJoinLines();
+    break;
+
+  case 'w': // Word motions, across lines.
+  case 'W':
   case 'b':
-    // TODO Implement word traversal backwards.
-    break;
-  case 'w': {
-    // TODO Implement word traversal right.
-    char *line_from_cursor = &E.rows[E.cy].chars.buf[E.cx];
-    char *first_space = strchr(line_from_cursor, ' ');
-    // You should move X to the first non-white-space char.
-    if (first_space) {
-      E.cx += (first_space - line_from_cursor) + 1;
-    } else {
-      E.cx = 0;
-      moveCursor(ARROW_DOWN);
-    }
-  } break;
+  case 'B':
+  case 'e':
+    normalWordMove(c, times);
+    break;
 
   case 'u':
-    // TODO implement undo.
+    for (size_t i = 0; i < times; i++)
+      editorUndo();
+    break;
+  case CTRL_KEY('r'):
+    for (size_t i = 0; i < times; i++)
+      editorRedo();
+    break;
+
+  case '.': // Repeat the last change.
+    macroRepeat(count);
+    break;
+
+  case 'q': // Stop recording a macro, or start with the register typed next.
+    if (Macros.recording)
+      macroStop();
+    else
+      Normal.pending = c;
+    break;
+
+  case 'p': // Put the lines of the register below the cursor.
+    registerPut(cmd.reg, E.buf->num_rows ? E.buf->cy + 1 : 0, times);
+    break;
+  case 'P': // Put them above it.
+    registerPut(cmd.reg, E.buf->cy, times);
+    break;
+
+  case 'g': // Wait for the next key, keeping the count for it.
+  case 'd':
+  case 'y':
+  case 'r':
+  case '@':
+  case '"':
+  case ']':
+  case '[':
+    Normal = cmd;
+    Normal.pending = c;
     break;
 
   case 'o': { // Insert new line below the line of the cursor.
-    E.cx = E.rows[E.cy + E.row_offset].render.len;
+    E.buf->cx = E.buf->rows[E.buf->cy].chars.len;
     editorInsertNewline();
     E.mode = INSERT;
   } break;
 
   default:
-    handleDoubleNormalKey(c, last_command);
-    last_command = c;
     break;
   }
 }
@@ -0,0 +1,436 @@
+#pragma once
+
+#include "base.c"
+#include "trace.c"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*** pager ***/
+#define PAGER_MAX_MARKS 4096 // Lines known by the index, whatever the size.
+#define PAGER_RELEASE_MIN (16 << 20) // Smaller scans keep their pages.
+
+/// Read only view of a file, drawn straight from its mapping. Instead of rows
+/// there is a sparse index with where every `stride` lines start, built as
+/// far as the file has been looked at. When it fills up every other mark is
+/// dropped and the stride doubles, so the memory it takes stays the same.
+struct pager {
+  const char *map;
+  size_t size;
+
+  size_t marks[PAGER_MAX_MARKS]; // Start of line i * `stride`.
+  size_t num_marks;
+  size_t stride;
+
+  // The file is indexed up to the start of line `scanned_lines`.
+  size_t scanned_lines;
+  size_t scanned_bytes;
+  size_t num_lines; // Only known once `complete`.
+  uint_fast8_t complete;
+
+  // Last line looked up, so moving line by line doesn't go through the index.
+  size_t last_line;
+  size_t last_start;
+
+  char *query; // Last search.
+};
+
+/// Skips up to `lines` line breaks of the `len` bytes of `s`, counting them 32
+/// bytes at a time. Returns where the line after the last one skipped starts,
+/// and how many were skipped through `skipped`.
+size_t skipLines(const char *s, size_t len, size_t lines, size_t *skipped) {
+  const uint64_t low7 = 0x7F7F7F7F7F7F7F7F;
+  const uint64_t breaks = 0x0A0A0A0A0A0A0A0A;
+  size_t after = 0;
+  size_t i = 0;
+
+  *skipped = 0;
+
+  // Whole blocks while they have less breaks than left to skip.
+  for (; i + 32 <= len; i += 32) {
+    words32 w;
+    memcpy(&w, &s[i], sizeof(w));
+    w ^= breaks;
+
+    // Only the high bit of the bytes that were line breaks is set.
+    words32 zero = ~(((w & low7) + low7) | w | low7);
+    size_t count = 0;
+
+    for (size_t j = 0; j < 4; j++)
+      count += __builtin_popcountll(zero[j]);
+
+    if (*skipped + count >= lines)
+      break;
+
+    *skipped += count;
+    for (size_t j = 4; count > 0 && j-- > 0;) {
+      if (zero[j]) {
+        after = i + j * 8 + (63 - __builtin_clzll(zero[j])) / 8 + 1;
+        break;
+      }
+    }
+  }
+
+  while (*skipped < lines) {
+    const char *p = memchr(&s[i], '\n', len - i);
+    if (p == NULL)
+      break;
+
+    i = after = p - s + 1;
+    (*skipped)++;
+  }
+
+  return after;
+}
+
+/// Lets the kernel drop the pages from `from` to `to` that were only read to
+/// get through them, so the resident size doesn't grow with the file.
+void pagerRelease(size_t from, size_t to) {
+  struct pager *p = E.buf->pager;
+  size_t page = sysconf(_SC_PAGESIZE);
+
+  from = (from + page - 1) / page * page;
+  to = to / page * page;
+
+  if (to > from && to - from >= PAGER_RELEASE_MIN)
+    madvise((char *)&p->map[from], to - from, MADV_DONTNEED);
+}
+
+/// Extends the index until it has the start of line `line`, or of a line
+/// after byte `byte`, or the whole file.
+void pagerScan(size_t line, size_t byte) {
+  struct pager *p = E.buf->pager;
+  size_t scan_start = p->scanned_bytes;
+
+  while (!p->complete && p->scanned_lines < line && p->scanned_bytes <= byte) {
+    if (p->scanned_lines == p->num_marks * p->stride) {
+      if (p->num_marks == PAGER_MAX_MARKS) {
+        for (size_t i = 0; i < PAGER_MAX_MARKS / 2; i++)
+          p->marks[i] = p->marks[i * 2];
+        p->num_marks /= 2;
+        p->stride *= 2;
+      }
+
+      p->marks[p->num_marks++] = p->scanned_bytes;
+    }
+
+    // Up to the next mark.
+    size_t want = p->num_marks * p->stride - p->scanned_lines;
+    if (want > line - p->scanned_lines)
+      want = line - p->scanned_lines;
+
+    size_t skipped = 0;
+    size_t after = skipLines(&p->map[p->scanned_bytes],
+                             p->size - p->scanned_bytes, want, &skipped);
+
+    p->scanned_lines += skipped;
+    p->scanned_bytes += after;
+
+    if (skipped < want) {
+      // The last line may have no line break.
+      p->num_lines = p->scanned_lines + (p->scanned_bytes < p->size);
+      p->complete = 1;
+    }
+  }
+
+  pagerRelease(scan_start, p->scanned_bytes);
+}
+
+/// Lines known so far, all of them once the file is indexed.
+size_t pagerNumLines() {
+  struct pager *p = E.buf->pager;
+
+  return p->complete ? p->num_lines : p->scanned_lines;
+}
+
+/// Where line `line` starts, the size of the file if there is no such line.
+size_t pagerLineStart(size_t line) {
+  struct pager *p = E.buf->pager;
+
+  pagerScan(line, SIZE_MAX);
+  if (line >= p->scanned_lines)
+    return line == p->scanned_lines ? p->scanned_bytes : p->size;
+
+  // From the closest line known before it, or back from the last one.
+  size_t from_line = line / p->stride * p->stride;
+  size_t start = p->marks[line / p->stride];
+
+  if (p->last_line <= line && p->last_line >= from_line) {
+    from_line = p->last_line;
+    start = p->last_start;
+  } else if (p->last_line > line && p->last_line - line < line - from_line) {
+    start = p->last_start;
+
+    for (size_t l = p->last_line; l > line; l--) {
+      const char *prev = memrchr(p->map, '\n', start - 1);
+      start = prev ? (size_t)(prev - p->map) + 1 : 0;
+    }
+    from_line = line;
+  }
+
+  size_t skipped = 0;
+  if (line > from_line)
+    start += skipLines(&p->map[start], p->size - start, line - from_line,
+                       &skipped);
+
+  p->last_line = line;
+  p->last_start = start;
+  return start;
+}
+
+/// Line `line`, without its line break, NULL if there is no such line.
+const char *pagerLine(size_t line, size_t *len) {
+  struct pager *p = E.buf->pager;
+  size_t start = pagerLineStart(line);
+
+  *len = 0;
+  if (start >= p->size)
+    return NULL;
+
+  const char *s = &p->map[start];
+  const char *end = memchr(s, '\n', p->size - start);
+
+  *len = end ? (size_t)(end - s) : p->size - start;
+  if (*len > 0 && s[*len - 1] == '\r')
+    (*len)--;
+
+  return s;
+}
+
+/// Line of the byte at `byte`.
+size_t pagerLineOf(size_t byte) {
+  struct pager *p = E.buf->pager;
+
+  pagerScan(SIZE_MAX, byte);
+
+  // The last mark before it.
+  size_t lo = 0;
+  size_t hi = p->num_marks;
+
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (p->marks[mid] <= byte)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  size_t skipped = 0;
+  skipLines(&p->map[p->marks[lo]], byte - p->marks[lo], SIZE_MAX, &skipped);
+
+  return lo * p->stride + skipped;
+}
+
+/// Columns of the cursor and of the char after it.
+void pagerCursorCols(uint_fast32_t *rx, uint_fast32_t *rx_end) {
+  size_t len = 0;
+  const char *s = pagerLine(E.buf->cy, &len);
+  size_t cols = 0;
+  size_t next = 0;
+  uint8_t flags = 0;
+
+  if (E.buf->cx > len)
+    E.buf->cx = len;
+
+  rowRenderChars(s, E.buf->cx, 0, NULL, &cols, &flags);
+  if (E.buf->cx < len) {
+    uint32_t cp = 0;
+    rowRenderChars(&s[E.buf->cx],
+                   utf8Decode(&s[E.buf->cx], len - E.buf->cx, &cp), cols, NULL,
+                   &next, &flags);
+  }
+
+  *rx = cols;
+  *rx_end = cols + (next > 0 ? next : 1);
+}
+
+void pagerDrawRows(appendBuffer *ab) {
+  struct pager *p = E.buf->pager;
+  size_t text_cols = editorTextCols();
+  size_t start = pagerLineStart(E.buf->row_offset);
+
+  for (uint_fast32_t y = 0; y < E.screen_rows; y++) {
+    if (start < p->size) {
+      const char *s = &p->map[start];
+      const char *end = memchr(s, '\n', p->size - start);
+      size_t len = end ? (size_t)(end - s) : p->size - start;
+
+      start += len + 1;
+      if (len > 0 && s[len - 1] == '\r')
+        len--;
+
+      add_line_number(ab, E.buf->row_offset + y + 1, E.left_margin);
+      editorDrawChars(ab, s, len, 0, 0, E.buf->col_offset, text_cols);
+    }
+
+    abAppend(ab, "\x1b[K\r\n");
+  }
+}
+
+/// Moves the cursor to the next match of `query` after it, from the start of
+/// the file if there are no more.
+void pagerFind(const char *query) {
+  struct pager *p = E.buf->pager;
+  size_t query_len = strlen(query);
+  size_t from = pagerLineStart(E.buf->cy) + E.buf->cx + 1;
+
+  if (p->size == 0)
+    return;
+
+  uint64_t start = traceBegin();
+  if (from > p->size)
+    from = p->size;
+
+  const char *match = memmem(&p->map[from], p->size - from, query, query_len);
+  pagerRelease(from, match ? (size_t)(match - p->map) : p->size);
+
+  if (match == NULL) {
+    size_t end = from + query_len - 1 < p->size ? from + query_len - 1 : p->size;
+    match = memmem(p->map, end, query, query_len);
+    pagerRelease(0, match ? (size_t)(match - p->map) : end);
+  }
+
+  if (match == NULL) {
+    setStatusMessage("Not found: %s", query);
+  } else {
+    size_t line = pagerLineOf(match - p->map);
+
+    E.buf->cy = line;
+    E.buf->cx = match - p->map - pagerLineStart(line);
+
+    // Show it at the top, if it's not already on the screen.
+    if (E.buf->cy < (size_t)E.buf->row_offset ||
+        E.buf->cy >= E.buf->row_offset + E.screen_rows)
+      E.buf->row_offset = E.buf->cy;
+  }
+
+  traceEnd("search", start);
+}
+
+void handlePagerKey(uint64_t c) {
+  static uint64_t last_key = '\0';
+  struct pager *p = E.buf->pager;
+  size_t len = 0;
+  const char *s = pagerLine(E.buf->cy, &len);
+  size_t lines = E.screen_rows;
+
+  switch (c) {
+  case 'q':
+  case CTRL_KEY('c'):
+    editorWrite("\x1b[2J\x1b[H", 7); // Clear screen.
+    exit(0);
+    break;
+
+  case 'j':
+  case ARROW_DOWN:
+  case ENTER:
+    lines = 1;
+    // Fall through.
+  case ' ':
+  case PAGE_DOWN:
+    for (; lines > 0 && pagerLineStart(E.buf->cy + 1) < p->size; lines--)
+      E.buf->cy++;
+    break;
+
+  case 'k':
+  case ARROW_UP:
+    lines = 1;
+    // Fall through.
+  case PAGE_UP:
+    E.buf->cy = E.buf->cy > lines ? E.buf->cy - lines : 0;
+    break;
+
+  case 'g': // gg: go to the first line.
+    if (last_key == 'g')
+      E.buf->cy = 0;
+    break;
+
+  case 'G': // Go to the last line, which indexes the whole file.
+    pagerScan(SIZE_MAX, SIZE_MAX);
+    E.buf->cy = p->num_lines > 0 ? p->num_lines - 1 : 0;
+    break;
+
+  case 'h':
+  case ARROW_LEFT:
+  case BACKSPACE:
+    while (E.buf->cx > 0 && utf8IsContinuation(s[--E.buf->cx]))
+      ;
+    break;
+
+  case 'l':
+  case ARROW_RIGHT:
+    if (E.buf->cx < len) {
+      uint32_t cp = 0;
+      E.buf->cx += utf8Decode(&s[E.buf->cx], len - E.buf->cx, &cp);
+    }
+    break;
+
+  case 'H':
+    E.buf->cx = 0;
+    break;
+  case 'L':
+    E.buf->cx = len;
+    break;
+
+  case '/': {
+    char *query = editorPrompt("Search: %s (Use ESC/Enter)", NULL);
+
+    if (query && *query) {
+      free(p->query);
+      p->query = query;
+      pagerFind(query);
+    } else {
+      free(query);
+    }
+  } break;
+
+  case 'n': // Next match of the last search.
+    if (p->query)
+      pagerFind(p->query);
+    break;
+
+  case 'i':
+  case CTRL_KEY('s'):
+    setStatusMessage("Read only, opened with -R");
+    break;
+  }
+
+  last_key = c;
+
+  // Don't stay past the end of a shorter line, or in the middle of a char.
+  s = pagerLine(E.buf->cy, &len);
+  if (E.buf->cx > len)
+    E.buf->cx = len;
+  while (E.buf->cx > 0 && E.buf->cx < len && utf8IsContinuation(s[E.buf->cx]))
+    E.buf->cx--;
+}
+
+/// Opens `filename` read only, to be viewed without loading it.
+void pagerOpen(char *filename) {
+  struct stat st = {0};
+  int fd = open(filename, O_RDONLY);
+
+  if (fd == -1 || fstat(fd, &st) == -1)
+    die("open");
+
+  struct pager *p = calloc(1, sizeof(struct pager));
+  p->size = st.st_size;
+  p->stride = 1;
+
+  if (p->size > 0) {
+    p->map = mmap(NULL, p->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p->map == MAP_FAILED)
+      die("mmap");
+  } else {
+    p->complete = 1;
+  }
+
+  close(fd);
+  E.buf->filename = strdup(filename);
+  E.buf->file_stamp = fileStampOf(&st);
+  E.buf->pager = p;
+  openStateRestore();
+}
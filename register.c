@@ -0,0 +1,160 @@
+#pragma once
+
+#include "base.c"
+#include "loader.c"
+#include <stdlib.h>
+#include <string.h>
+
+/*** registers ***/
+#define REGISTER_UNNAMED 26 // After `a` to `z`, where yanks go by default.
+
+/// Lines kept by a register. Rows put from it, and the rows it was yanked
+/// from, borrow their chars from these and hold a reference each, so they
+/// are only copied when one side changes them.
+typedef struct rowStore {
+  size_t refs;
+  row *lines; // Only the chars, and the store they may borrow from.
+  size_t num_lines;
+  rowText *text; // Of the file, some lines may still borrow from it.
+} rowStore;
+
+/// A register holds whole lines. Right after a yank they are still just the
+/// rows `at` to `at + len` of the buffer, until an edit is about to change
+/// them or they are put, and they move into a `store`.
+typedef struct lineRegister {
+  rowStore *store; // NULL while the lines are rows of the file.
+  buffer *buf;     // Of the rows, while they are.
+  size_t at;
+  size_t len;
+} lineRegister;
+
+struct registers {
+  lineRegister regs[REGISTER_UNNAMED + 1];
+  lineRegister *last; // Written last, what a put without a name takes.
+};
+
+struct registers Registers = {0};
+
+void rowStoreRelease(rowStore *s) {
+  if (s == NULL || --s->refs > 0)
+    return;
+
+  for (size_t i = 0; i < s->num_lines; i++)
+    editorFreeRow(&s->lines[i]);
+  free(s->lines);
+  rowTextRelease(s->text);
+  free(s);
+}
+
+/// Makes `r` borrow the chars of line `i` of the store.
+void rowShare(row *r, rowStore *s, size_t i) {
+  appendBuffer *chars = &s->lines[i].chars;
+
+  r->chars = abBorrow(chars->buf, chars->len);
+  r->shared = s;
+  s->refs++;
+}
+
+/// Moves the chars of the rows of the register into a store, which the rows
+/// borrow them back from.
+void registerShare(lineRegister *reg) {
+  rowStore *s = malloc(sizeof(rowStore));
+
+  s->refs = 1;
+  s->num_lines = reg->len;
+  s->lines = malloc(sizeof(row) * (reg->len + 1));
+  s->text = reg->buf->text;
+  rowTextHold(s->text);
+
+  for (size_t i = 0; i < reg->len; i++) {
+    row *r = &reg->buf->rows[reg->at + i];
+
+    // The reference the row had, if it was shared already, goes along.
+    s->lines[i] = (row){.chars = r->chars, .shared = r->shared};
+    rowShare(r, s, i);
+  }
+
+  reg->store = s;
+}
+
+/// Called before `remove` rows at `at` are replaced with `insert` rows. The
+/// registers that are still rows of the buffer keep up with them, or take
+/// their lines before they change.
+void registersChanging(size_t at, size_t remove, size_t insert) {
+  for (size_t i = 0; i <= REGISTER_UNNAMED; i++) {
+    lineRegister *reg = &Registers.regs[i];
+
+    if (reg->store || reg->buf != E.buf || reg->len == 0 ||
+        at >= reg->at + reg->len)
+      continue;
+
+    if (at + remove <= reg->at)
+      reg->at = reg->at - remove + insert;
+    else
+      registerShare(reg);
+  }
+}
+
+/// The register called `name`, the last one written if it is 0.
+lineRegister *registerNamed(uint64_t name) {
+  if (name == 0)
+    return Registers.last;
+  if (name >= 'A' && name <= 'Z')
+    name += 'a' - 'A';
+  if (name >= 'a' && name <= 'z')
+    return &Registers.regs[name - 'a'];
+  if (name == '"')
+    return &Registers.regs[REGISTER_UNNAMED];
+
+  return NULL;
+}
+
+/// Keeps `n` rows from `at` on in register `name`, without copying them.
+void registerYank(uint64_t name, size_t at, size_t n) {
+  lineRegister *reg = name ? registerNamed(name) : registerNamed('"');
+
+  if (reg == NULL || at >= E.buf->num_rows)
+    return;
+  if (n > E.buf->num_rows - at)
+    n = E.buf->num_rows - at;
+
+  rowStoreRelease(reg->store);
+  *reg = (lineRegister){.buf = E.buf, .at = at, .len = n};
+  Registers.last = reg;
+}
+
+/// Puts the lines of register `name` `times` over before row `at`. They
+/// borrow their chars from the register until they are edited.
+void registerPut(uint64_t name, size_t at, size_t times) {
+  lineRegister *reg = registerNamed(name);
+
+  if (reg == NULL || reg->len == 0) {
+    setStatusMessage("Nothing in register %c", name ? (int)name : '"');
+    return;
+  }
+  if (reg->store == NULL)
+    registerShare(reg);
+  if (at > E.buf->num_rows)
+    at = E.buf->num_rows;
+
+  rowStore *s = reg->store;
+  size_t n = s->num_lines * times;
+
+  undoRecord(at, 0, n);
+  row *r = editorSpliceRows(at, 0, n);
+
+  for (size_t i = 0; i < n; i++) {
+    rowShare(&r[i], s, i % s->num_lines);
+
+    // Like loaded rows, the render is the chars unless there are tabs.
+    if (r[i].chars.len >= LONG_LINE || memchr(r[i].chars.buf, '\t',
+                                              r[i].chars.len))
+      updateRow(&r[i]);
+    else
+      r[i].render = r[i].chars;
+  }
+
+  E.buf->cy = at;
+  E.buf->cx = 0;
+  E.buf->dirty = 1;
+}
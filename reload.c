@@ -0,0 +1,404 @@
+#pragma once
+
+#include "base.c"
+#include "complete.c"
+#include "event.c"
+#include "loader.c"
+#include "register.c"
+#include "trace.c"
+#include "watch.c"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*** reload ***/
+#define DIFF_WINDOW 64   // Lines looked at first where the rows differ.
+#define DIFF_RUN 4       // Lines that must be the same to be back in step.
+#define DIFF_MAX_CHAIN 8 // Places a line is looked for at, at most.
+
+/// A line of the file as it is on disk now.
+typedef struct diskLine {
+  const char *s;
+  size_t len;
+  uint64_t hash; // Set when it's in the window of `diffRows`.
+} diskLine;
+
+/// Rows `old_start` to `old_start + old_len` that are replaced with `new_len`
+/// lines of the file, which start at row `new_start` once it is reloaded.
+typedef struct reloadHunk {
+  size_t old_start;
+  size_t old_len;
+  size_t new_start;
+  size_t new_len;
+} reloadHunk;
+
+/// Hashes a line a word at a time.
+uint64_t lineHash(const char *s, size_t len) {
+  uint64_t h = len * 0x9e3779b97f4a7c15;
+  uint64_t w = 0;
+  size_t i = 0;
+
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&w, &s[i], 8);
+    h = (h ^ w) * 0xff51afd7ed558ccd;
+    h ^= h >> 29;
+  }
+
+  w = 0;
+  memcpy(&w, &s[i], len - i);
+  h = (h ^ w) * 0xc4ceb9fe1a85ec53;
+
+  return h ^ (h >> 32);
+}
+
+/// Length of a line without the `\r` of CRLF line endings, like the rows.
+size_t diskLineLen(const char *s, size_t len) {
+  while (len > 0 && s[len - 1] == '\r')
+    len--;
+
+  return len;
+}
+
+uint_fast8_t rowEqualsLine(row *r, const char *s, size_t len) {
+  return r->chars.len == len && memcmp(r->chars.buf, s, len) == 0;
+}
+
+/// Adds a hunk for rows `oi` to `oo` replaced with lines `ni` to `nn`, both
+/// counted from row `at`.
+void diffAddHunk(reloadHunk **hunks, size_t *num_hunks, size_t *cap_hunks,
+                 size_t at, size_t oi, size_t oo, size_t ni, size_t nn) {
+  if (*num_hunks == *cap_hunks) {
+    *cap_hunks = *cap_hunks ? *cap_hunks * 2 : 16;
+    *hunks = realloc(*hunks, sizeof(reloadHunk) * *cap_hunks);
+  }
+
+  (*hunks)[(*num_hunks)++] = (reloadHunk){.old_start = at + oi,
+                                          .old_len = oo - oi,
+                                          .new_start = at + ni,
+                                          .new_len = nn - ni};
+}
+
+/// Finds what changed between `m` rows from row `at` on and `k` lines of the
+/// file, that start at the same row. Both are walked together while they are
+/// the same. Where they differ, the next `DIFF_WINDOW` lines of each are
+/// hashed to find the closest place where `DIFF_RUN` lines are the same again,
+/// and the window doubles until one is found, so the time goes with the size
+/// of the changes more than with the size of the file.
+size_t diffRows(size_t at, size_t m, diskLine *lines, size_t k,
+                reloadHunk **hunks) {
+  size_t num_hunks = 0;
+  size_t cap_hunks = 0;
+  size_t oi = 0;
+  size_t ni = 0;
+
+  // Lines of the window of the file by hash, chained by `next`.
+  size_t *heads = NULL;
+  size_t *next = NULL;
+
+#define SAME(i, j)                                                             \
+  rowEqualsLine(&E.buf->rows[at + (i)], lines[j].s, lines[j].len)
+
+  *hunks = NULL;
+
+  while (oi < m && ni < k) {
+    if (SAME(oi, ni)) {
+      oi++;
+      ni++;
+      continue;
+    }
+
+    for (size_t window = DIFF_WINDOW;; window *= 2) {
+      size_t oe = m - oi < window ? m : oi + window;
+      size_t ne = k - ni < window ? k : ni + window;
+
+      size_t cap = 1;
+      while (cap < (ne - ni) * 2)
+        cap *= 2;
+
+      heads = realloc(heads, sizeof(size_t) * cap);
+      next = realloc(next, sizeof(size_t) * (ne - ni));
+      memset(heads, 0xff, sizeof(size_t) * cap);
+
+      for (size_t j = ne; j > ni; j--) {
+        lines[j - 1].hash = lineHash(lines[j - 1].s, lines[j - 1].len);
+        size_t slot = lines[j - 1].hash & (cap - 1);
+
+        next[j - 1 - ni] = heads[slot];
+        heads[slot] = j - 1;
+      }
+
+      // Closest pair of lines, in lines skipped from both, that starts a run.
+      size_t best_o = oe;
+      size_t best_n = ne;
+      size_t best = SIZE_MAX;
+
+      for (size_t i = oi; i < oe && i - oi < best; i++) {
+        row *r = &E.buf->rows[at + i];
+        uint64_t hash = lineHash(r->chars.buf, r->chars.len);
+        size_t chain = 0;
+
+        for (size_t j = heads[hash & (cap - 1)];
+             j != SIZE_MAX && chain < DIFF_MAX_CHAIN; j = next[j - ni]) {
+          if ((i - oi) + (j - ni) >= best)
+            break; // The rest are further, the chain goes down the file.
+          if (lines[j].hash != hash)
+            continue;
+          chain++;
+
+          size_t run = 0;
+          while (run < DIFF_RUN && i + run < m && j + run < k &&
+                 SAME(i + run, j + run))
+            run++;
+
+          if (run == DIFF_RUN || (run > 0 && (i + run == m || j + run == k))) {
+            best = (i - oi) + (j - ni);
+            best_o = i;
+            best_n = j;
+          }
+        }
+      }
+
+      if (best != SIZE_MAX || (oe == m && ne == k)) {
+        diffAddHunk(hunks, &num_hunks, &cap_hunks, at, oi, best_o, ni, best_n);
+        oi = best_o;
+        ni = best_n;
+        break;
+      }
+    }
+  }
+#undef SAME
+
+  if (oi < m || ni < k)
+    diffAddHunk(hunks, &num_hunks, &cap_hunks, at, oi, m, ni, k);
+
+  free(heads);
+  free(next);
+
+  return num_hunks;
+}
+
+/// Where row `y` is after the hunks are applied. Rows that were replaced go
+/// to the lines that replaced them.
+size_t reloadMapRow(reloadHunk *hunks, size_t num_hunks, size_t y) {
+  size_t shifted = y;
+
+  for (size_t i = 0; i < num_hunks; i++) {
+    reloadHunk *h = &hunks[i];
+
+    if (y < h->old_start)
+      break;
+
+    if (y < h->old_start + h->old_len) {
+      size_t into = y - h->old_start;
+      return h->new_start + (into < h->new_len ? into : h->new_len);
+    }
+
+    shifted = shifted + h->new_len - h->old_len;
+  }
+
+  return shifted;
+}
+
+/// Reads the whole file `fd` of `size` bytes. Returns the bytes read, which
+/// are fewer if it was truncated meanwhile.
+size_t reloadRead(int fd, char *buf, size_t size) {
+  size_t done = 0;
+
+  while (done < size) {
+    ssize_t n = read(fd, &buf[done], size - done);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    done += n;
+  }
+
+  return done;
+}
+
+/// Loads what changed in the file on disk into the rows. The rows at the start
+/// and at the end that are the same are skipped, the lines in between are
+/// diffed by their hashes and only the rows that differ are replaced, so
+/// the cursor and the view stay on the same text. Returns whether the file
+/// could be read.
+uint_fast8_t editorReload() {
+  struct stat st = {0};
+  int fd = open(E.buf->filename, O_RDONLY | O_CLOEXEC);
+
+  if (fd == -1)
+    return 0;
+
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return 0;
+  }
+
+  uint64_t start = traceBegin();
+  char *text = malloc(st.st_size + 1);
+  size_t size = reloadRead(fd, text, st.st_size);
+  close(fd);
+
+  const char *p = text;
+  const char *end = text + size;
+
+  // Rows at the start that are the same, compared where each would end.
+  size_t prefix = 0;
+  while (prefix < E.buf->num_rows && p < end) {
+    row *r = &E.buf->rows[prefix];
+    const char *line_end = p + r->chars.len;
+
+    if ((size_t)(end - p) < r->chars.len ||
+        memcmp(r->chars.buf, p, r->chars.len) != 0)
+      break;
+
+    while (line_end < end && *line_end == '\r')
+      line_end++;
+    if (line_end < end && *line_end != '\n')
+      break;
+
+    prefix++;
+    p = line_end < end ? line_end + 1 : end;
+  }
+
+  // And at the end, the last line break doesn't start another line.
+  size_t old_end = E.buf->num_rows;
+  const char *tail = end > p && end[-1] == '\n' ? end - 1 : end;
+  uint_fast8_t has_lines = p < end;
+
+  while (has_lines && old_end > prefix) {
+    row *r = &E.buf->rows[old_end - 1];
+    const char *line_end = tail;
+
+    while (line_end > p && line_end[-1] == '\r')
+      line_end--;
+    if ((size_t)(line_end - p) < r->chars.len)
+      break;
+
+    const char *line_start = line_end - r->chars.len;
+    if ((line_start > p && line_start[-1] != '\n') ||
+        memcmp(r->chars.buf, line_start, r->chars.len) != 0)
+      break;
+
+    old_end--;
+    has_lines = line_start > p;
+    tail = line_start > p ? line_start - 1 : p;
+  }
+
+  // Lines in between.
+  diskLine *lines = NULL;
+  size_t num_lines = 0;
+  size_t cap_lines = 0;
+
+  for (const char *s = p; has_lines;) {
+    const char *nl = memchr(s, '\n', tail - s);
+    const char *line_end = nl ? nl : tail;
+
+    if (num_lines == cap_lines) {
+      cap_lines = cap_lines ? cap_lines * 2 : 64;
+      lines = realloc(lines, sizeof(diskLine) * cap_lines);
+    }
+
+    size_t len = diskLineLen(s, line_end - s);
+    lines[num_lines++] = (diskLine){.s = s, .len = len};
+
+    has_lines = nl != NULL;
+    s = nl ? nl + 1 : tail;
+  }
+
+  reloadHunk *hunks = NULL;
+  size_t num_hunks =
+      diffRows(prefix, old_end - prefix, lines, num_lines, &hunks);
+
+  size_t cy = reloadMapRow(hunks, num_hunks, E.buf->cy);
+  size_t row_offset = reloadMapRow(hunks, num_hunks, E.buf->row_offset);
+  size_t added = 0;
+  size_t removed = 0;
+
+  // From the last one, so the rows of the others are still where they were.
+  for (size_t i = num_hunks; i > 0; i--) {
+    reloadHunk *h = &hunks[i - 1];
+
+    registersChanging(h->old_start, h->old_len, h->new_len);
+    completeChanging(h->old_start, h->old_len, h->new_len);
+    diffChanging(h->old_start, h->old_len, h->new_len);
+    row *r = editorSpliceRows(h->old_start, h->old_len, h->new_len);
+
+    for (size_t j = 0; j < h->new_len; j++) {
+      diskLine *l = &lines[h->new_start - prefix + j];
+
+      abAppendN(&r[j].chars, l->s, l->len);
+      updateRow(&r[j]);
+    }
+
+    added += h->new_len;
+    removed += h->old_len;
+  }
+
+  E.buf->cy = cy < E.buf->num_rows
+                  ? cy
+                  : (E.buf->num_rows > 0 ? E.buf->num_rows - 1 : 0);
+  E.buf->row_offset = row_offset < E.buf->num_rows ? row_offset : E.buf->cy;
+
+  if (E.buf->cy < E.buf->num_rows) {
+    row *r = &E.buf->rows[E.buf->cy];
+
+    if (E.buf->cx > r->chars.len)
+      E.buf->cx = r->chars.len;
+    while (E.buf->cx > 0 && utf8IsContinuation(r->chars.buf[E.buf->cx]))
+      E.buf->cx--;
+  } else {
+    E.buf->cx = 0;
+  }
+
+  // The changes were to rows that may not be there anymore.
+  if (num_hunks > 0)
+    undoForget();
+
+  E.buf->file_stamp = fileStampOf(&st);
+  E.buf->file_stamp.size = size;
+  E.buf->dirty = 0;
+  watchFile(); // It may be another file now.
+
+  if (num_hunks > 0)
+    setStatusMessage("%s changed on disk: +%zu -%zu lines", E.buf->filename,
+                     added, removed);
+
+  free(hunks);
+  free(lines);
+  free(text);
+  rowTextDrop(E.buf); // The rows that were read first may all be gone.
+  traceEnd("editorReload", start);
+
+  return 1;
+}
+
+/// Reloads the file when its size, time or inode say it changed since it was
+/// loaded or saved. Unsaved changes are not thrown away.
+uint_fast8_t reloadCheck() {
+  struct stat st = {0};
+
+  // The rows of the file are still coming.
+  if (E.buf->loader) {
+    watchSchedule(WATCH_BATCH_MS);
+    return 0;
+  }
+
+  // Gone, wait for it to come back.
+  if (stat(E.buf->filename, &st) == -1 || !S_ISREG(st.st_mode))
+    return 0;
+
+  fileStamp stamp = fileStampOf(&st);
+  if (fileStampEqual(stamp, E.buf->file_stamp))
+    return 0;
+
+  if (E.buf->dirty) {
+    E.buf->file_stamp = stamp; // Tell only once.
+    setStatusMessage("%s changed on disk, the unsaved changes are kept",
+                     E.buf->filename);
+    return 1;
+  }
+
+  return editorReload();
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include "appendBuffer.c"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*** theme ***/
+
+typedef enum themeColor {
+  THEME_BACKGROUND,
+  THEME_TEXT,
+  THEME_NUMBER,
+  THEME_MATCH,
+  THEME_LINE_NUMBER,
+  THEME_CURRENT_LINE_NUMBER,
+  THEME_NORMAL_MODE,
+  THEME_INSERT_MODE,
+  THEME_DIFF_ADDED,
+  THEME_DIFF_CHANGED,
+  THEME_DIFF_REMOVED,
+  THEME_COLORS
+} themeColor;
+
+/// Colors the terminal is able to show.
+typedef enum colorDepth { COLORS_16, COLORS_256, COLORS_TRUE } colorDepth;
+
+/// Basic colors, for terminals without 256 colors. Add 8 for the bright ones.
+enum basicColor { BLACK, RED, GREEN, YELLOW, BLUE, MAGENTA, CYAN, WHITE };
+
+typedef struct themeEntry {
+  uint8_t r, g, b;
+  uint8_t basic;      // The closest of the 16 basic colors that stands out.
+  uint8_t background; // Sets the background instead of the foreground.
+} themeEntry;
+
+const themeEntry Palette[THEME_COLORS] = {
+    [THEME_BACKGROUND] = {38, 42, 51, BLACK, 1},              // Gray.
+    [THEME_TEXT] = {194, 179, 149, WHITE, 0},                 // Blueish.
+    [THEME_NUMBER] = {255, 165, 0, YELLOW, 0},                // Orange.
+    [THEME_MATCH] = {255, 165, 0, YELLOW, 0},                 // Orange.
+    [THEME_LINE_NUMBER] = {60, 65, 72, BLACK + 8, 0},         // Gray.
+    [THEME_CURRENT_LINE_NUMBER] = {150, 188, 100, GREEN, 0},  // Green.
+    [THEME_NORMAL_MODE] = {242, 198, 128, YELLOW, 0},         // Orange.
+    [THEME_INSERT_MODE] = {93, 198, 128, GREEN, 0},           // Green.
+    [THEME_DIFF_ADDED] = {150, 188, 100, GREEN, 0},           // Green.
+    [THEME_DIFF_CHANGED] = {242, 198, 128, YELLOW, 0},        // Orange.
+    [THEME_DIFF_REMOVED] = {224, 108, 117, RED, 0},           // Red.
+};
+
+/// The escape sequences of the palette, rendered once for the color depth of
+/// the terminal, and the colors it currently has set so unchanged ones are not
+/// sent again.
+struct theme {
+  colorDepth depth;
+  char sgr[THEME_COLORS][24];
+  uint8_t sgr_len[THEME_COLORS];
+  uint8_t same_as[THEME_COLORS]; // First color with the same escape sequence.
+  int_fast8_t fg; // Current colors, -1 if unknown.
+  int_fast8_t bg;
+};
+
+struct theme Theme = {.fg = -1, .bg = -1};
+
+/// Distance between two colors, good enough to pick the closest one.
+uint32_t colorDistance(int r1, int g1, int b1, int r2, int g2, int b2) {
+  return (r1 - r2) * (r1 - r2) + (g1 - g2) * (g1 - g2) + (b1 - b2) * (b1 - b2);
+}
+
+/// Closest color of the xterm 256 color palette, either from its 6x6x6 cube or
+/// from its gray ramp.
+uint8_t rgbTo256(uint8_t r, uint8_t g, uint8_t b) {
+  static const uint8_t levels[6] = {0, 95, 135, 175, 215, 255};
+  uint8_t ri = r < 48 ? 0 : r < 115 ? 1 : (r - 35) / 40;
+  uint8_t gi = g < 48 ? 0 : g < 115 ? 1 : (g - 35) / 40;
+  uint8_t bi = b < 48 ? 0 : b < 115 ? 1 : (b - 35) / 40;
+
+  int avg = (r + g + b) / 3;
+  int gray_idx = avg > 238 ? 23 : avg < 8 ? 0 : (avg - 8) / 10;
+  int gray = 8 + gray_idx * 10;
+
+  uint32_t cube_dist =
+      colorDistance(r, g, b, levels[ri], levels[gi], levels[bi]);
+  uint32_t gray_dist = colorDistance(r, g, b, gray, gray, gray);
+
+  if (gray_dist < cube_dist)
+    return 232 + gray_idx;
+
+  return 16 + 36 * ri + 6 * gi + bi;
+}
+
+/// Truecolor if `COLORTERM` says so, 256 colors if `TERM` does, 16 otherwise.
+/// `FIRE_COLORS` (16, 256 or true) overrides it.
+colorDepth themeDetectDepth() {
+  const char *forced = getenv("FIRE_COLORS");
+  const char *colorterm = getenv("COLORTERM");
+  const char *term = getenv("TERM");
+
+  if (forced && *forced)
+    return strcmp(forced, "16") == 0    ? COLORS_16
+           : strcmp(forced, "256") == 0 ? COLORS_256
+                                        : COLORS_TRUE;
+
+  if (colorterm &&
+      (strcmp(colorterm, "truecolor") == 0 || strcmp(colorterm, "24bit") == 0))
+    return COLORS_TRUE;
+
+  if (term && strstr(term, "256color"))
+    return COLORS_256;
+
+  return COLORS_16;
+}
+
+/// Renders the escape sequence of every color of the palette.
+void themeInit() {
+  Theme.depth = themeDetectDepth();
+
+  for (size_t i = 0; i < THEME_COLORS; i++) {
+    const themeEntry *c = &Palette[i];
+    int len = 0;
+
+    if (Theme.depth == COLORS_TRUE) {
+      len = snprintf(Theme.sgr[i], sizeof(Theme.sgr[i]), "\x1b[%d;2;%d;%d;%dm",
+                     c->background ? 48 : 38, c->r, c->g, c->b);
+    } else if (Theme.depth == COLORS_256) {
+      len = snprintf(Theme.sgr[i], sizeof(Theme.sgr[i]), "\x1b[%d;5;%dm",
+                     c->background ? 48 : 38, rgbTo256(c->r, c->g, c->b));
+    } else {
+      int code = c->basic < 8 ? 30 + c->basic : 90 + c->basic - 8;
+
+      len = snprintf(Theme.sgr[i], sizeof(Theme.sgr[i]), "\x1b[%dm",
+                     code + (c->background ? 10 : 0));
+    }
+
+    Theme.sgr_len[i] = len;
+    Theme.same_as[i] = i;
+
+    for (size_t j = 0; j < i; j++) {
+      if (strcmp(Theme.sgr[i], Theme.sgr[j]) == 0) {
+        Theme.same_as[i] = j;
+        break;
+      }
+    }
+  }
+
+  Theme.fg = Theme.bg = -1;
+}
+
+/// Forgets the colors set in the terminal, so the next ones are always sent.
+void themeForget() { Theme.fg = Theme.bg = -1; }
+
+/// Sets `color`, unless the terminal already has it.
+void themeSet(appendBuffer *ab, themeColor color) {
+  int_fast8_t *current = Palette[color].background ? &Theme.bg : &Theme.fg;
+
+  color = Theme.same_as[color];
+  if (*current == (int_fast8_t)color)
+    return;
+
+  *current = color;
+  abAppendN(ab, Theme.sgr[color], Theme.sgr_len[color]);
+}
+
+/// Resets every attribute of the terminal to its default.
+void themeResetAttributes(appendBuffer *ab) {
+  abAppendN(ab, "\x1b[m", 3);
+  themeForget();
+}
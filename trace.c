@@ -0,0 +1,107 @@
+#pragma once
+
+#include "base.c"
+#include "event.c"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+/*** tracing ***/
+
+/// Writes how long the main loop phases and the edit operations take, in the
+/// Chrome trace event format (load it in chrome://tracing or Perfetto). It is
+/// enabled by setting `FIRE_TRACE` to the path of the trace file, and costs a
+/// single branch per traced section otherwise.
+struct tracer {
+  FILE *fp; // Guarded by `lock`, the threads look at `enabled` instead.
+  atomic_bool enabled;
+  pthread_mutex_t lock;
+  uint64_t start;
+  pid_t main_tid;
+  uint_fast8_t has_events;
+};
+
+struct tracer Trace = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/// Whether tracing is enabled, from any thread.
+uint_fast8_t traceEnabled() {
+  return atomic_load_explicit(&Trace.enabled, memory_order_relaxed);
+}
+
+/// Returns the start time of a traced section, or 0 if tracing is disabled.
+uint64_t traceBegin() { return traceEnabled() ? nowNs() : 0; }
+
+/// Like `traceBegin`, but only on the main thread. For sections that run for
+/// every row, which would flood the trace when the loader threads run them.
+uint64_t traceBeginMain() {
+  return traceEnabled() && gettid() == Trace.main_tid ? nowNs() : 0;
+}
+
+void traceWrite(const char *event) {
+  pthread_mutex_lock(&Trace.lock);
+  if (Trace.fp) { // Other threads may still run while exiting.
+    fprintf(Trace.fp, "%s%s", Trace.has_events ? ",\n" : "", event);
+    Trace.has_events = 1;
+  }
+  pthread_mutex_unlock(&Trace.lock);
+}
+
+/// Records a section named `name` that started at `start`.
+void traceEnd(const char *name, uint64_t start) {
+  if (start == 0)
+    return;
+
+  char event[256] = {0};
+  uint64_t end = nowNs();
+
+  snprintf(event, sizeof(event),
+           "{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+           "\"pid\": %d, \"tid\": %d}",
+           name, (start - Trace.start) / 1e3, (end - start) / 1e3, getpid(),
+           gettid());
+  traceWrite(event);
+}
+
+/// Names the calling thread in the trace.
+void traceThreadName(const char *name) {
+  if (!traceEnabled())
+    return;
+
+  char event[256] = {0};
+
+  snprintf(event, sizeof(event),
+           "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, "
+           "\"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+           getpid(), gettid(), name);
+  traceWrite(event);
+}
+
+void traceClose() {
+  pthread_mutex_lock(&Trace.lock);
+  atomic_store(&Trace.enabled, 0);
+  fprintf(Trace.fp, "\n]\n");
+  fclose(Trace.fp);
+  Trace.fp = NULL;
+  pthread_mutex_unlock(&Trace.lock);
+}
+
+/// Starts tracing if `FIRE_TRACE` is set.
+void traceInit() {
+  const char *path = getenv("FIRE_TRACE");
+
+  if (path == NULL || *path == '\0')
+    return;
+
+  Trace.fp = fopen(path, "w");
+  if (!Trace.fp)
+    die("fopen");
+
+  setvbuf(Trace.fp, NULL, _IOFBF, 1 << 20);
+  fprintf(Trace.fp, "[\n");
+  Trace.start = nowNs();
+  Trace.main_tid = gettid();
+  atomic_store(&Trace.enabled, 1);
+  atexit(traceClose);
+
+  traceThreadName("main");
+}
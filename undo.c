@@ -0,0 +1,227 @@
+#pragma once
+
+#include "base.c"
+#include "complete.c"
+#include "register.c"
+#include <stdlib.h>
+#include <string.h>
+
+/*** undo ***/
+#define UNDO_MAX_CHANGES 1000 // The oldest ones are forgotten.
+
+/// Rows `at` to `at + len` took the place of `num_rows` rows, which are kept
+/// in `rows` to be put back. Their chars are borrowed from `text`, so keeping
+/// a lot of them takes a single copy.
+typedef struct undoChange {
+  size_t at;
+  size_t len;
+  row *rows;
+  size_t num_rows;
+  char *text;
+  textPos cursor;       // Where it was before the change.
+  uint_fast8_t chained; // Goes together with the change below it.
+} undoChange;
+
+typedef struct undoStack {
+  undoChange *changes;
+  size_t len;
+  size_t cap;
+  size_t groups; // Changes that are not chained, what `u` walks through.
+} undoStack;
+
+/// Changes that can be undone, and the undone ones that can be done again.
+/// Every edit goes through `undoRecord` before it touches the rows, and edits
+/// that follow it into the same rows, like typing in insert mode, join it
+/// until `undoBreak`.
+struct undoLog {
+  undoStack undo;
+  undoStack redo;
+  uint_fast8_t open;   // The last change takes in the next edits.
+  uint_fast8_t paused; // Edits are not changes, e.g. a followed file grows.
+  size_t grouping;     // Nested groups open, their changes are undone as one.
+  uint_fast8_t grouped; // The open group has a change already.
+  uint64_t recorded;    // Changes ever recorded, tells if a command edited.
+};
+
+struct undoLog *undoLog() {
+  if (E.buf->undo == NULL)
+    E.buf->undo = calloc(1, sizeof(struct undoLog));
+
+  return E.buf->undo;
+}
+
+void undoFreeChange(undoChange *c) {
+  free(c->rows);
+  free(c->text);
+}
+
+void undoClearStack(undoStack *s) {
+  for (size_t i = 0; i < s->len; i++)
+    undoFreeChange(&s->changes[i]);
+  s->len = 0;
+  s->groups = 0;
+}
+
+void undoPush(undoStack *s, undoChange c) {
+  if (!c.chained && s->groups++ == UNDO_MAX_CHANGES) {
+    // Forget the oldest group, with all the changes chained to it.
+    size_t drop = 1;
+    while (drop < s->len && s->changes[drop].chained)
+      drop++;
+
+    for (size_t i = 0; i < drop; i++)
+      undoFreeChange(&s->changes[i]);
+    memmove(&s->changes[0], &s->changes[drop],
+            sizeof(undoChange) * (s->len - drop));
+    s->len -= drop;
+    s->groups--;
+  }
+
+  if (s->len == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 16;
+    s->changes = realloc(s->changes, sizeof(undoChange) * s->cap);
+  }
+
+  s->changes[s->len++] = c;
+}
+
+/// A change that keeps a copy of `remove` rows from `at` on, which are going
+/// to be replaced with `insert` rows.
+undoChange undoSave(size_t at, size_t remove, size_t insert) {
+  undoChange c = {.at = at,
+                  .len = insert,
+                  .num_rows = remove,
+                  .cursor = {.y = E.buf->cy, .x = E.buf->cx}};
+
+  size_t size = 0;
+  for (size_t i = 0; i < remove; i++)
+    size += E.buf->rows[at + i].chars.len;
+
+  c.rows = malloc(sizeof(row) * (remove + 1));
+  c.text = malloc(size + 1);
+
+  for (size_t i = 0, used = 0; i < remove; i++) {
+    row *r = &E.buf->rows[at + i];
+
+    memcpy(&c.text[used], r->chars.buf, r->chars.len);
+    c.rows[i] = (row){.chars = abBorrow(&c.text[used], r->chars.len)};
+    used += r->chars.len;
+  }
+
+  return c;
+}
+
+/// Called before `remove` rows at `at` are replaced with `insert` rows.
+void undoRecord(size_t at, size_t remove, size_t insert) {
+  struct undoLog *u = undoLog();
+
+  if (!u->paused) {
+    undoClearStack(&u->redo);
+
+    // Inside the rows of the last change, they are part of it.
+    undoChange *last = u->undo.len ? &u->undo.changes[u->undo.len - 1] : NULL;
+    if (u->open && last && at >= last->at &&
+        at + remove <= last->at + last->len) {
+      last->len = last->len - remove + insert;
+    } else {
+      undoChange c = undoSave(at, remove, insert);
+      c.chained = u->grouping && u->grouped && u->undo.len > 0;
+      u->grouped = u->grouping != 0;
+      u->recorded++;
+
+      undoPush(&u->undo, c);
+      u->open = 1;
+    }
+  }
+
+  // Once the rows are saved, registers that share them may take them.
+  registersChanging(at, remove, insert);
+  completeChanging(at, remove, insert);
+  diffChanging(at, remove, insert);
+}
+
+/// The next edit is another change.
+void undoBreak() {
+  if (E.buf->undo)
+    E.buf->undo->open = 0;
+}
+
+void undoPause(uint_fast8_t paused) { undoLog()->paused = paused; }
+
+/// Changes recorded between `undoGroup(1)` and `undoGroup(0)` are undone and
+/// redone as one, like every edit of a macro. Groups can nest.
+void undoGroup(uint_fast8_t open) {
+  struct undoLog *u = undoLog();
+
+  if (open && u->grouping++ == 0)
+    u->grouped = 0;
+  else if (!open && u->grouping > 0)
+    u->grouping--;
+}
+
+/// Forgets every change, once the rows are not what they replaced anymore.
+void undoForget() {
+  if (E.buf->undo == NULL)
+    return;
+
+  undoClearStack(&E.buf->undo->undo);
+  undoClearStack(&E.buf->undo->redo);
+  E.buf->undo->open = 0;
+}
+
+/// Puts back the rows of the last group of changes of `from`, and keeps the
+/// ones they replace in `to`, in the reverse order. Returns whether there was
+/// one.
+uint_fast8_t undoApply(undoStack *from, undoStack *to) {
+  if (from->len == 0)
+    return 0;
+
+  uint_fast8_t chained = 0;
+  textPos cursor = {0};
+
+  do {
+    undoChange c = from->changes[--from->len];
+    undoChange back = undoSave(c.at, c.len, c.num_rows);
+
+    if (!c.chained)
+      from->groups--;
+    back.cursor = cursor = c.cursor;
+    back.chained = chained; // The last one undone is the first redone.
+    undoPush(to, back);
+    registersChanging(c.at, c.len, c.num_rows);
+    completeChanging(c.at, c.len, c.num_rows);
+    diffChanging(c.at, c.len, c.num_rows);
+
+    // The rows get chars of their own, they are edited from now on.
+    row *r = editorSpliceRows(c.at, c.len, c.num_rows);
+    for (size_t i = 0; i < c.num_rows; i++) {
+      abAppendN(&r[i].chars, c.rows[i].chars.buf, c.rows[i].chars.len);
+      updateRow(&r[i]);
+    }
+    undoFreeChange(&c);
+
+    chained = c.chained;
+  } while (chained && from->len > 0);
+
+  E.buf->cy = cursor.y;
+  E.buf->cx = cursor.x;
+  if (E.buf->cy >= E.buf->num_rows)
+    E.buf->cy = E.buf->num_rows > 0 ? E.buf->num_rows - 1 : 0;
+  if (E.buf->cy < E.buf->num_rows &&
+      E.buf->cx > E.buf->rows[E.buf->cy].chars.len)
+    E.buf->cx = E.buf->rows[E.buf->cy].chars.len;
+
+  E.buf->undo->open = 0;
+  E.buf->dirty = 1;
+  return 1;
+}
+
+void editorUndo() {
+  if (!undoApply(&undoLog()->undo, &undoLog()->redo))
+    setStatusMessage("Already at oldest change");
+}
+
+void editorRedo() {
+  if (!undoApply(&undoLog()->redo, &undoLog()->undo))
+    setStatusMessage("Already at newest change");
+}
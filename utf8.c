@@ -0,0 +1,229 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*** utf-8 ***/
+
+/// Code point shown in place of bytes that are not valid UTF-8.
+#define UTF8_REPLACEMENT 0xFFFD
+#define UTF8_REPLACEMENT_STR "\xEF\xBF\xBD"
+
+typedef uint64_t words32 __attribute__((vector_size(32)));
+
+/// Length of the ASCII prefix of `s`, checked 32 bytes at a time.
+size_t utf8AsciiPrefix(const char *s, size_t len) {
+  const uint64_t high_bits = 0x8080808080808080;
+  size_t i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    words32 w;
+    memcpy(&w, &s[i], sizeof(w));
+    w &= high_bits;
+
+    if (w[0] | w[1] | w[2] | w[3])
+      break;
+  }
+
+  for (; i + 8 <= len; i += 8) {
+    uint64_t w;
+    memcpy(&w, &s[i], sizeof(w));
+
+    if (w & high_bits)
+      break;
+  }
+
+  while (i < len && (unsigned char)s[i] < 0x80)
+    i++;
+
+  return i;
+}
+
+uint_fast8_t utf8IsContinuation(char c) {
+  return ((unsigned char)c & 0xC0) == 0x80;
+}
+
+/// Decodes the char at the start of `s` into `cp`, returns how many bytes it
+/// takes. Invalid bytes (overlong forms, surrogates, truncated sequences...)
+/// decode one by one into `UTF8_REPLACEMENT`.
+size_t utf8Decode(const char *str, size_t len, uint32_t *cp) {
+  const unsigned char *s = (const unsigned char *)str;
+  size_t n = 0;
+  uint32_t c = s[0];
+  uint32_t min = 0;
+
+  if (c < 0x80) {
+    *cp = c;
+    return 1;
+  } else if (c >= 0xC2 && c <= 0xDF) {
+    n = 2;
+    c &= 0x1F;
+    min = 0x80;
+  } else if (c >= 0xE0 && c <= 0xEF) {
+    n = 3;
+    c &= 0x0F;
+    min = 0x800;
+  } else if (c >= 0xF0 && c <= 0xF4) {
+    n = 4;
+    c &= 0x07;
+    min = 0x10000;
+  } else {
+    *cp = UTF8_REPLACEMENT;
+    return 1;
+  }
+
+  if (n > len) {
+    *cp = UTF8_REPLACEMENT;
+    return 1;
+  }
+
+  for (size_t i = 1; i < n; i++) {
+    if ((s[i] & 0xC0) != 0x80) {
+      *cp = UTF8_REPLACEMENT;
+      return 1;
+    }
+    c = c << 6 | (s[i] & 0x3F);
+  }
+
+  if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) {
+    *cp = UTF8_REPLACEMENT;
+    return 1;
+  }
+
+  *cp = c;
+  return n;
+}
+
+/// Bytes that a char starting with `c` should take, 1 for invalid ones.
+size_t utf8SequenceLength(unsigned char c) {
+  if (c >= 0xC2 && c <= 0xDF)
+    return 2;
+  if (c >= 0xE0 && c <= 0xEF)
+    return 3;
+  if (c >= 0xF0 && c <= 0xF4)
+    return 4;
+
+  return 1;
+}
+
+typedef struct codepointRange {
+  uint32_t first;
+  uint32_t last;
+} codepointRange;
+
+/// Combining marks and invisible format chars, they take no columns.
+const codepointRange ZeroWidth[] = {
+    {0x0300, 0x036F},   {0x0483, 0x0489},   {0x0591, 0x05BD},
+    {0x05BF, 0x05BF},   {0x05C1, 0x05C2},   {0x05C4, 0x05C5},
+    {0x05C7, 0x05C7},   {0x0610, 0x061A},   {0x064B, 0x065F},
+    {0x0670, 0x0670},   {0x06D6, 0x06DC},   {0x06DF, 0x06E4},
+    {0x06E7, 0x06E8},   {0x06EA, 0x06ED},   {0x0900, 0x0902},
+    {0x093A, 0x093A},   {0x093C, 0x093C},   {0x0941, 0x0948},
+    {0x094D, 0x094D},   {0x0951, 0x0957},   {0x0E31, 0x0E31},
+    {0x0E34, 0x0E3A},   {0x0E47, 0x0E4E},   {0x1AB0, 0x1AFF},
+    {0x1DC0, 0x1DFF},   {0x200B, 0x200F},   {0x202A, 0x202E},
+    {0x2060, 0x2064},   {0x20D0, 0x20FF},   {0x302A, 0x302D},
+    {0x3099, 0x309A},   {0xFE00, 0xFE0F},   {0xFE20, 0xFE2F},
+    {0xFEFF, 0xFEFF},   {0xE0001, 0xE007F}, {0xE0100, 0xE01EF},
+};
+
+/// East Asian wide and fullwidth chars and emoji, they take two columns.
+const codepointRange DoubleWidth[] = {
+    {0x1100, 0x115F},   {0x231A, 0x231B},   {0x2329, 0x232A},
+    {0x23E9, 0x23EC},   {0x23F0, 0x23F0},   {0x23F3, 0x23F3},
+    {0x25FD, 0x25FE},   {0x2614, 0x2615},   {0x2648, 0x2653},
+    {0x267F, 0x267F},   {0x2693, 0x2693},   {0x26A1, 0x26A1},
+    {0x26AA, 0x26AB},   {0x26BD, 0x26BE},   {0x26C4, 0x26C5},
+    {0x26CE, 0x26CE},   {0x26D4, 0x26D4},   {0x26EA, 0x26EA},
+    {0x26F2, 0x26F3},   {0x26F5, 0x26F5},   {0x26FA, 0x26FA},
+    {0x26FD, 0x26FD},   {0x2705, 0x2705},   {0x270A, 0x270B},
+    {0x2728, 0x2728},   {0x274C, 0x274C},   {0x274E, 0x274E},
+    {0x2753, 0x2755},   {0x2757, 0x2757},   {0x2795, 0x2797},
+    {0x27B0, 0x27B0},   {0x27BF, 0x27BF},   {0x2B1B, 0x2B1C},
+    {0x2B50, 0x2B50},   {0x2B55, 0x2B55},   {0x2E80, 0x303E},
+    {0x3041, 0x33FF},   {0x3400, 0x4DBF},   {0x4E00, 0x9FFF},
+    {0xA000, 0xA4CF},   {0xA960, 0xA97F},   {0xAC00, 0xD7A3},
+    {0xF900, 0xFAFF},   {0xFE10, 0xFE19},   {0xFE30, 0xFE6F},
+    {0xFF00, 0xFF60},   {0xFFE0, 0xFFE6},   {0x16FE0, 0x16FE4},
+    {0x17000, 0x18CFF}, {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004},
+    {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A},
+    {0x1F200, 0x1F251}, {0x1F300, 0x1F64F}, {0x1F680, 0x1F6FF},
+    {0x1F7E0, 0x1F7EB}, {0x1F90C, 0x1F9FF}, {0x1FA70, 0x1FAFF},
+    {0x20000, 0x3FFFD},
+};
+
+uint_fast8_t inRanges(uint32_t cp, const codepointRange *ranges, size_t n) {
+  size_t lo = 0;
+  size_t hi = n;
+
+  if (cp < ranges[0].first || cp > ranges[n - 1].last)
+    return 0;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (cp > ranges[mid].last)
+      lo = mid + 1;
+    else if (cp < ranges[mid].first)
+      hi = mid;
+    else
+      return 1;
+  }
+
+  return 0;
+}
+
+/// Columns a code point takes in the terminal.
+size_t codepointWidth(uint32_t cp) {
+  if (cp < 0x300)
+    return 1;
+
+  if (inRanges(cp, ZeroWidth, sizeof(ZeroWidth) / sizeof(ZeroWidth[0])))
+    return 0;
+
+  if (inRanges(cp, DoubleWidth, sizeof(DoubleWidth) / sizeof(DoubleWidth[0])))
+    return 2;
+
+  return 1;
+}
+
+/// Columns `len` bytes of text without tabs take in the terminal.
+size_t utf8Width(const char *s, size_t len) {
+  size_t cols = 0;
+  size_t i = 0;
+
+  while (i < len) {
+    size_t ascii = utf8AsciiPrefix(&s[i], len - i);
+    cols += ascii;
+    i += ascii;
+
+    if (i < len) {
+      uint32_t cp = 0;
+      i += utf8Decode(&s[i], len - i, &cp);
+      cols += codepointWidth(cp);
+    }
+  }
+
+  return cols;
+}
+
+/// How many bytes of `s` fit in `cols` columns, without splitting chars.
+size_t utf8FitColumns(const char *s, size_t len, size_t cols) {
+  size_t used = 0;
+  size_t i = 0;
+
+  while (i < len) {
+    uint32_t cp = 0;
+    size_t n = utf8Decode(&s[i], len - i, &cp);
+    size_t w = codepointWidth(cp);
+
+    if (used + w > cols)
+      break;
+
+    used += w;
+    i += n;
+  }
+
+  return i;
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "base.c"
+#include "event.c"
+#include <libgen.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+
+/*** file watching ***/
+#define WATCH_BATCH_MS 20 // Changes that arrive meanwhile, one check.
+
+/// Notices when the open file changes on disk. The file is watched with
+/// inotify, and so is its directory, for when another file is moved into its
+/// place, like editors and log rotation do.
+struct fileWatch {
+  int inotify_fd;
+  int file_watch; // -1 while the file is gone.
+  int dir_watch;
+  char *name; // Of the file, in its directory.
+  uint_fast8_t scheduled; // A check of the file is coming.
+};
+
+/// Watches again the file that has the name now.
+void watchFile() {
+  struct fileWatch *w = E.buf->watch;
+
+  if (w == NULL)
+    return;
+
+  if (w->file_watch != -1)
+    inotify_rm_watch(w->inotify_fd, w->file_watch);
+
+  w->file_watch = inotify_add_watch(w->inotify_fd, E.buf->filename,
+                                    IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+                                        IN_MOVE_SELF | IN_DELETE_SELF);
+}
+
+/// Looks at the file once the changes that came together are in. Followed
+/// files get what was appended, others what changed.
+uint_fast8_t watchCheck(int fd) {
+  (void)fd;
+
+  if (E.buf->watch == NULL)
+    return 0;
+  E.buf->watch->scheduled = 0;
+
+  return E.buf->follow ? followCheck() : reloadCheck();
+}
+
+/// Checks the file in `ms` milliseconds, unless a check is coming already.
+void watchSchedule(uint64_t ms) {
+  if (E.buf->watch == NULL || E.buf->watch->scheduled)
+    return;
+
+  E.buf->watch->scheduled = 1;
+  eventSetTimer(watchCheck, ms);
+}
+
+/// Collects the events of the file and its directory, and checks the file
+/// once a burst of them is over.
+uint_fast8_t watchEvents(int fd) {
+  struct fileWatch *w = E.buf->watch;
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  uint_fast8_t changed = 0;
+  ssize_t n = 0;
+
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + n;) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+
+      if (ev->wd == w->file_watch) {
+        if (ev->mask & IN_IGNORED)
+          w->file_watch = -1;
+        changed = 1;
+      } else if (ev->wd == w->dir_watch && ev->len > 0 &&
+                 strcmp(ev->name, w->name) == 0) {
+        changed = 1; // Created or moved into place.
+      }
+
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+
+  if (changed)
+    watchSchedule(WATCH_BATCH_MS);
+
+  return 0;
+}
+
+/// Starts watching the open file. Returns whether it is watched.
+uint_fast8_t watchStart() {
+  if (E.buf->watch)
+    return 1;
+  if (E.buf->filename == NULL || E.buf->pager)
+    return 0;
+
+  int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd == -1)
+    return 0;
+
+  struct fileWatch *w = calloc(1, sizeof(struct fileWatch));
+  w->inotify_fd = inotify_fd;
+  w->file_watch = -1;
+
+  char *path = strdup(E.buf->filename);
+  char *file = strdup(E.buf->filename);
+  w->name = strdup(basename(file));
+  w->dir_watch =
+      inotify_add_watch(inotify_fd, dirname(path), IN_CREATE | IN_MOVED_TO);
+  free(path);
+  free(file);
+
+  E.buf->watch = w;
+  watchFile();
+  eventWatch(inotify_fd, watchEvents);
+
+  return 1;
+}
@@ -0,0 +1,259 @@
+#pragma once
+
+#include "base.c"
+#include "utf8.c"
+#include <stdlib.h>
+#include <string.h>
+
+/*** word motions ***/
+
+/// Bitmaps a row keeps of where its words start and end, one bit per byte.
+/// Words are runs of keyword chars (letters, digits, `_` and anything not
+/// ASCII) or runs of other non-blank chars, WORDs are runs of non-blanks.
+enum wordBitmap {
+  WORD_STARTS = 0,
+  WORD_ENDS,
+  BIG_WORD_STARTS,
+  WORD_BITMAPS
+};
+
+typedef unsigned char bytes64 __attribute__((vector_size(64)));
+typedef signed char mask64 __attribute__((vector_size(64)));
+
+/// Packs the high bit of each byte of `w` into the low 8 bits.
+uint64_t wordPackBytes(uint64_t w) {
+  return (((w >> 7) & 0x0101010101010101) * 0x0102040810204080) >> 56;
+}
+
+/// Packs a mask of 64 bytes, all set or all clear, into 64 bits. It's taken
+/// by pointer, a vector this wide passed by value changes the ABI without
+/// AVX-512.
+uint64_t wordPackMask(const mask64 *m) {
+  uint64_t w[8];
+  uint64_t bits = 0;
+
+  memcpy(w, m, sizeof(w));
+  for (size_t i = 0; i < 8; i++)
+    bits |= wordPackBytes(w[i]) << (i * 8);
+
+  return bits;
+}
+
+/// Which of the 64 bytes from `s` are not blank, and which of those are
+/// keyword chars. The bytes past `len` are blanks.
+void wordClassify(const char *s, size_t len, uint64_t *non_blank,
+                  uint64_t *keyword) {
+  bytes64 b;
+
+  if (len >= 64) {
+    memcpy(&b, s, sizeof(b));
+  } else {
+    memset(&b, ' ', sizeof(b));
+    memcpy(&b, s, len);
+  }
+
+  bytes64 lower = b | 0x20;
+  mask64 blank = (b == ' ') | (b == '\t');
+  mask64 digit = (b >= '0') & (b <= '9');
+  mask64 letter = (lower >= 'a') & (lower <= 'z');
+  mask64 word = digit | letter | (b == '_') | (b >= 0x80);
+
+  *non_blank = ~wordPackMask(&blank);
+  *keyword = wordPackMask(&word);
+}
+
+/// Builds the bitmaps of the row, 64 bytes at a time. A word starts where a
+/// non-blank doesn't have the class of the byte before it, and ends where the
+/// byte after it is blank or starts another word.
+void wordBuild(row *r) {
+  const char *s = r->chars.buf;
+  size_t len = r->chars.len;
+  size_t n = (len + 63) / 64;
+  uint64_t *starts = malloc(sizeof(uint64_t) * n * WORD_BITMAPS);
+  uint64_t *ends = &starts[n * WORD_ENDS];
+  uint64_t *big_starts = &starts[n * BIG_WORD_STARTS];
+  uint64_t last_non_blank = 0;
+  uint64_t last_keyword = 0;
+  uint64_t last_other = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    uint64_t non_blank = 0;
+    uint64_t keyword = 0;
+
+    wordClassify(&s[i * 64], len - i * 64, &non_blank, &keyword);
+    uint64_t other = non_blank & ~keyword;
+
+    // Bit `j` of each `before` is the class of byte `j - 1`.
+    uint64_t keyword_before = keyword << 1 | last_keyword >> 63;
+    uint64_t other_before = other << 1 | last_other >> 63;
+    uint64_t non_blank_before = non_blank << 1 | last_non_blank >> 63;
+
+    starts[i] = (keyword & ~keyword_before) | (other & ~other_before);
+    big_starts[i] = non_blank & ~non_blank_before;
+    ends[i] = non_blank; // Finished below, once the next block is known.
+
+    last_keyword = keyword;
+    last_other = other;
+    last_non_blank = non_blank;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    uint64_t next_non_blank = ends[i] >> 1;
+    uint64_t next_starts = starts[i] >> 1;
+
+    if (i + 1 < n) {
+      next_non_blank |= ends[i + 1] << 63;
+      next_starts |= starts[i + 1] << 63;
+    }
+
+    // Keeps going into the next byte only if it is the same word.
+    ends[i] &= ~(next_non_blank & ~next_starts);
+  }
+
+  r->words = starts;
+}
+
+/// The bitmap `which` of the row, built the first time it is needed after
+/// the row changes. Empty rows have none.
+const uint64_t *rowWords(row *r, enum wordBitmap which) {
+  if (r->chars.len == 0)
+    return NULL;
+  if (r->words == NULL)
+    wordBuild(r);
+
+  return &r->words[(r->chars.len + 63) / 64 * which];
+}
+
+/// Forgets the bitmaps of a row that changed.
+void rowWordsFree(row *r) {
+  free(r->words);
+  r->words = NULL;
+}
+
+/// First bit set from `from` on, or `len` if there is none before it.
+size_t bitsNext(const uint64_t *bits, size_t from, size_t len) {
+  if (from >= len)
+    return len;
+
+  size_t n = (len + 63) / 64;
+  size_t i = from / 64;
+  uint64_t w = bits[i] & (~(uint64_t)0 << (from % 64));
+
+  while (w == 0) {
+    if (++i == n)
+      return len;
+    w = bits[i];
+  }
+
+  size_t at = i * 64 + __builtin_ctzll(w);
+  return at < len ? at : len;
+}
+
+/// Last bit set before `to`, or `SIZE_MAX` if there is none.
+size_t bitsPrev(const uint64_t *bits, size_t to) {
+  if (to == 0)
+    return SIZE_MAX;
+
+  size_t i = (to - 1) / 64;
+  uint64_t w = bits[i] & (~(uint64_t)0 >> (63 - (to - 1) % 64));
+
+  while (w == 0) {
+    if (i == 0)
+      return SIZE_MAX;
+    w = bits[--i];
+  }
+
+  return i * 64 + 63 - __builtin_clzll(w);
+}
+
+/// Start of the last char of the text, where motions stop at the end.
+textPos wordLastPos() {
+  row *r = &E.buf->rows[E.buf->num_rows - 1];
+  size_t x = r->chars.len;
+
+  while (x > 0 && utf8IsContinuation(r->chars.buf[--x]))
+    ;
+
+  return (textPos){.y = E.buf->num_rows - 1, .x = x};
+}
+
+/// Start of the next word (`w`) or WORD (`W`) after `p`. Empty lines count
+/// as words.
+textPos wordNextStart(textPos p, enum wordBitmap which) {
+  size_t x = editorRowNextChar(&E.buf->rows[p.y], p.x);
+
+  for (size_t y = p.y; y < E.buf->num_rows; y++, x = 0) {
+    row *r = &E.buf->rows[y];
+
+    if (r->chars.len == 0 && y != p.y)
+      return (textPos){.y = y, .x = 0};
+
+    x = bitsNext(rowWords(r, which), x, r->chars.len);
+    if (x < r->chars.len)
+      return (textPos){.y = y, .x = x};
+  }
+
+  return wordLastPos();
+}
+
+/// Start of the word (`b`) or WORD (`B`) before `p`.
+textPos wordPrevStart(textPos p, enum wordBitmap which) {
+  size_t to = p.x;
+
+  for (size_t y = p.y;; y--) {
+    row *r = &E.buf->rows[y];
+
+    if (r->chars.len == 0 && y != p.y)
+      return (textPos){.y = y, .x = 0};
+
+    size_t x =
+        bitsPrev(rowWords(r, which), to < r->chars.len ? to : r->chars.len);
+    if (x != SIZE_MAX)
+      return (textPos){.y = y, .x = x};
+    if (y == 0)
+      return (textPos){0};
+
+    to = SIZE_MAX;
+  }
+}
+
+/// End of the word after `p` (`e`), on the first byte of its last char.
+textPos wordNextEnd(textPos p) {
+  size_t x = editorRowNextChar(&E.buf->rows[p.y], p.x);
+
+  for (size_t y = p.y; y < E.buf->num_rows; y++, x = 0) {
+    row *r = &E.buf->rows[y];
+
+    x = bitsNext(rowWords(r, WORD_ENDS), x, r->chars.len);
+    if (x < r->chars.len) {
+      while (x > 0 && utf8IsContinuation(r->chars.buf[x]))
+        x--;
+      return (textPos){.y = y, .x = x};
+    }
+  }
+
+  return wordLastPos();
+}
+
+/// Where the word motion `key` (`w`, `W`, `b`, `B` or `e`) goes from `p`.
+textPos wordMotion(textPos p, uint64_t key) {
+  if (E.buf->num_rows == 0)
+    return p;
+  if (p.y >= E.buf->num_rows)
+    p = wordLastPos();
+
+  switch (key) {
+  case 'w':
+    return wordNextStart(p, WORD_STARTS);
+  case 'W':
+    return wordNextStart(p, BIG_WORD_STARTS);
+  case 'b':
+    return wordPrevStart(p, WORD_STARTS);
+  case 'B':
+    return wordPrevStart(p, BIG_WORD_STARTS);
+  case 'e':
+    return wordNextEnd(p);
+  }
+
+  return p;
+}
@@ -0,0 +1,269 @@
+#pragma once
+
+#include "base.c"
+#include <stdlib.h>
+#include <string.h>
+
+/*** soft wrap ***/
+
+/// How many visual lines each row takes when wrapped at `cols` columns, in a
+/// Fenwick tree so the visual line of a row, and the row of a visual line,
+/// are found in O(log n) steps.
+struct wrapIndex {
+  uint32_t *lines; // Visual lines of each row, 0 if not counted yet.
+  size_t *tree;    // Sums of `lines`, node i covers the rows up to i - 1.
+  size_t num_rows;
+  size_t cap;
+  size_t cols;
+
+  // Rows spliced in or edited since they were last counted.
+  size_t pending_from;
+  size_t pending_to;
+
+  size_t skip; // Visual lines of the row at `row_offset` above the screen.
+
+  // Screen position of the cursor.
+  size_t cursor_y;
+  size_t cursor_x;
+};
+
+/// End of the visual line that starts at byte `from` of the render of a row
+/// with wide chars. They are not cut at the end of a line but go to the next.
+size_t wrapLineEnd(row *r, size_t from, size_t cols) {
+  const char *s = &r->render.buf[from];
+  size_t len = r->render.len - from;
+  size_t fits = utf8FitColumns(s, len, cols);
+
+  // A wide char in a single column.
+  if (fits == 0 && len > 0) {
+    uint32_t cp = 0;
+    fits = utf8Decode(s, len, &cp);
+  }
+
+  return from + fits;
+}
+
+/// Visual lines of a row wrapped at `cols` columns, at least one. Long rows
+/// are wrapped at exact columns, a wide char cut at the end of a line is not
+/// shown.
+size_t wrapRowLines(row *r, size_t cols) {
+  rowLayout(r);
+
+  if (!(r->flags & ROW_WIDE) || rowIsLong(r))
+    return r->width > cols ? (r->width + cols - 1) / cols : 1;
+
+  size_t lines = 0;
+  size_t from = 0;
+
+  do {
+    from = wrapLineEnd(r, from, cols);
+    lines++;
+  } while (from < r->render.len);
+
+  return lines;
+}
+
+/// Visual line of the row and column in it of the render column `rx`.
+void wrapRowPos(row *r, size_t rx, size_t cols, size_t *line, size_t *col) {
+  rowLayout(r);
+
+  if (!(r->flags & ROW_WIDE) || rowIsLong(r)) {
+    *line = rx / cols;
+    *col = rx % cols;
+  } else {
+    size_t from = 0;
+    size_t start = 0; // Column the visual line starts at.
+
+    *line = 0;
+    while (from < r->render.len) {
+      size_t to = wrapLineEnd(r, from, cols);
+      size_t width = utf8Width(&r->render.buf[from], to - from);
+
+      if (rx < start + width || to == r->render.len)
+        break;
+
+      from = to;
+      start += width;
+      (*line)++;
+    }
+
+    *col = rx - start;
+  }
+
+  // The end of a row that fills its last line.
+  size_t lines = wrapRowLines(r, cols);
+  if (*line >= lines) {
+    *line = lines - 1;
+    *col = cols;
+  }
+  if (*col >= cols)
+    *col = cols - 1;
+}
+
+/// Visual lines of the rows before row `y`.
+size_t wrapPrefix(size_t y) {
+  size_t sum = 0;
+
+  for (size_t i = y; i > 0; i -= i & -i)
+    sum += E.buf->wrap->tree[i];
+
+  return sum;
+}
+
+/// Row of visual line `line`, and the visual lines of it before that one
+/// through `skip`. Lines past the end are in row `num_rows`.
+size_t wrapFind(size_t line, size_t *skip) {
+  struct wrapIndex *w = E.buf->wrap;
+  size_t y = 0;
+  size_t step = 1;
+
+  while (step * 2 <= w->num_rows)
+    step *= 2;
+
+  for (; step > 0; step /= 2) {
+    if (y + step <= w->num_rows && w->tree[y + step] <= line) {
+      y += step;
+      line -= w->tree[y];
+    }
+  }
+
+  *skip = line;
+  return y;
+}
+
+/// Builds again the nodes of the tree for the rows from `at` on. Nodes up to
+/// `at` only cover rows before it, so they stay.
+void wrapRebuildFrom(size_t at) {
+  struct wrapIndex *w = E.buf->wrap;
+  size_t n = w->num_rows;
+
+  for (size_t i = at + 1; i <= n; i++)
+    w->tree[i] = w->lines[i - 1];
+
+  // The nodes that add up to the rows before `at` go into ones after it.
+  for (size_t i = at; i > 0; i -= i & -i) {
+    size_t parent = i + (i & -i);
+    if (parent <= n)
+      w->tree[parent] += w->tree[i];
+  }
+
+  for (size_t i = at + 1; i <= n; i++) {
+    size_t parent = i + (i & -i);
+    if (parent <= n)
+      w->tree[parent] += w->tree[i];
+  }
+}
+
+void wrapSetLines(size_t y, size_t lines) {
+  struct wrapIndex *w = E.buf->wrap;
+  size_t delta = lines - w->lines[y]; // Wraps around when it shrinks.
+
+  w->lines[y] = lines;
+  for (size_t i = y + 1; i <= w->num_rows; i += i & -i)
+    w->tree[i] += delta;
+}
+
+/// Marks rows from `from` to `to` (exclusive) to be counted again.
+void wrapRowsChanged(size_t from, size_t to) {
+  struct wrapIndex *w = E.buf->wrap;
+
+  if (w == NULL || from >= to)
+    return;
+
+  if (w->pending_from >= w->pending_to) {
+    w->pending_from = from;
+    w->pending_to = to;
+  } else {
+    w->pending_from = from < w->pending_from ? from : w->pending_from;
+    w->pending_to = to > w->pending_to ? to : w->pending_to;
+  }
+}
+
+/// Counts the pending rows. A lot of them, like the ones appended while
+/// loading, are cheaper to count with the rest of the tree built again.
+void wrapCountPending() {
+  struct wrapIndex *w = E.buf->wrap;
+  size_t from = w->pending_from;
+  size_t to = w->pending_to < w->num_rows ? w->pending_to : w->num_rows;
+
+  // Not drawn yet, `wrapUpdate` counts them all once it is.
+  if (w->cols == 0)
+    return;
+
+  w->pending_from = w->pending_to = 0;
+  if (from >= to)
+    return;
+
+  if ((to - from) * 32 >= w->num_rows - from) {
+    for (size_t y = from; y < to; y++)
+      w->lines[y] = wrapRowLines(&E.buf->rows[y], w->cols);
+    wrapRebuildFrom(from);
+  } else {
+    for (size_t y = from; y < to; y++)
+      wrapSetLines(y, wrapRowLines(&E.buf->rows[y], w->cols));
+  }
+}
+
+/// Keeps the counts in step with `editorSpliceRows`, called before it
+/// replaces `remove` rows at `at` with `insert` new ones. The new rows are
+/// counted once they have their text, by `wrapUpdate`.
+void wrapSplice(size_t at, size_t remove, size_t insert) {
+  struct wrapIndex *w = E.buf->wrap;
+
+  if (w == NULL)
+    return;
+
+  // Rows from the last splice have their text by now.
+  wrapCountPending();
+
+  size_t num_rows = w->num_rows - remove + insert;
+  if (num_rows > w->cap) {
+    w->cap = num_rows > w->cap * 2 ? num_rows : w->cap * 2;
+    w->lines = realloc(w->lines, sizeof(uint32_t) * w->cap);
+    w->tree = realloc(w->tree, sizeof(size_t) * (w->cap + 1));
+  }
+
+  if (remove == insert) {
+    // The rows after them stay in place, so does the tree.
+    for (size_t y = at; y < at + insert; y++)
+      wrapSetLines(y, 0);
+  } else {
+    memmove(&w->lines[at + insert], &w->lines[at + remove],
+            sizeof(uint32_t) * (w->num_rows - at - remove));
+    memset(&w->lines[at], 0, sizeof(uint32_t) * insert);
+    w->num_rows = num_rows;
+    wrapRebuildFrom(at);
+  }
+
+  wrapRowsChanged(at, at + insert);
+}
+
+/// Counts every row again when the width of the text changes, and the rows
+/// that changed otherwise.
+void wrapUpdate(size_t cols) {
+  struct wrapIndex *w = E.buf->wrap;
+
+  if (w->cols != cols) {
+    w->cols = cols;
+    w->pending_from = 0;
+    w->pending_to = w->num_rows;
+  }
+
+  wrapCountPending();
+}
+
+void wrapToggle() {
+  if (E.buf->wrap) {
+    free(E.buf->wrap->lines);
+    free(E.buf->wrap->tree);
+    free(E.buf->wrap);
+    E.buf->wrap = NULL;
+    return;
+  }
+
+  struct wrapIndex *w = calloc(1, sizeof(struct wrapIndex));
+  w->num_rows = w->cap = E.buf->num_rows;
+  w->lines = calloc(w->cap + 1, sizeof(uint32_t));
+  w->tree = calloc(w->cap + 1, sizeof(size_t));
+  E.buf->wrap = w;
+}